@@ -20,46 +20,132 @@
 #include <config.h>
 #include "Cache.h"
 
+void Cache::Link(CacheEntry *e)
+{
+   e->prev=0;
+   e->next=chain;
+   if(chain)
+      chain->prev=e;
+   else
+      tail=e;
+   chain=e;
+}
+void Cache::Unlink(CacheEntry *e)
+{
+   if(e->prev)
+      e->prev->next=e->next;
+   else
+      chain=e->next;
+   if(e->next)
+      e->next->prev=e->prev;
+   else
+      tail=e->prev;
+   e->next=e->prev=0;
+}
+void Cache::Remove(CacheEntry *e)
+{
+   if(curr==e)
+      curr=e->next;
+   Unlink(e);
+   CacheEntry **scan=&hash_table[e->hash&(hash_table.count()-1)];
+   while(*scan!=e)
+      scan=&scan[0]->hash_next;
+   *scan=e->hash_next;
+   entry_count--;
+   total_size-=e->size;
+}
+void Cache::RebuildHash(int new_size)
+{
+   hash_table.get_space(new_size);
+   hash_table.set_length(new_size);
+   for(int i=0; i<new_size; i++)
+      hash_table[i]=0;
+   for(CacheEntry *e=chain; e; e=e->next)
+   {
+      CacheEntry **bucket=&hash_table[e->hash&(new_size-1)];
+      e->hash_next=*bucket;
+      *bucket=e;
+   }
+}
+void Cache::AddCacheEntry(CacheEntry *e,unsigned h)
+{
+   e->hash=h;
+   e->size=e->EstimateSize();
+   Link(e);
+   entry_count++;
+   total_size+=e->size;
+   if(entry_count>hash_table.count()*2)
+   {
+      // the new entry is already in the LRU list, so it gets hashed too
+      RebuildHash(hash_table.count()?hash_table.count()*4:64);
+      return;
+   }
+   CacheEntry **bucket=&hash_table[h&(hash_table.count()-1)];
+   e->hash_next=*bucket;
+   *bucket=e;
+}
+CacheEntry *Cache::HashFirst(unsigned h) const
+{
+   if(!hash_table.count())
+      return 0;
+   for(CacheEntry *e=hash_table[h&(hash_table.count()-1)]; e; e=e->hash_next)
+      if(e->hash==h)
+	 return e;
+   return 0;
+}
+void Cache::Touch(CacheEntry *e)
+{
+   if(chain==e)
+      return;
+   Unlink(e);
+   Link(e);
+}
+void Cache::Resized(CacheEntry *e)
+{
+   long new_size=e->EstimateSize();
+   total_size+=new_size-e->size;
+   e->size=new_size;
+}
+
 void Cache::Trim()
 {
    long sizelimit=res_max_size->Query(0);
 
-   long size=0;
-   CacheEntry **scan=&chain;
-   while(scan[0])
-   {
-      if(scan[0]->Stopped())
-	 delete replace_value(scan[0],scan[0]->next);
-      else
-      {
-	 size+=scan[0]->EstimateSize();
-	 scan=&scan[0]->next;
-      }
-   }
-// printf("Cache::Trim size=%ld, limit=%ld\n",size,sizelimit);
-   while(chain && size>sizelimit)
+   // drop expired entries from the cold end first, then the least
+   // recently used ones until the cache fits into the limit.
+   while(tail && tail->Stopped())
+      Delete(tail);
+   while(tail && total_size>sizelimit)
+      Delete(tail);
+}
+void Cache::Expire()
+{
+   CacheEntry *e=chain;
+   while(e)
    {
-      size-=chain->EstimateSize();
-      delete replace_value(chain,chain->next);
+      CacheEntry *next=e->next;
+      if(e->Stopped())
+	 Delete(e);
+      e=next;
    }
 }
 void Cache::Flush()
 {
    while(chain)
-      delete replace_value(chain,chain->next);
+      Delete(chain);
 }
 CacheEntry *Cache::IterateFirst()
 {
-   curr=&chain;
-   return *curr;
+   curr=chain;
+   return curr;
 }
 CacheEntry *Cache::IterateNext()
 {
-   curr=&curr[0]->next;
-   return *curr;
+   curr=curr->next;
+   return curr;
 }
 CacheEntry *Cache::IterateDelete()
 {
-   delete replace_value(curr[0],curr[0]->next);
-   return *curr;
+   Delete(curr); // advances curr
+   return curr;
 }
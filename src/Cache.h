@@ -21,13 +21,18 @@
 #define CACHE_H
 
 #include "Timer.h"
+#include "xarray.h"
 
 class CacheEntry : public Timer
 {
    friend class Cache;
-   CacheEntry *next;
+   CacheEntry *next;	   // LRU list, most recently used first
+   CacheEntry *prev;
+   CacheEntry *hash_next;  // hash bucket chain
+   unsigned hash;
+   long size;		   // EstimateSize() at the time of last accounting
 public:
-   CacheEntry() { next=0; }
+   CacheEntry() { next=prev=hash_next=0; hash=0; size=0; }
    virtual int EstimateSize() const { return 1; }
    virtual ~CacheEntry() {}
 };
@@ -35,28 +40,52 @@ class Cache
 {
    const ResType *res_max_size;
    const ResType *res_enable;
+
+   CacheEntry *tail;
+   xarray<CacheEntry*> hash_table;
+   int entry_count;
+   long total_size;
+
+   void Link(CacheEntry *e);
+   void Unlink(CacheEntry *e);
+   void Remove(CacheEntry *e);
+   void RebuildHash(int new_size);
 protected:
    CacheEntry *chain;
-   CacheEntry **curr;
+   CacheEntry *curr;
    CacheEntry *IterateFirst();
    CacheEntry *IterateNext();
    CacheEntry *IterateDelete();
+
+   CacheEntry *HashFirst(unsigned h) const;
+   static CacheEntry *HashNext(const CacheEntry *e) {
+      unsigned h=e->hash;
+      for(e=e->hash_next; e; e=e->hash_next)
+	 if(e->hash==h)
+	    return const_cast<CacheEntry*>(e);
+      return 0;
+   }
+   void Touch(CacheEntry *e);
+   void Resized(CacheEntry *e);
+   void Delete(CacheEntry *e) { Remove(e); delete e; }
 public:
    void Trim();
+   void Expire();
    void Flush();
    Cache(const ResType *s,const ResType *e) {
       res_max_size=s;
       res_enable=e;
-      chain=0;
+      chain=tail=0;
       curr=0;
+      entry_count=0;
+      total_size=0;
    }
    ~Cache() { Flush(); }
    bool IsEnabled(const char *closure) { return res_enable->QueryBool(closure); }
    long SizeLimit() { return res_max_size->Query(0); }
-   void AddCacheEntry(CacheEntry *e) {
-      e->next=chain;
-      chain=e;
-   }
+   long TotalSize() const { return total_size; }
+   int Count() const { return entry_count; }
+   void AddCacheEntry(CacheEntry *e,unsigned h);
 };
 
 #endif//CACHE_H
@@ -0,0 +1,252 @@
+/*
+ * lftp - file transfer program
+ *
+ * Copyright (c) 1996-2017 by Alexander V. Lukyanov (lav@yars.free.net)
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <config.h>
+#include <string.h>
+#include <math.h>
+#include "DeltaSum.h"
+#include "lftp_sha1.h"
+
+enum {
+   MIN_BLOCK_SIZE=700,
+   MAX_BLOCK_SIZE=0x20000,
+   MAX_LITERAL=0x10000,
+};
+
+/* Same as rsync: the square root of the basis size, so that both the
+ * signature and the delta for a small change grow slowly. */
+int DeltaSignature::BlockSizeFor(off_t basis_size)
+{
+   if(basis_size<=(off_t)MIN_BLOCK_SIZE*MIN_BLOCK_SIZE)
+      return MIN_BLOCK_SIZE;
+   double r=sqrt((double)basis_size);
+   if(r>=MAX_BLOCK_SIZE)
+      return MAX_BLOCK_SIZE;
+   return (int)r&~7;
+}
+
+void DeltaSignature::Strong(const char *data,int len,unsigned char *out)
+{
+   unsigned char digest[20];
+   lftp_sha1_buffer(data,len,digest);
+   memcpy(out,digest,STRONG_LEN);
+}
+
+void DeltaSignature::AddBlock(const char *data,int len)
+{
+   if(len<block_size)
+      return;
+   RollSum r;
+   r.Init(data,block_size);
+   Block b={r.Digest(),blocks.count()};
+   blocks.append(b);
+   strong.get_space(strong.count()+STRONG_LEN);
+   Strong(data,block_size,strong.get_non_const()+strong.count());
+   strong.set_length(strong.count()+STRONG_LEN);
+   indexed=false;
+}
+
+int DeltaSignature::cmp_block(const Block *a,const Block *b)
+{
+   if(a->weak!=b->weak)
+      return a->weak<b->weak ? -1 : 1;
+   return a->index-b->index;
+}
+
+void DeltaSignature::Index()
+{
+   blocks.qsort(cmp_block);
+   unsigned bits=64;
+   while(bits<(unsigned)blocks.count()*8 && bits<(1U<<30))
+      bits*=2;
+   filter_mask=bits-1;
+   filter.get_space(bits/8);
+   filter.set_length(bits/8);
+   memset(filter.get_non_const(),0,bits/8);
+   for(int i=0; i<blocks.count(); i++)
+   {
+      unsigned h=Hash(blocks[i].weak)&filter_mask;
+      filter[h>>3]|=1<<(h&7);
+   }
+   indexed=true;
+}
+
+int DeltaSignature::Find(unsigned weak,const char *data,off_t min_pos) const
+{
+   if(!indexed || blocks.count()==0)
+      return -1;
+   unsigned h=Hash(weak)&filter_mask;
+   if(!(filter[h>>3]&(1<<(h&7))))
+      return -1;
+
+   // the first block with this weak sum at min_pos or later
+   off_t min_index=(min_pos+block_size-1)/block_size;
+   int lo=0,hi=blocks.count();
+   while(lo<hi)
+   {
+      int mid=(lo+hi)/2;
+      const Block& b=blocks[mid];
+      if(b.weak<weak || (b.weak==weak && b.index<min_index))
+	 lo=mid+1;
+      else
+	 hi=mid;
+   }
+   unsigned char s[STRONG_LEN];
+   bool have_strong=false;
+   for(int i=lo; i<blocks.count() && blocks[i].weak==weak; i++)
+   {
+      if(!have_strong)
+      {
+	 Strong(data,block_size,s);
+	 have_strong=true;
+      }
+      int index=blocks[i].index;
+      if(!memcmp(s,strong.get()+index*STRONG_LEN,STRONG_LEN))
+	 return index;
+   }
+   return -1;
+}
+
+static void append_be32(xstring& out,unsigned n)
+{
+   char b[4]={char(n>>24),char(n>>16),char(n>>8),char(n)};
+   out.append(b,4);
+}
+static unsigned get_be32(const char *p)
+{
+   const unsigned char *b=(const unsigned char*)p;
+   return (b[0]<<24)|(b[1]<<16)|(b[2]<<8)|b[3];
+}
+
+DeltaEncoder::DeltaEncoder(const DeltaSignature *s)
+   : sig(s), bs(s->GetBlockSize()), lit(0), scan(0), out_pos(0),
+     roll_valid(false), started(false), copy_index(0), copy_count(0)
+{
+}
+
+void DeltaEncoder::FlushCopy(xstring& out)
+{
+   if(copy_count==0)
+      return;
+   out.append('C');
+   append_be32(out,copy_index);
+   append_be32(out,copy_count);
+   copy_count=0;
+}
+void DeltaEncoder::EmitLiteral(xstring& out,int len)
+{
+   if(len==0)
+      return;
+   FlushCopy(out);
+   out.append('L');
+   append_be32(out,len);
+   out.append(data.get()+lit,len);
+   lit+=len;
+   out_pos+=len;
+}
+
+void DeltaEncoder::Put(const char *buf,int len,xstring& out)
+{
+   if(!started)
+   {
+      out.append('B');
+      append_be32(out,bs);
+      started=true;
+   }
+   data.append(buf,len);
+   for(;;)
+   {
+      int avail=data.length()-scan;
+      if(avail<bs)
+	 break;
+      if(!roll_valid)
+      {
+	 roll.Init(data.get()+scan,bs);
+	 roll_valid=true;
+      }
+      off_t pos=out_pos+(scan-lit);
+      int index=sig->Find(roll.Digest(),data.get()+scan,pos);
+      if(index>=0)
+      {
+	 EmitLiteral(out,scan-lit);
+	 if(copy_count>0 && index==copy_index+copy_count)
+	    copy_count++;
+	 else
+	 {
+	    FlushCopy(out);
+	    copy_index=index;
+	    copy_count=1;
+	 }
+	 scan+=bs;
+	 lit=scan;
+	 out_pos+=bs;
+	 roll_valid=false;
+	 continue;
+      }
+      if(avail==bs)
+	 break;	 // need the next byte to roll
+      roll.Rotate(data[scan],data[scan+bs]);
+      scan++;
+      if(scan-lit>=MAX_LITERAL)
+	 EmitLiteral(out,scan-lit);
+   }
+   if(lit>=MAX_LITERAL || (lit>0 && lit==(int)data.length()))
+   {
+      memmove(data.get_non_const(),data.get()+lit,data.length()-lit);
+      data.truncate(data.length()-lit);
+      scan-=lit;
+      lit=0;
+   }
+}
+
+void DeltaEncoder::PutEOF(xstring& out)
+{
+   Put("",0,out);
+   while((int)data.length()>lit)
+   {
+      int len=data.length()-lit;
+      EmitLiteral(out,len<MAX_LITERAL?len:MAX_LITERAL);
+   }
+   FlushCopy(out);
+   data.truncate();
+   lit=scan=0;
+}
+
+int DeltaParse(const char *buf,int len,char *cmd,unsigned *a,unsigned *b)
+{
+   if(len<1)
+      return 0;
+   *cmd=buf[0];
+   switch(buf[0])
+   {
+   case 'B':
+   case 'L':
+      if(len<5)
+	 return 0;
+      *a=get_be32(buf+1);
+      return 5;
+   case 'C':
+      if(len<9)
+	 return 0;
+      *a=get_be32(buf+1);
+      *b=get_be32(buf+5);
+      return 9;
+   }
+   return -1;
+}
@@ -0,0 +1,129 @@
+/*
+ * lftp - file transfer program
+ *
+ * Copyright (c) 1996-2017 by Alexander V. Lukyanov (lav@yars.free.net)
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef DELTASUM_H
+#define DELTASUM_H
+
+#include <sys/types.h>
+#include "xarray.h"
+#include "xstring.h"
+
+/* Delta transfer in the style of rsync. A signature of the old copy of a
+ * file (the basis) has a rolling checksum and a strong checksum of every
+ * block. The new data are searched for the blocks at every offset, the
+ * rolling checksum makes it cheap to skip most offsets. The result is a
+ * delta, a byte stream of commands
+ *    'B' <block_size:4>	 starts the delta
+ *    'C' <index:4> <count:4>	 copy count basis blocks starting at index
+ *    'L' <length:4> <data>	 literal data
+ * with big-endian numbers. The delta is meant to be applied in place: a
+ * block is referenced only if it has not been overwritten by the time it is
+ * copied, and a block copied to the same offset needs no writing at all. */
+
+class RollSum
+{
+   unsigned a,b,count;
+public:
+   enum { CHAR_OFFSET=31 };
+   void Init(const char *p,unsigned len)
+      {
+	 a=b=0;
+	 count=len;
+	 const unsigned char *s=(const unsigned char*)p;
+	 for(unsigned i=0; i<len; i++)
+	 {
+	    a+=s[i]+CHAR_OFFSET;
+	    b+=a;
+	 }
+      }
+   void Rotate(unsigned char out,unsigned char in)
+      {
+	 a+=in-out;
+	 b+=a-count*(out+CHAR_OFFSET);
+      }
+   unsigned Digest() const { return (b<<16)|(a&0xffff); }
+};
+
+class DeltaSignature
+{
+   enum { STRONG_LEN=8 };
+   struct Block
+   {
+      unsigned weak;
+      int index;
+   };
+   int block_size;
+   xarray<Block> blocks;	   // sorted by the weak sum when indexed
+   xarray<unsigned char> strong;   // STRONG_LEN bytes per block, by index
+   xarray<unsigned char> filter;   // a bit per hashed weak sum
+   unsigned filter_mask;
+   bool indexed;
+
+   static void Strong(const char *data,int len,unsigned char *out);
+   static unsigned Hash(unsigned weak) { return weak^(weak>>15); }
+   static int cmp_block(const Block *a,const Block *b);
+
+public:
+   DeltaSignature(int bs) : block_size(bs), filter_mask(0), indexed(false) {}
+
+   static int BlockSizeFor(off_t basis_size);
+   int GetBlockSize() const { return block_size; }
+   int Count() const { return blocks.count(); }
+
+   // blocks have to be added in order; a short last block is ignored.
+   void AddBlock(const char *data,int len);
+   void Index();
+
+   // Finds a block with given data at basis offset min_pos or later,
+   // preferring the block at min_pos. Returns the block index or -1.
+   int Find(unsigned weak,const char *data,off_t min_pos) const;
+};
+
+class DeltaEncoder
+{
+   const DeltaSignature *sig;
+   int bs;
+   xstring data;	 // unprocessed new data
+   int lit;		 // start of pending literal data
+   int scan;		 // start of the window
+   off_t out_pos;	 // target offset of data[lit]
+   RollSum roll;
+   bool roll_valid;
+   bool started;
+   int copy_index,copy_count;
+
+   void FlushCopy(xstring& out);
+   void EmitLiteral(xstring& out,int len);
+
+public:
+   DeltaEncoder(const DeltaSignature *s);
+
+   // consumes new data and appends delta commands to out.
+   void Put(const char *buf,int len,xstring& out);
+   void PutEOF(xstring& out);
+
+   off_t GetPos() const { return out_pos+(data.length()-lit); }
+};
+
+/* Parses the delta command at buf. Returns its header length and sets
+ * cmd, a and b; returns 0 if the header is incomplete and -1 on bad data.
+ * The literal data are not included in the header length. */
+int DeltaParse(const char *buf,int len,char *cmd,unsigned *a,unsigned *b);
+
+#endif//DELTASUM_H
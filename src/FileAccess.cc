@@ -1074,6 +1074,7 @@ void FileAccess::ClassCleanup()
    delete cache;
    cache=0;
    FileCopy::fxp_create=0;
+   BufferPool::ClassCleanup();
 }
 
 const FileAccessRef& FileAccessRef::operator=(FileAccess *p)
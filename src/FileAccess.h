@@ -246,6 +246,16 @@ public:
 
    virtual int Read(Buffer *buf,int size) = 0;
    virtual int Write(const void *buf,int size) = 0;
+   // Zero-copy transfer of a local file. WriteFromFile is like Write, but
+   // the data are sent directly from the regular file fd at offset at;
+   // NOT_SUPP means Write has to be used. GetLocalFile returns the file
+   // being retrieved (with the offset and size of unread data), if any.
+   virtual int WriteFromFile(int fd,off_t at,int size) { return NOT_SUPP; }
+   // ReadToFile is like Read, but moves the data to the regular file fd at
+   // offset at (by splice); NOT_SUPP means Read has to be used.
+   virtual int ReadToFile(int fd,off_t at,int size) { return NOT_SUPP; }
+   virtual int GetLocalFile(off_t *at,off_t *avail) { return -1; }
+   virtual void SkipLocalFile(int len) {}
    virtual int Buffered();
    virtual int StoreStatus() = 0;
    virtual bool IOReady();
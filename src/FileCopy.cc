@@ -52,6 +52,7 @@ ResDecl rate_period  ("xfer:rate-period","15", ResMgr::UNumberValidate,ResMgr::N
 ResDecl eta_period   ("xfer:eta-period", "120",ResMgr::UNumberValidate,ResMgr::NoClosure);
 ResDecl max_redir    ("xfer:max-redirections", "5",ResMgr::UNumberValidate,ResMgr::NoClosure);
 ResDecl buffer_size  ("xfer:buffer-size","0x10000",ResMgr::UNumberValidate,ResMgr::NoClosure);
+ResDecl use_sendfile ("xfer:use-sendfile","yes",ResMgr::BoolValidate,ResMgr::NoClosure);
 
 // It's bad when lftp receives data in small chunks, try to accumulate
 // data in a kernel buffer using a delay and slurp it at once:
@@ -193,7 +194,8 @@ int FileCopy::Do()
 	 get->Suspend();
 	 return m;
       }
-      get->Resume();
+      if(!sending_file)
+	 get->Resume();
       if(fail_if_cannot_seek && (get->GetRealPos()<get->range_start
 			      || put->GetRealPos()<put->range_start
 			      || get->GetRealPos()!=put->GetRealPos()))
@@ -270,6 +272,31 @@ int FileCopy::Do()
 	    return MOVED;
 	 }
       }
+      s=CopyFromFile();
+      if(s<0)
+	 s=CopyToFile();
+      if(s>=0)
+      {
+	 if(s==0)
+	    return m;
+	 bytes_count+=s;
+	 rate_add=put_buf;
+	 put_buf=put->Buffered();
+	 rate_add-=put_buf-s;
+	 RateAdd(rate_add);
+	 if(high_watermark<put_pos+s)
+	 {
+	    high_watermark=put_pos+s;
+	    high_watermark_timeout.Reset();
+	 }
+	 if(get->range_limit!=FILE_END && get->range_limit<=get->GetRealPos())
+	 {
+	    debug((10,"copy: get reached range limit\n"));
+	    goto eof;
+	 }
+	 return MOVED;
+      }
+
       if(put->IsFull())
 	 get->Suspend(); // stall the get.
       get->Get(&b,&s);
@@ -457,6 +484,10 @@ FileCopy::FileCopy(FileCopyPeer *s,FileCopyPeer *d,bool c)
    remove_source_later=false;
    remove_target_first=false;
    line_buffer_max=0;
+   copy_from_file=use_sendfile.QueryBool(0);
+   sending_file=false;
+   copy_to_file=copy_from_file;
+   receiving_file=false;
 }
 FileCopy::~FileCopy()
 {
@@ -470,6 +501,102 @@ FileCopy *FileCopy::New(FileCopyPeer *s,FileCopyPeer *d,bool c)
       return res;
    return new FileCopy(s,d,c);
 }
+
+// Sends the local source file straight to the destination (e.g. using
+// sendfile on a data socket). Returns number of bytes sent, 0 when it has
+// to wait, -1 when the usual buffered copy has to be done.
+int FileCopy::CopyFromFile()
+{
+   if(!copy_from_file || line_buffer)
+      return -1;
+   off_t at,avail;
+   int fd=get->GetLocalFile(&at,&avail);
+   if(fd==-1 || avail<=0)  // let get handle eof and errors.
+      goto buffered;
+   if(!sending_file)
+   {
+      // don't read more data, only the buffered data have to be copied.
+      get->Suspend();
+      sending_file=true;
+   }
+   if(get->Size()>0)
+      return -1;
+   if(put->Size()>0)
+      return 0;
+   if(get->range_limit!=FILE_END && avail>get->range_limit-get->GetRealPos())
+      avail=get->range_limit-get->GetRealPos();
+   if(avail<=0)
+      goto buffered;
+   {
+      int res=put->PutFromFile(fd,at,avail<0x40000000?avail:0x40000000);
+      if(res<0)
+      {
+	 debug((10,"copy: cannot send the file directly\n"));
+	 copy_from_file=false;
+	 goto buffered;
+      }
+      if(res>0)
+	 get->SkipLocalFile(res);
+      return res;
+   }
+buffered:
+   if(sending_file)
+   {
+      get->Resume();
+      sending_file=false;
+   }
+   return -1;
+}
+
+// Receives data straight into the local target file (e.g. using splice
+// from a data socket). Same return values as CopyFromFile.
+int FileCopy::CopyToFile()
+{
+   if(!copy_to_file || line_buffer)
+      return -1;
+   off_t at,avail;
+   int fd=put->GetLocalFile(&at,&avail);
+   if(fd==-1)
+      goto buffered;
+   if(!receiving_file)
+   {
+      if(!get->StartGetToFile())
+      {
+	 copy_to_file=false;
+	 return -1;
+      }
+      receiving_file=true;
+   }
+   if(get->Size()>0)
+      return -1;  // copy the data buffered before the usual way.
+   if(put->Size()>0)
+      return 0;
+   {
+      off_t len=0x40000000;
+      if(get->range_limit!=FILE_END && len>get->range_limit-get->GetRealPos())
+	 len=get->range_limit-get->GetRealPos();
+      if(len<=0)
+	 goto buffered;
+      int res=get->GetToFile(fd,at,len);
+      if(res<0)
+      {
+	 debug((10,"copy: stopped receiving the file directly\n"));
+	 copy_to_file=false;
+	 goto buffered;
+      }
+      if(res>0)
+	 put->SkipLocalFile(res);
+      return res;
+   }
+buffered:
+   if(receiving_file)
+   {
+      get->StopGetToFile();
+      receiving_file=false;
+   }
+   return -1;
+}
+
 void FileCopy::SuspendInternal()
 {
    super::SuspendInternal();
@@ -810,6 +937,7 @@ const char *FileCopyPeer::UseTempFile(const char *file)
 
 FileCopyPeer::FileCopyPeer(dir_t m) : IOBuffer(m)
 {
+   SetPoolLimited();
    want_size=false;
    want_date=false;
    start_transfer=true;
@@ -1155,6 +1283,9 @@ void FileCopyPeerFA::RemoveFile()
 
 int FileCopyPeerFA::Get_LL(int len)
 {
+   if(get_to_file)
+      return 0;
+
    if(get_delay>0)
    {
       if(!get_ll_timer.Stopped())
@@ -1276,19 +1407,17 @@ int FileCopyPeerFA::Get_LL(int len)
    return res;
 }
 
-int FileCopyPeerFA::Put_LL(const char *buf,int len)
+bool FileCopyPeerFA::PutReady()
 {
    if(session->IsClosed())
       OpenSession();
 
    off_t io_at=pos; // GetRealPos can alter pos, save it.
-   if(GetRealPos()!=io_at)
-      return 0;
-
-   if(len==0 && eof)
-      return 0;
+   return GetRealPos()==io_at;
+}
 
-   int res=session->Write(buf,len);
+int FileCopyPeerFA::PutResult(int res)
+{
    if(res<0)
    {
       if(res==FA::DO_AGAIN)
@@ -1310,6 +1439,81 @@ int FileCopyPeerFA::Put_LL(const char *buf,int len)
    return res;
 }
 
+int FileCopyPeerFA::Put_LL(const char *buf,int len)
+{
+   if(!PutReady())
+      return 0;
+
+   if(len==0 && eof)
+      return 0;
+
+   return PutResult(session->Write(buf,len));
+}
+
+int FileCopyPeerFA::PutFromFile(int fd,off_t at,int len)
+{
+   if(mode!=PUT || fxp || ascii || eof || Size()>0)
+      return -1;
+   if(!PutReady())
+      return 0;
+   int res=session->WriteFromFile(fd,at,len);
+   if(res==FA::NOT_SUPP)
+      return -1;
+   res=PutResult(res);
+   if(res>0)
+      pos+=res;
+   return res;
+}
+
+int FileCopyPeerFA::GetLocalFile(off_t *at,off_t *avail)
+{
+   if(mode!=GET || fxp || ascii || eof)
+      return -1;
+   return session->GetLocalFile(at,avail);
+}
+void FileCopyPeerFA::SkipLocalFile(int len)
+{
+   session->SkipLocalFile(len);
+   pos+=len;
+}
+
+bool FileCopyPeerFA::StartGetToFile()
+{
+   if(mode!=GET || fxp || ascii || eof)
+      return false;
+   get_to_file=true;
+   return true;
+}
+int FileCopyPeerFA::GetToFile(int fd,off_t at,int len)
+{
+   if(!get_to_file || eof || Size()>0)
+      return -1;
+   if(get_delay>0)
+   {
+      get_delay=0;
+      session->ResumeSlave();
+   }
+   if(session->IsClosed())
+      OpenSession();
+   if(eof)
+      return -1;
+   off_t io_at=pos;
+   if(GetRealPos()!=io_at) // GetRealPos can alter pos.
+      return 0;
+
+   int res=session->ReadToFile(fd,at,len);
+   if(res==FA::DO_AGAIN)
+      return 0;
+   if(res<=0)
+   {
+      // let Get_LL handle eof and errors.
+      get_to_file=false;
+      return -1;
+   }
+   pos+=res;
+   return res;
+}
+
 int FileCopyPeerFA::PutEOF_LL()
 {
    if(mode==GET && session)
@@ -1349,6 +1553,7 @@ void FileCopyPeerFA::Init()
 {
    get_delay=0;
    fxp=false;
+   get_to_file=false;
    redirections=0;
    can_seek=true;
    can_seek0=true;
@@ -1428,6 +1633,8 @@ FileCopyPeerFDStream::FileCopyPeerFDStream(const Ref<FDStream>& o,dir_t m)
 void FileCopyPeerFDStream::Init()
 {
    seek_base=0;
+   not_regular=false;
+   file_offset_behind=false;
    create_fg_data=true;
    need_seek=false;
    can_seek = can_seek0 = stream->can_seek();
@@ -1710,6 +1917,9 @@ int FileCopyPeerFDStream::Get_LL(int len)
 
    if(need_seek)  // this does not combine with ascii.
       lseek(fd,seek_base+pos,SEEK_SET);
+   else if(file_offset_behind)
+      lseek(fd,seek_base+pos+Size(),SEEK_SET);
+   file_offset_behind=false;
 
    char *p=GetSpace(ascii?len*2:len);
    res=read(fd,p,len);
@@ -1751,6 +1961,37 @@ int FileCopyPeerFDStream::Get_LL(int len)
    return res;
 }
 
+int FileCopyPeerFDStream::GetLocalFile(off_t *at,off_t *avail)
+{
+   if(ascii || eof || not_regular || stream->fd==-1)
+      return -1;
+   if(mode==PUT && !write_allowed)
+      return -1;
+   struct stat st;
+   if(fstat(stream->fd,&st)==-1 || !S_ISREG(st.st_mode)
+   || (fcntl(stream->fd,F_GETFL)&O_APPEND))
+   {
+      not_regular=true;
+      return -1;
+   }
+   if(mode==GET)
+   {
+      *at=seek_base+pos+Size();
+      *avail=st.st_size-*at;
+   }
+   else
+   {
+      *at=seek_base+pos;
+      *avail=-1;
+   }
+   return stream->fd;
+}
+void FileCopyPeerFDStream::SkipLocalFile(int len)
+{
+   pos+=len;
+   file_offset_behind=true;
+}
+
 int FileCopyPeerFDStream::Put_LL(const char *buf,int len)
 {
    if(len==0)
@@ -1793,8 +2034,9 @@ int FileCopyPeerFDStream::Put_LL(const char *buf,int len)
    if(len==0)
       return skip_cr;
 
-   if(need_seek)  // this does not combine with ascii.
+   if(need_seek || file_offset_behind)  // this does not combine with ascii.
       lseek(fd,seek_base+pos-Size(),SEEK_SET);
+   file_offset_behind=false;
 
    int res=write(fd,buf,len);
    if(res<0)
@@ -1974,6 +2216,292 @@ int FileCopyPeerMemory::Do()
    return m;
 }
 
+// FileCopyPeerDeltaGet
+#undef super
+#define super FileCopyPeer
+FileCopyPeerDeltaGet::FileCopyPeerDeltaGet(const char *source_file,const char *basis_file)
+   : FileCopyPeer(GET),
+     source(new FileStream(source_file,O_RDONLY)),
+     basis(new FileStream(basis_file,O_RDONLY)),
+     basis_pos(0)
+{
+   can_seek=false;
+   can_seek0=false;
+}
+
+int FileCopyPeerDeltaGet::getfd(const Ref<FDStream>& s)
+{
+   int fd=s->getfd();
+   if(fd==-1)
+   {
+      if(s->error())
+      {
+	 SetError(s->error_text);
+	 current->Timeout(0);
+      }
+      else
+	 current->TimeoutS(1);
+   }
+   return fd;
+}
+
+// Reads a part of the basis into the signature.
+int FileCopyPeerDeltaGet::ReadBasis()
+{
+   int fd=getfd(basis);
+   if(fd==-1)
+      return STALL;
+   if(!sig)
+   {
+      struct stat st;
+      off_t size=(fstat(fd,&st)==-1 ? 0 : st.st_size);
+      sig=new DeltaSignature(DeltaSignature::BlockSizeFor(size));
+   }
+   int bs=sig->GetBlockSize();
+   int want=(0x40000/bs+1)*bs;
+   xstring buf;
+   int res=pread(fd,buf.add_space(want),want,basis_pos);
+   if(res==-1)
+   {
+      if(basis->NonFatalError(errno))
+	 return STALL;
+      basis->MakeErrorText();
+      SetError(basis->error_text);
+      return MOVED;
+   }
+   for(int o=0; o+bs<=res; o+=bs)
+      sig->AddBlock(buf.get()+o,bs);
+   basis_pos+=res;
+   if(res<want)
+   {
+      debug((10,"delta: %d blocks of %d bytes in the basis\n",sig->Count(),bs));
+      sig->Index();
+      encoder=new DeltaEncoder(sig.get());
+      basis=0;
+   }
+   return MOVED;
+}
+
+int FileCopyPeerDeltaGet::ReadSource()
+{
+   int fd=getfd(source);
+   if(fd==-1)
+      return STALL;
+   xstring buf;
+   int res=read(fd,buf.add_space(GET_BUFSIZE),GET_BUFSIZE);
+   if(res==-1)
+   {
+      if(source->NonFatalError(errno))
+	 return STALL;
+      source->MakeErrorText();
+      SetError(source->error_text);
+      return MOVED;
+   }
+   source->clear_status();
+   xstring delta;
+   if(res>0)
+      encoder->Put(buf.get(),res,delta);
+   else
+   {
+      encoder->PutEOF(delta);
+      eof=true;
+   }
+   memcpy(GetSpace(delta.length()),delta.get(),delta.length());
+   SpaceAdd(delta.length());
+   return MOVED;
+}
+
+int FileCopyPeerDeltaGet::Do()
+{
+   if(Done() || Error() || eof)
+      return STALL;
+   if(!encoder)
+      return ReadBasis();
+   return ReadSource();
+}
+
+// the size of the delta is not known beforehand.
+void FileCopyPeerDeltaGet::WantSize()
+{
+   SetSize(NO_SIZE);
+}
+void FileCopyPeerDeltaGet::WantDate()
+{
+   struct stat st;
+   if(stat(source->full_name,&st)!=-1)
+      SetDate(st.st_mtime);
+   else
+      SetDate(NO_DATE);
+}
+// mirror --Remove-source-files; the basis is the target, it stays.
+void FileCopyPeerDeltaGet::RemoveFile()
+{
+   source->remove();
+   removing=false;   // it is instant.
+   file_removed=true;
+   Suspend();
+   current->Timeout(0);
+}
+
+// FileCopyPeerDeltaPut
+FileCopyPeerDeltaPut::FileCopyPeerDeltaPut(const char *file)
+   : FileCopyPeer(PUT),
+     stream(new FileStream(file,O_RDWR|O_CREAT)),
+     block_size(0), out_pos(0), copy_from(0), copy_left(0), literal_left(0)
+{
+   can_seek=false;
+   can_seek0=false;
+}
+
+int FileCopyPeerDeltaPut::getfd()
+{
+   int fd=stream->getfd();
+   if(fd==-1)
+   {
+      if(stream->error())
+      {
+	 SetError(stream->error_text);
+	 current->Timeout(0);
+      }
+      else
+	 current->TimeoutS(1);
+   }
+   return fd;
+}
+
+/* Applies a part of the delta. A block copied to the same offset is already
+ * in place; blocks at other offsets never precede the output position, so
+ * they can be copied forward. Returns the number of bytes written (at least
+ * 1 on progress), 0 if more delta data are needed, or -1 on error. */
+int FileCopyPeerDeltaPut::Apply(int fd)
+{
+   const char *b;
+   int s;
+   Get(&b,&s);
+   if(copy_left>0)
+   {
+      if(copy_from==out_pos)
+      {
+	 out_pos+=copy_left;
+	 copy_from+=copy_left;
+	 copy_left=0;
+	 return 1;
+      }
+      char buf[0x10000];
+      int len=(copy_left<(off_t)sizeof(buf)?copy_left:sizeof(buf));
+      int res=pread(fd,buf,len,copy_from);
+      if(res>0)
+	 res=pwrite(fd,buf,res,out_pos);
+      if(res<=0)
+	 goto write_error;
+      out_pos+=res;
+      copy_from+=res;
+      copy_left-=res;
+      return res;
+   }
+   if(literal_left>0)
+   {
+      if(s==0)
+	 return 0;
+      int len=(literal_left<(unsigned)s?literal_left:s);
+      int res=pwrite(fd,b,len,out_pos);
+      if(res<=0)
+	 goto write_error;
+      buffer_ptr+=res;
+      out_pos+=res;
+      literal_left-=res;
+      return res;
+   }
+
+   char cmd;
+   unsigned arg1,arg2;
+   int hlen;
+   hlen=DeltaParse(b,s,&cmd,&arg1,&arg2);
+   if(hlen==0)
+      return 0;
+   if(hlen<0 || (cmd!='B' && block_size==0))
+   {
+      SetError(_("invalid delta data"));
+      return -1;
+   }
+   buffer_ptr+=hlen;
+   switch(cmd)
+   {
+   case 'B':
+      block_size=arg1;
+      break;
+   case 'C':
+      copy_from=(off_t)arg1*block_size;
+      copy_left=(off_t)arg2*block_size;
+      if(copy_from<out_pos)
+      {
+	 SetError(_("invalid delta data"));
+	 return -1;
+      }
+      break;
+   case 'L':
+      literal_left=arg1;
+      break;
+   }
+   return 1;
+
+write_error:
+   if(stream->NonFatalError(errno))
+      return 0;
+   stream->MakeErrorText();
+   SetError(stream->error_text);
+   return -1;
+}
+
+int FileCopyPeerDeltaPut::Do()
+{
+   int m=STALL;
+   if(Done() || Error())
+      return m;
+   if(Size()==0 && copy_left==0 && !eof)
+      return m;
+   int fd=getfd();
+   if(fd==-1)
+      return m;
+
+   int done_bytes=0;
+   while(done_bytes<0x100000)
+   {
+      int res=Apply(fd);
+      if(res<0)
+	 return MOVED;
+      if(res==0)
+	 break;
+      done_bytes+=res;
+      m=MOVED;
+   }
+   if(!eof || Size()>0 || copy_left>0)
+      return m;
+   if(literal_left>0)
+   {
+      SetError(_("invalid delta data"));
+      return MOVED;
+   }
+   if(!date_set)
+   {
+      if(ftruncate(fd,out_pos)==-1)
+      {
+	 stream->MakeErrorText();
+	 SetError(stream->error_text);
+	 return MOVED;
+      }
+      if(date!=NO_DATE && do_set_date)
+      {
+	 if(date==NO_DATE_YET)
+	    return m;
+	 stream->setmtime(date);
+      }
+      date_set=true;
+   }
+   done=true;
+   return MOVED;
+}
+
 // FileVerificator
 void FileVerificator::Init0()
 {
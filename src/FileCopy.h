@@ -23,6 +23,8 @@
    FileCopyPeer
    +FileCopyPeerFA
    +FileCopyPeerFDStream
+   +FileCopyPeerDeltaGet
+   +FileCopyPeerDeltaPut
    \FileCopyPeerList
 */
 
@@ -35,6 +37,7 @@
 #include "Speedometer.h"
 #include "Timer.h"
 #include "log.h"
+#include "DeltaSum.h"
 
 class FileCopyPeer : public IOBuffer
 {
@@ -140,6 +143,20 @@ public:
    virtual FileCopyPeer *Clone() { return 0; }
    virtual const Ref<FDStream>& GetLocal() const { return Ref<FDStream>::null; }
 
+   // Zero-copy transfer of a regular local file (get side): returns the
+   // descriptor, the offset and size of the data not yet read, or -1.
+   virtual int GetLocalFile(off_t *at,off_t *avail) { return -1; }
+   // the data were sent from the file by other means, advance position.
+   virtual void SkipLocalFile(int len) {}
+   // put side: send data from the file directly; returns number of bytes
+   // sent, 0 to retry later, -1 if not possible.
+   virtual int PutFromFile(int fd,off_t at,int len) { return -1; }
+   // get side: stop reading into the buffer and write data straight to
+   // the file (e.g. using splice); same return values as PutFromFile.
+   virtual bool StartGetToFile() { return false; }
+   virtual int GetToFile(int fd,off_t at,int len) { return -1; }
+   virtual void StopGetToFile() {}
+
    const char *GetSuggestedFileName() { return suggested_filename; }
    void SetSuggestedFileName(const char *f) { if(f) suggested_filename.set(f); }
    void AutoRename(bool yes=true) { auto_rename=yes; }
@@ -188,6 +205,13 @@ private:
    Ref<Buffer> line_buffer;
    int  line_buffer_max;
 
+   bool copy_from_file;	 // try to send the local file directly
+   bool sending_file;	 // get is suspended while sending directly
+   int CopyFromFile();
+   bool copy_to_file;	 // try to receive into the local file directly
+   bool receiving_file;	 // get does not buffer while receiving directly
+   int CopyToFile();
+
    bool CheckFileSizeAtEOF() const;
 
 protected:
@@ -293,6 +317,8 @@ class FileCopyPeerFA : public FileCopyPeer
    int Get_LL(int size);
    int Put_LL(const char *buf,int size);
    int PutEOF_LL();
+   bool PutReady();
+   int PutResult(int res);
 
    // to read data in larger quantities, delay the read op
    Timer get_ll_timer;
@@ -301,6 +327,7 @@ class FileCopyPeerFA : public FileCopyPeer
    FileSet info;
 
    bool fxp;   // FXP (ftp<=>ftp copy) active
+   bool get_to_file;   // data are written to a local file by GetToFile
 
    UploadState upload_state;
    int redirections;
@@ -323,6 +350,13 @@ public:
 
    int Buffered() { return Size()+session->Buffered(); }
 
+   int GetLocalFile(off_t *at,off_t *avail);
+   void SkipLocalFile(int len);
+   int PutFromFile(int fd,off_t at,int len);
+   bool StartGetToFile();
+   int GetToFile(int fd,off_t at,int len);
+   void StopGetToFile() { get_to_file=false; }
+
    void SuspendInternal();
    void ResumeInternal();
 
@@ -366,6 +400,8 @@ class FileCopyPeerFDStream : public FileCopyPeer
    bool create_fg_data;
    bool need_seek;
    bool close_when_done;
+   bool not_regular;	// cannot be sent by GetLocalFile
+   bool file_offset_behind;   // data were sent using GetLocalFile
 
    SMTaskRef<FileVerificator> verify;
 
@@ -387,6 +423,9 @@ public:
    void RemoveFile();
    void SetBase(off_t b) { seek_base=b; }
 
+   int GetLocalFile(off_t *at,off_t *avail);
+   void SkipLocalFile(int len);
+
    const char *GetStatus();
 
    static FileCopyPeerFDStream *NewPut(const char *file,bool cont=false);
@@ -438,4 +477,52 @@ public:
    bool Done() { return true; }
 };
 
+// Delta transfer between local files (xfer:delta). The get side reads the
+// old copy of the target as the basis and sends a delta of the source file,
+// the put side applies the delta to the target in place.
+class FileCopyPeerDeltaGet : public FileCopyPeer
+{
+   Ref<FDStream> source;
+   Ref<FDStream> basis;
+   Ref<DeltaSignature> sig;
+   Ref<DeltaEncoder> encoder;
+   off_t basis_pos;
+
+   int getfd(const Ref<FDStream>& s);
+   int ReadBasis();
+   int ReadSource();
+
+public:
+   FileCopyPeerDeltaGet(const char *source_file,const char *basis_file);
+   int Do();
+   void WantSize();
+   void WantDate();
+   void RemoveFile();
+   const char *GetStatus() { return source->status; }
+
+   const char *GetDescriptionForLog() { return source->name; }
+   const char *GetURL() { return source->full_name; }
+};
+
+class FileCopyPeerDeltaPut : public FileCopyPeer
+{
+   Ref<FDStream> stream;
+   int block_size;
+   off_t out_pos;
+   off_t copy_from;
+   off_t copy_left;
+   unsigned literal_left;
+
+   int getfd();
+   int Apply(int fd);
+
+public:
+   FileCopyPeerDeltaPut(const char *file);
+   int Do();
+   const char *GetStatus() { return stream->status; }
+
+   const char *GetDescriptionForLog() { return stream->name; }
+   const char *GetURL() { return stream->full_name; }
+};
+
 #endif
@@ -0,0 +1,96 @@
+/*
+ * lftp - file transfer program
+ *
+ * Copyright (c) 1996-2017 by Alexander V. Lukyanov (lav@yars.free.net)
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <config.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#ifdef HAVE_LINUX_FIEMAP_H
+# include <linux/fs.h>
+# include <linux/fiemap.h>
+#endif
+#include "FileLayout.h"
+#include "ResMgr.h"
+#include "ProtoLog.h"
+
+static int allocate(int fd,off_t size)
+{
+#if defined(HAVE_FALLOCATE)
+   if(fallocate(fd,0,0,size)==0)
+      return 0;
+# ifdef FALLOC_FL_KEEP_SIZE
+   // some file systems can only reserve the space past the end of file
+   if(errno==EOPNOTSUPP)
+      return fallocate(fd,FALLOC_FL_KEEP_SIZE,0,size);
+# endif
+   return -1;
+#elif defined(HAVE_POSIX_FALLOCATE)
+   int err=posix_fallocate(fd,0,size);
+   if(err==0)
+      return 0;
+   errno=err;
+   return -1;
+#else
+   errno=ENOSYS;
+   return -1;
+#endif
+}
+
+int FileLayout::Preallocate(int fd,off_t size,const char *name)
+{
+   struct stat st;
+   if(fstat(fd,&st)==-1)
+      return -1;
+   if(!S_ISREG(st.st_mode))
+      return 0;
+
+   int res=0;
+   const char *what="already allocated";
+   // A sparse file has fewer blocks than its size. The blocks of a file
+   // written by a previous run are not counted twice.
+   if((off_t)st.st_blocks*512<size) {
+      res=allocate(fd,size);
+      what=(res==0?"allocated":"not allocated");
+   }
+   int saved_errno=errno;
+   int extents=CountExtents(fd);
+   if(extents>=0)
+      ProtoLog::LogNote(9,"%s: %lld bytes %s, %d extent%s",name,(long long)size,what,
+	 extents,extents==1?"":"s");
+   errno=saved_errno;
+   return res;
+}
+
+int FileLayout::CountExtents(int fd)
+{
+#if defined(HAVE_LINUX_FIEMAP_H) && defined(FS_IOC_FIEMAP)
+   struct fiemap fm;
+   memset(&fm,0,sizeof(fm));
+   fm.fm_length=FIEMAP_MAX_OFFSET;
+   fm.fm_extent_count=0;   // just count them
+   if(ioctl(fd,FS_IOC_FIEMAP,&fm)==-1)
+      return -1;
+   return fm.fm_mapped_extents;
+#else
+   return -1;
+#endif
+}
@@ -0,0 +1,43 @@
+/*
+ * lftp - file transfer program
+ *
+ * Copyright (c) 1996-2017 by Alexander V. Lukyanov (lav@yars.free.net)
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef FILELAYOUT_H
+#define FILELAYOUT_H
+
+#include <sys/types.h>
+
+/* Disk space allocation for files written out of order, like pget chunks
+ * and torrent pieces. Extending a file piecemeal from many places leaves
+ * it in many small extents; allocating the final size at the start lets
+ * the file system lay it out contiguously. */
+class FileLayout
+{
+public:
+   // Allocates the space for size bytes, once per file: only the holes
+   // are allocated and the data already written are kept. Returns 0 on
+   // success or when the space is already allocated, -1 with errno set on
+   // failure; ENOSYS and EOPNOTSUPP mean there is no support for it.
+   // The resulting number of extents is logged for the name.
+   static int Preallocate(int fd,off_t size,const char *name);
+
+   // the number of extents of the file, -1 if unknown.
+   static int CountExtents(int fd);
+};
+
+#endif//FILELAYOUT_H
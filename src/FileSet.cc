@@ -35,6 +35,7 @@
 #include <ctype.h>
 
 #include "misc.h"
+#include "ascii_ctype.h"
 #include "ResMgr.h"
 #include "StringPool.h"
 #include "IdNameCache.h"
@@ -336,7 +337,8 @@ void FileSet::UnsortFlat()
 {
    for(int i=0; i<files.count(); i++) {
       assert(files[i]->longname!=0);
-      files[i]->name.move_here(files[i]->longname);
+      files[i]->name.set(files[i]->longname);
+      files[i]->longname.unset();
    }
 }
 
@@ -347,129 +349,191 @@ void FileSet::Empty()
    ind=0;
 }
 
-void FileSet::SubtractSame(const FileSet *set,int ignore)
+bool FileSet::is_sorted() const
 {
-   if(!set)
-      return;
+   for(int i=0; i<fnum-1; i++)
+      if(strcmp(files[i]->name,files[i+1]->name)>=0)
+	 return false;
+   return true;
+}
+
+/* Remove the files for which pred(file,other) is true, where other is the
+ * file with the same name in set, or 0. Both file arrays are kept sorted
+ * by name, so they are merged in one pass; binary search is only used when
+ * a set was flattened (see BYNAME_FLAT) and is no longer in order. The kept
+ * files are moved down in place. */
+template<class P> void FileSet::SubtractIf(const FileSet *set,const P& pred)
+{
+   assert(!sorted);
+   bool merge=(set && is_sorted() && set->is_sorted());
+   int j=0;
+   int keep=0;
+   int new_ind=ind;
    for(int i=0; i<fnum; i++)
    {
-      FileInfo *f=set->FindByName(files[i]->name);
-      if(f && files[i]->SameAs(f,ignore))
-	 Sub(i--);
+      const FileInfo *f=files[i];
+      const FileInfo *other=0;
+      if(set==this)
+	 other=f;
+      else if(merge)
+      {
+	 int cmp=-1;
+	 while(j<set->fnum && (cmp=strcmp(set->files[j]->name,f->name))<0)
+	    j++;
+	 if(cmp==0)
+	    other=set->files[j];
+      }
+      else if(set)
+	 other=set->FindByName(f->name);
+      if(pred(f,other))
+      {
+	 files[i].unset();
+	 if(i<ind)
+	    new_ind--;
+	 continue;
+      }
+      if(keep<i)
+	 files[keep]=files[i].borrow();
+      keep++;
    }
+   files.set_length(keep);
+   ind=new_ind;
 }
 
+struct same_pred
+{
+   int ignore;
+   same_pred(int i) : ignore(i) {}
+   bool operator()(const FileInfo *f,const FileInfo *o) const {
+      return o && f->SameAs(o,ignore);
+   }
+};
+void FileSet::SubtractSame(const FileSet *set,int ignore)
+{
+   if(!set)
+      return;
+   SubtractIf(set,same_pred(ignore));
+}
+
+struct in_set_pred
+{
+   bool operator()(const FileInfo *f,const FileInfo *o) const { return o; }
+};
 void FileSet::SubtractAny(const FileSet *set)
 {
    if(!set)
       return;
-   for(int i=0; i<fnum; i++)
-      if(set->FindByName(files[i]->name))
-	 Sub(i--);
+   SubtractIf(set,in_set_pred());
 }
 
+struct not_in_set_pred
+{
+   bool operator()(const FileInfo *f,const FileInfo *o) const { return !o; }
+};
 void FileSet::SubtractNotIn(const FileSet *set)
 {
    if(!set) {
       Empty();
       return;
    }
-   for(int i=0; i<fnum; i++)
-      if(!set->FindByName(files[i]->name))
-	 Sub(i--);
+   SubtractIf(set,not_in_set_pred());
 }
+
+struct same_type_pred
+{
+   bool operator()(const FileInfo *f,const FileInfo *o) const {
+      return o && f->Has(FileInfo::TYPE) && o->Has(FileInfo::TYPE)
+	 && f->filetype==o->filetype;
+   }
+};
 void FileSet::SubtractSameType(const FileSet *set)
 {
    if(!set)
       return;
-   for(int i=0; i<fnum; i++)
-   {
-      FileInfo *f=set->FindByName(files[i]->name);
-      if(f && files[i]->defined&FileInfo::TYPE && f->defined&FileInfo::TYPE
-      && files[i]->filetype==f->filetype)
-	 Sub(i--);
-   }
+   SubtractIf(set,same_type_pred());
 }
+
+struct both_dirs_pred
+{
+   bool operator()(const FileInfo *f,const FileInfo *o) const {
+      return o && f->TypeIs(FileInfo::DIRECTORY) && o->TypeIs(FileInfo::DIRECTORY);
+   }
+};
 void FileSet::SubtractDirs(const FileSet *set)
 {
    if(!set)
       return;
-   for(int i=0; i<fnum; i++)
-   {
-      if(!files[i]->TypeIs(FileInfo::DIRECTORY))
-	 continue;
-      FileInfo *f=set->FindByName(files[i]->name);
-      if(f && f->TypeIs(f->DIRECTORY))
-	 Sub(i--);
-   }
+   SubtractIf(set,both_dirs_pred());
 }
+
+struct not_older_dir_pred
+{
+   bool operator()(const FileInfo *f,const FileInfo *o) const {
+      return o && f->TypeIs(FileInfo::DIRECTORY) && f->Has(FileInfo::DATE)
+	 && o->TypeIs(FileInfo::DIRECTORY) && o->NotOlderThan(f->date);
+   }
+};
 void FileSet::SubtractNotOlderDirs(const FileSet *set)
 {
    if(!set)
       return;
-   for(int i=0; i<fnum; i++)
-   {
-      if(!files[i]->TypeIs(FileInfo::DIRECTORY)
-      || !files[i]->Has(FileInfo::DATE))
-	 continue;
-      FileInfo *f=set->FindByName(files[i]->name);
-      if(f && f->TypeIs(f->DIRECTORY) && f->NotOlderThan(files[i]->date))
-	 Sub(i--);
-   }
+   SubtractIf(set,not_older_dir_pred());
 }
 
-void FileSet::SubtractTimeCmp(bool (FileInfo::*cmp)(time_t) const,time_t t)
+// the filters below apply to files which are not known to be other than
+// plain files.
+static bool maybe_plain(const FileInfo *f)
 {
-   for(int i=0; i<fnum; i++)
-   {
-      if(files[i]->defined&FileInfo::TYPE
-      && files[i]->filetype!=FileInfo::NORMAL)
-	 continue;
-      if((files[i].get()->*cmp)(t))
-      {
-	 Sub(i);
-	 i--;
-      }
+   return !f->Has(FileInfo::TYPE) || f->filetype==FileInfo::NORMAL;
+}
+
+struct time_cmp_pred
+{
+   bool (FileInfo::*cmp)(time_t) const;
+   time_t t;
+   time_cmp_pred(bool (FileInfo::*c)(time_t) const,time_t t1) : cmp(c), t(t1) {}
+   bool operator()(const FileInfo *f,const FileInfo *) const {
+      return maybe_plain(f) && (f->*cmp)(t);
    }
+};
+void FileSet::SubtractTimeCmp(bool (FileInfo::*cmp)(time_t) const,time_t t)
+{
+   SubtractIf(0,time_cmp_pred(cmp,t));
 }
 
-void FileSet::SubtractSizeOutside(const Range *r)
+struct size_outside_pred
 {
-   for(int i=0; i<fnum; i++)
-   {
-      if(files[i]->defined&FileInfo::TYPE
-      && files[i]->filetype!=FileInfo::NORMAL)
-	 continue;
-      if(files[i]->SizeOutside(r))
-      {
-	 Sub(i);
-	 i--;
-      }
+   const Range *r;
+   size_outside_pred(const Range *r1) : r(r1) {}
+   bool operator()(const FileInfo *f,const FileInfo *) const {
+      return maybe_plain(f) && f->SizeOutside(r);
    }
+};
+void FileSet::SubtractSizeOutside(const Range *r)
+{
+   SubtractIf(0,size_outside_pred(r));
 }
-void FileSet::SubtractDirs()
+
+struct dir_pred
 {
-   for(int i=0; i<fnum; i++)
-   {
-      if(files[i]->defined&FileInfo::TYPE
-      && files[i]->filetype==FileInfo::DIRECTORY)
-      {
-	 Sub(i);
-	 i--;
-      }
+   bool operator()(const FileInfo *f,const FileInfo *) const {
+      return f->TypeIs(FileInfo::DIRECTORY);
    }
+};
+void FileSet::SubtractDirs()
+{
+   SubtractIf(0,dir_pred());
 }
-void FileSet::SubtractNotDirs()
+
+struct not_dir_pred
 {
-   for(int i=0; i<fnum; i++)
-   {
-      if(!(files[i]->defined&FileInfo::TYPE)
-      || files[i]->filetype!=FileInfo::DIRECTORY)
-      {
-	 Sub(i);
-	 i--;
-      }
+   bool operator()(const FileInfo *f,const FileInfo *) const {
+      return !f->TypeIs(FileInfo::DIRECTORY);
    }
+};
+void FileSet::SubtractNotDirs()
+{
+   SubtractIf(0,not_dir_pred());
 }
 
 void FileSet::ExcludeDots()
@@ -897,6 +961,50 @@ check_again:
    }
 }
 
+static inline bool is_ls_space(char c)
+{
+   return c==' ' || c=='\t';
+}
+/* Same as strtok_r(NULL," \t",next), without the generic delimiter set. */
+static char *ls_token(char **next)
+{
+   char *t=*next;
+   while(is_ls_space(*t))
+      t++;
+   if(!*t)
+   {
+      *next=t;
+      return 0;
+   }
+   char *e=t;
+   while(*e && !is_ls_space(*e))
+      e++;
+   if(*e)
+      *e++=0;
+   *next=e;
+   return t;
+}
+static bool ls_number(const char *t,long long *n)
+{
+   char *end;
+   long long v=strtoll(t,&end,10);
+   if(end==t || *end)
+      return false;
+   *n=v;
+   return true;
+}
+static bool ls_time(const char *t,int *hour,int *minute)
+{
+   if(is_ascii_digit(t[0]) && is_ascii_digit(t[1]) && t[2]==':'
+   && is_ascii_digit(t[3]) && is_ascii_digit(t[4]))
+   {
+      *hour=(t[0]-'0')*10+(t[1]-'0');
+      *minute=(t[3]-'0')*10+(t[4]-'0');
+      return true;
+   }
+   return sscanf(t,"%2d:%2d",hour,minute)==2;
+}
+
 /* parse_ls_line: too common procedure to make it protocol specific */
 /*
 -rwxr-xr-x   1 lav      root         4771 Sep 12  1996 install-sh
@@ -910,10 +1018,10 @@ FileInfo *FileInfo::parse_ls_line(const char *line_c,int line_len,const char *tz
    char *line=string_alloca(line_len+1);
    memcpy(line,line_c,line_len);
    line[line_len]=0;
-   char *next=0;
+   char *next=line;
    FileInfo *fi=0; /* don't instantiate until we at least have something */
-#define FIRST_TOKEN strtok_r(line," \t",&next)
-#define NEXT_TOKEN  strtok_r(NULL," \t",&next)
+#define FIRST_TOKEN ls_token(&next)
+#define NEXT_TOKEN  ls_token(&next)
 #define ERR do{delete fi;return(0);}while(0)
 
    /* parse perms */
@@ -970,8 +1078,7 @@ FileInfo *FileInfo::parse_ls_line(const char *line_c,int line_len,const char *tz
       // it's size, so the previous was group:
       fi->SetGroup(group_or_size);
       long long size;
-      int n;
-      if(sscanf(t,"%lld%n",&size,&n)==1 && t[n]==0)
+      if(ls_number(t,&size))
 	 fi->SetSize(size);
       t = NEXT_TOKEN;
       if(!t)
@@ -981,8 +1088,7 @@ FileInfo *FileInfo::parse_ls_line(const char *line_c,int line_len,const char *tz
    {
       // it was month, so the previous was size:
       long long size;
-      int n;
-      if(sscanf(group_or_size,"%lld%n",&size,&n)==1 && group_or_size[n]==0)
+      if(ls_number(group_or_size,&size))
 	 fi->SetSize(size);
    }
 
@@ -1009,7 +1115,7 @@ FileInfo *FileInfo::parse_ls_line(const char *line_c,int line_len,const char *tz
    date.tm_sec=30;
    int prec=30;
 
-   if(sscanf(t,"%2d:%2d",&date.tm_hour,&date.tm_min)==2)
+   if(ls_time(t,&date.tm_hour,&date.tm_min))
       date.tm_year=guess_year(date.tm_mon,date.tm_mday,date.tm_hour,date.tm_min) - 1900;
    else
    {
@@ -1026,8 +1132,8 @@ FileInfo *FileInfo::parse_ls_line(const char *line_c,int line_len,const char *tz
 
    fi->SetDate(mktime_from_tz(&date,tz),prec);
 
-   char *name=strtok_r(NULL,"",&next);
-   if(!name)
+   char *name=next;
+   if(!*name)
       ERR;
 
    // there are ls which output extra space after year.
@@ -1049,7 +1155,7 @@ FileInfo *FileInfo::parse_ls_line(const char *line_c,int line_len,const char *tz
       }
    }
    fi->SetName(name);
-   fi->SetLongName(line_c);
+   fi->SetLongName(line_c,line_len);
 
    return fi;
 }
@@ -1136,24 +1242,165 @@ void FileInfo::MakeLongName()
    if(defined&DATE)
       date_str=TimeDate(date).IsoDateTime();
 
+   const char *arrow="",*target="";
+   if((defined&SYMLINK_DEF) && symlink)
+      arrow=" -> ",target=symlink;
+
    longname.vset(filetype_s,format_perms(mode1),"  ",usergroup," ",size_str,
-      " ",date_str," ",name.get(),NULL);
+      " ",date_str," ",name.get(),arrow,target,NULL);
+}
 
-   if(defined&SYMLINK_DEF)
-      longname.vappend(" -> ",symlink.get(),NULL);
+/* Free the memory not needed to compare and transfer the files: the listing
+ * lines (GetLongName can make them up) and spare array slots. */
+void FileSet::Compact()
+{
+   if(sort_mode==BYNAME_FLAT)
+      return;  // longname holds the paths
+   for(int i=0; i<fnum; i++)
+      files[i]->longname.unset();
+   files.shrink_space();
+   sorted.shrink_space();
 }
 
 size_t FileSet::EstimateMemory() const
 {
    size_t size=sizeof(FileSet)
-      +files.count()*files.get_element_size()
-      +sorted.count()*sorted.get_element_size();
+      +files.get_allocated_size()
+      +sorted.get_allocated_size();
    for(int i=0; i<fnum; i++)
    {
+      const FileInfo *fi=files[i];
       size+=sizeof(FileInfo);
-      size+=xstrlen(files[i]->name);
-      size+=xstrlen(files[i]->symlink);
-      size+=xstrlen(files[i]->longname);
+      size+=fi->name.capacity();
+      size+=xstrlen(fi->longname);
+      size+=xstrlen(fi->symlink);
+      size+=xstrlen(fi->uri);
    }
    return size;
 }
+
+static const RefArray<FileInfo> *pack_files;
+static int pack_cmp(const int *a,const int *b)
+{
+   return strcmp((*pack_files)[*a]->name,(*pack_files)[*b]->name);
+}
+
+unsigned PackedFileSet::AddString(const char *s)
+{
+   unsigned pos=strings.length();
+   strings.append(s,strlen(s)+1);
+   return pos;
+}
+
+PackedFileSet::PackedFileSet(const FileSet *set)
+   : ind(0)
+{
+   const RefArray<FileInfo>& files=set->files;
+   int n=files.count();
+
+   // the names are sorted, unless UnsortFlat has replaced them by paths.
+   xarray<int> order;
+   order.get_space(n);
+   for(int i=0; i<n; i++)
+      order.append(i);
+   if(!set->is_sorted())
+   {
+      pack_files=&files;
+      order.qsort(pack_cmp);
+      pack_files=0;
+   }
+
+   size_t strings_len=0;
+   for(int i=0; i<n; i++)
+   {
+      strings_len+=files[i]->name.length()+1;
+      if(files[i]->symlink)
+	 strings_len+=strlen(files[i]->symlink)+1;
+   }
+   strings.get_space(strings_len);
+   name_pos.get_space(n);
+   symlink_pos.get_space(n);
+   size.get_space(n);
+   date.get_space(n);
+   date_prec.get_space(n);
+   mode.get_space(n);
+   nlinks.get_space(n);
+   defined.get_space(n);
+   filetype.get_space(n);
+   user.get_space(n);
+   group.get_space(n);
+
+   for(int i=0; i<n; i++)
+   {
+      const FileInfo *f=files[order[i]];
+      name_pos.append(AddString(f->name));
+      symlink_pos.append(f->symlink ? AddString(f->symlink) : unsigned(NO_POS));
+      size.append(f->size);
+      date.append(f->date.ts);
+      date_prec.append(f->date.ts_prec);
+      mode.append(f->mode);
+      nlinks.append(f->nlinks);
+      defined.append(f->defined);
+      filetype.append(f->filetype);
+      user.append(f->user);
+      group.append(f->group);
+   }
+}
+
+const FileInfo *PackedFileSet::operator[](int i) const
+{
+   if(i<0 || i>=count())
+      return 0;
+   fi.Init();
+   fi.name.set(Name(i));
+   fi.symlink.set(symlink_pos[i]==NO_POS ? 0 : strings.get()+symlink_pos[i]);
+   fi.longname.unset();
+   fi.size=size[i];
+   fi.date.set(date[i],date_prec[i]);
+   fi.mode=mode[i];
+   fi.nlinks=nlinks[i];
+   fi.defined=defined[i];
+   fi.filetype=(FileInfo::type)filetype[i];
+   fi.user=user[i];
+   fi.group=group[i];
+   return &fi;
+}
+
+int PackedFileSet::FindGEIndByName(const char *name) const
+{
+   int l=0,u=count();
+   while(l<u)
+   {
+      int m=(l+u)/2;
+      if(strcmp(Name(m),name)<0)
+	 l=m+1;
+      else
+	 u=m;
+   }
+   return l;
+}
+
+const FileInfo *PackedFileSet::FindByName(const char *name) const
+{
+   int i=FindGEIndByName(name);
+   if(i<count() && !strcmp(Name(i),name))
+      return (*this)[i];
+   return 0;
+}
+
+size_t PackedFileSet::EstimateMemory() const
+{
+   return sizeof(PackedFileSet)
+      +strings.capacity()
+      +name_pos.get_allocated_size()
+      +symlink_pos.get_allocated_size()
+      +size.get_allocated_size()
+      +date.get_allocated_size()
+      +date_prec.get_allocated_size()
+      +mode.get_allocated_size()
+      +nlinks.get_allocated_size()
+      +defined.get_allocated_size()
+      +filetype.get_allocated_size()
+      +user.get_allocated_size()
+      +group.get_allocated_size();
+}
@@ -48,15 +48,15 @@ class FileInfo
 {
    void def(unsigned m) { defined|=m; need&=~m; }
 public:
+   // the members are ordered to avoid padding, there can be millions of them.
    xstring  name;
-   xstring  longname;
+   xstring_c longname;
    xstring_c symlink;
    xstring_c uri;
-   mode_t   mode;
+   const char *user, *group;   // from StringPool
    FileTimestamp date;
    off_t    size;
-   xstring  data;
-   const char *user, *group;
+   mode_t   mode;
    int      nlinks;
 
    enum	 type
@@ -119,13 +119,11 @@ public:
    bool  SizeOutside(const Range *r) const;
    bool	 TypeIs(type t) const { return (defined&TYPE) && filetype==t; }
 
-   void	 SetAssociatedData(const void *d,int len) { data.nset((const char*)d,len); }
-   const void *GetAssociatedData() const { return data; }
-
    void SetRank(int r) { rank=r; }
    int GetRank() const { return rank; }
    void MakeLongName();
    void SetLongName(const char *s) { longname.set(s); }
+   void SetLongName(const char *s,int len) { longname.nset(s,len); }
    const char *GetLongName() { if(!longname) MakeLongName(); return longname; }
 
    operator const char *() const { return name; }
@@ -142,6 +140,8 @@ class PatternSet;
 
 class FileSet
 {
+   friend class PackedFileSet;
+
 public:
    enum sort_e { BYNAME, BYSIZE, DIRSFIRST, BYRANK, BYDATE, BYNAME_FLAT };
 
@@ -159,6 +159,9 @@ private:
 
    void add_before(int pos,FileInfo *fi);
    void assert_sorted() const;
+   bool is_sorted() const;
+
+   template<class P> void SubtractIf(const FileSet *set,const P& pred);
 
 public:
    FileSet();
@@ -237,8 +240,50 @@ public:
 
    FileInfo * operator[](int i) const;
 
+   void Compact();
    size_t EstimateMemory() const;
    void Dump(const char *tag) const;
 };
 
+/* A read-only copy of a FileSet for big sets which are only searched: the
+ * names and symlink targets are kept in one string, the other fields in
+ * arrays; user and group are pooled strings already. The longname is not
+ * kept. FileInfo is built on access and stays valid until the next one. */
+class PackedFileSet
+{
+   xstring strings;	    // NUL-terminated names and symlinks
+   xarray<unsigned> name_pos;
+   xarray<unsigned> symlink_pos;
+   xarray<off_t> size;
+   xarray<time_t> date;
+   xarray<int> date_prec;
+   xarray<mode_t> mode;
+   xarray<int> nlinks;
+   xarray<unsigned short> defined;
+   xarray<unsigned char> filetype;
+   xarray<const char*> user;
+   xarray<const char*> group;
+
+   mutable FileInfo fi;
+   int ind;
+
+   enum { NO_POS=~0U };
+   const char *Name(int i) const { return strings.get()+name_pos[i]; }
+   unsigned AddString(const char *s);
+
+public:
+   PackedFileSet(const FileSet *set);
+
+   int count() const { return name_pos.count(); }
+   const FileInfo *operator[](int i) const;
+   void rewind() { ind=0; }
+   const FileInfo *curr() const { return (*this)[ind]; }
+   const FileInfo *next() { ind++; return curr(); }
+
+   int FindGEIndByName(const char *name) const;
+   const FileInfo *FindByName(const char *name) const;
+
+   size_t EstimateMemory() const;
+};
+
 #endif // FILESET_H
@@ -63,6 +63,7 @@ void FDStream::DoCloseFD()
    if(fd!=-1) {
       if(close_when_done) {
 	 close(fd);
+	 SMTask::FDClosed(fd);
 	 Log::global->Format(11,"closed FD %d\n",fd);
       }
       fd=-1;
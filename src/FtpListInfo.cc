@@ -29,8 +29,6 @@
 #include "ftpclass.h"
 #include "ascii_ctype.h"
 
-#define number_of_parsers 7
-
 FileSet *FtpListInfo::Parse(const char *buf,int len)
 {
    if(mode==FA::LONG_LIST || mode==FA::MP_LIST)
@@ -58,96 +56,135 @@ FileSet *FtpListInfo::Parse(const char *buf,int len)
    }
 }
 
-FileSet *Ftp::ParseLongList(const char *buf,int len,int *err_ret) const
+int FtpListInfo::ParseMore(const char *buf,int len)
 {
-   if(err_ret)
-      *err_ret=0;
+   if(mode!=FA::LONG_LIST && mode!=FA::MP_LIST)
+      return 0;
+   if(stream && stream_mode!=mode)
+      stream=0;	  // the listing is being retried in another mode
+   if(!stream)
+   {
+      stream=static_cast<const Ftp*>(session.get())->NewLongListParser();
+      stream_mode=mode;
+      stream_parsed=0;
+   }
+   int res=stream->Parse(buf,len);
+   stream_parsed+=res;
+   return res;
+}
 
-   int err[number_of_parsers];
-   FileSet *set[number_of_parsers];
-   int i;
-   for(i=0; i<number_of_parsers; i++)
+FileSet *FtpListInfo::ParseEnd(const char *buf,int len)
+{
+   if(!stream || stream_mode!=mode || stream_parsed==0)
    {
-      err[i]=0;
-      set[i]=new FileSet;
+      stream=0;
+      return Parse(buf,len);
+   }
+   stream->Parse(buf,len);
+   int err;
+   FileSet *set=stream->GetResult(&err);
+   stream=0;
+   stream_parsed=0;
+   if(!set || err>0)
+   {
+      if(mode==FA::MP_LIST)
+	 mode=FA::LONG_LIST;
+      else
+	 mode=FA::LIST;
    }
+   return set;
+}
 
-   xstring line;
-   xstring tmp_line;
+Ftp::LongListParser *Ftp::NewLongListParser() const
+{
+   return new LongListParser(Query("timezone",hostname));
+}
 
-   FtpLineParser guessed_parser=0;
-   FileSet **the_set=0;
-   int *the_err=0;
-   int *best_err1=&err[0];
-   int *best_err2=&err[1];
+FileSet *Ftp::ParseLongList(const char *buf,int len,int *err_ret) const
+{
+   LongListParser parser(Query("timezone",hostname));
+   parser.Parse(buf,len);
+   return parser.GetResult(err_ret);
+}
 
-   const char *tz=Query("timezone",hostname);
+Ftp::LongListParser::LongListParser(const char *tz)
+   : tz(tz), guessed(-1), best_err1(0), best_err2(1), failed(false)
+{
+   for(int i=0; i<number_of_parsers; i++)
+   {
+      err[i]=0;
+      set[i]=new FileSet;
+   }
+}
 
-   for(;;)
+int Ftp::LongListParser::Parse(const char *buf,int len)
+{
+   const char *start=buf;
+   while(!failed)
    {
-      const char *nl=(char*)memchr(buf,'\n',len);
+      const char *nl=(const char*)memchr(buf,'\n',len);
       if(!nl)
 	 break;
       line.nset(buf,nl-buf);
       line.chomp('\r');
-      if(line.length()==0)
-      {
-	 len-=nl+1-buf;
-	 buf=nl+1;
-	 continue;
-      }
-
       len-=nl+1-buf;
       buf=nl+1;
+      if(line.length()>0)
+	 ParseLine();
+   }
+   return buf-start;
+}
 
-      if(!guessed_parser)
-      {
-	 for(i=0; i<number_of_parsers; i++)
-	 {
-	    tmp_line.set(line);	 // parser can clobber the line - work on a copy
-	    FileInfo *info=(*line_parsers[i])(tmp_line.get_non_const(),&err[i],tz);
-	    if(info && !strchr(info->name,'/'))
-	       set[i]->Add(info);
-	    else
-	       delete info;
-
-	    if(*best_err1>err[i])
-	       best_err1=&err[i];
-	    if(*best_err2>err[i] && best_err1!=&err[i])
-	       best_err2=&err[i];
-	    if(*best_err1>16)
-	       goto leave; // too many errors with best parser.
-	 }
-	 if(*best_err2 > (*best_err1+1)*16)
-	 {
-	    i=best_err1-err;
-	    guessed_parser=line_parsers[i];
-	    the_set=&set[i];
-	    the_err=&err[i];
-	 }
-      }
+void Ftp::LongListParser::ParseLine()
+{
+   if(guessed>=0)
+   {
+      FileInfo *info=(*line_parsers[guessed])(line.get_non_const(),&err[guessed],tz);
+      if(info && !strchr(info->name,'/'))
+	 set[guessed]->Add(info);
       else
+	 delete info;
+      return;
+   }
+   for(int i=0; i<number_of_parsers; i++)
+   {
+      tmp_line.set(line);	 // parser can clobber the line - work on a copy
+      FileInfo *info=(*line_parsers[i])(tmp_line.get_non_const(),&err[i],tz);
+      if(info && !strchr(info->name,'/'))
+	 set[i]->Add(info);
+      else
+	 delete info;
+
+      if(err[best_err1]>err[i])
+	 best_err1=i;
+      if(err[best_err2]>err[i] && best_err1!=i)
+	 best_err2=i;
+      if(err[best_err1]>16)
       {
-	 FileInfo *info=(*guessed_parser)(line.get_non_const(),the_err,tz);
-	 if(info && !strchr(info->name,'/'))
-	    (*the_set)->Add(info);
-	 else
-	    delete info;
+	 failed=true; // too many errors with best parser.
+	 return;
       }
    }
-   if(!the_set)
+   if(err[best_err2] > (err[best_err1]+1)*16)
    {
-      i=best_err1-err;
-      the_set=&set[i];
-      the_err=&err[i];
+      // lock onto the best parser and drop the other sets
+      guessed=best_err1;
+      for(int i=0; i<number_of_parsers; i++)
+	 if(i!=guessed)
+	    set[i]=0;
    }
-leave:
-   for(i=0; i<number_of_parsers; i++)
-      if(&set[i]!=the_set)
-	 delete set[i];
-   if(err_ret && the_err)
-      *err_ret=*the_err;
-   return the_set?*the_set:0;
+}
+
+FileSet *Ftp::LongListParser::GetResult(int *err_ret)
+{
+   if(err_ret)
+      *err_ret=0;
+   if(failed)
+      return 0;
+   int i=(guessed>=0 ? guessed : best_err1);
+   if(err_ret)
+      *err_ret=err[i];
+   return set[i].borrow();
 }
 
 FileSet *FtpListInfo::ParseShortList(const char *buf,int len)
@@ -214,7 +251,7 @@ static
 FileInfo *ParseFtpLongList_UNIX(char *line,int *err,const char *tz)
 {
    int	 tmp;
-   if(sscanf(line,"total %d",&tmp)==1)
+   if(line[0]=='t' && sscanf(line,"total %d",&tmp)==1)
       return 0;
    if(!strncasecmp(line,"Status of ",10))
       return 0;	  // STAT output.
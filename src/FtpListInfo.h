@@ -21,13 +21,20 @@
 #define FTPLISTINFO_H
 
 #include "NetAccess.h"
+#include "ftpclass.h"
 
 class FtpListInfo : public GenericParseListInfo
 {
    FileSet *ParseShortList(const char *buf,int len);
+   Ref<Ftp::LongListParser> stream;
+   int stream_mode;
+   int stream_parsed;
 public:
    virtual FileSet *Parse(const char *buf,int len);
-   FtpListInfo(FileAccess *session,const char *path) : GenericParseListInfo(session,path) {}
+   virtual int ParseMore(const char *buf,int len);
+   virtual FileSet *ParseEnd(const char *buf,int len);
+   FtpListInfo(FileAccess *session,const char *path)
+      : GenericParseListInfo(session,path), stream_mode(-1), stream_parsed(0) {}
 };
 
 #endif//FTPLISTINFO_H
@@ -127,6 +127,7 @@ Http::Connection::Connection(int s,const char *c)
 Http::Connection::~Connection()
 {
    close(sock);
+   SMTask::FDClosed(sock);
    /* make sure we free buffers before ssl */
    recv_buf=0;
    send_buf=0;
@@ -279,7 +280,10 @@ void Http::Close()
    if(mode==CLOSED)
       return;
    if(conn && conn->recv_buf)
+   {
+      conn->recv_buf->StopReceivingFile();
       conn->recv_buf->Roll();	// try to read any remaining data
+   }
    if(conn && keep_alive && (keep_alive_max>0 || keep_alive_max==-1)
    && !ModeIs(STORE) && !conn->recv_buf->Eof() && (state==RECEIVING_BODY || state==DONE))
    {
@@ -2016,6 +2020,7 @@ int Http::Read(Buffer *buf,int size)
    int res=DO_AGAIN;
    if(state==RECEIVING_BODY && real_pos>=0)
    {
+      conn->recv_buf->StopReceivingFile();
       Enter(this);
       res=_Read(buf,size);
       if(res>0)
@@ -2029,6 +2034,56 @@ int Http::Read(Buffer *buf,int size)
    }
    return res;
 }
+// splice the body from the socket, possible when it is sent as is.
+int Http::ReadToFile(int fd,off_t at,int size)
+{
+   if(Error())
+      return error_code;
+   if(mode==CLOSED)
+      return 0;
+   if(state==DONE)
+      return 0;	  // eof
+   if(state!=RECEIVING_BODY || real_pos<0)
+      return DO_AGAIN;
+   if(chunked || inflate || real_pos!=pos)
+      return NOT_SUPP;
+   if(body_size>=0)
+   {
+      if(bytes_received>=body_size)
+	 return 0;  // let Read handle it
+      if(size>body_size-bytes_received)
+	 size=body_size-bytes_received;
+   }
+   if(entity_size>=0 && pos>=entity_size)
+      return 0;
+   if(conn->recv_buf->Size()==0 && (conn->recv_buf->Eof() || conn->recv_buf->Error()))
+      return 0;
+   if(rate_limit)
+   {
+      int allowed=rate_limit->BytesAllowedToGet();
+      if(allowed==0)
+	 return DO_AGAIN;
+      if(size>allowed)
+	 size=allowed;
+   }
+   Enter(this);
+   int res=conn->recv_buf->ReceiveFile(fd,at,size);
+   if(res>0)
+   {
+      _UpdatePos(res);
+      pos+=res;
+      if(rate_limit)
+	 rate_limit->BytesGot(res);
+      TrySuccess();
+   }
+   Leave(this);
+   if(res<0)
+      return NOT_SUPP;
+   if(res==0)
+      return DO_AGAIN;
+   return res;
+}
+
 void Http::_Skip(int to_skip)
 {
    if(inflate)
@@ -2214,7 +2269,7 @@ int Http::Buffered()
    return conn->send_buf->Size()+SocketBuffered(conn->sock);
 }
 
-int Http::Write(const void *buf,int size)
+int Http::CanWrite(int size)
 {
    if(!ModeIs(STORE))
       return(0);
@@ -2234,8 +2289,6 @@ int Http::Write(const void *buf,int size)
       if(size>allowed)
 	 size=allowed;
    }
-   if(size+conn->send_buf->Size()>=max_buf)
-      size=max_buf-conn->send_buf->Size();
    if(entity_size!=NO_SIZE && pos+size>entity_size)
    {
       size=entity_size-pos;
@@ -2243,16 +2296,47 @@ int Http::Write(const void *buf,int size)
       if(size==0)
 	 return STORE_FAILED;
    }
-   if(size<=0)
-      return 0;
-
-   conn->send_buf->Put((const char*)buf,size);
+   return size;
+}
 
+void Http::Written(int size)
+{
    if(retries>0 && conn->send_buf->GetPos()-conn->send_buf->Size()>Buffered()+0x1000)
       TrySuccess();
    rate_limit->BytesPut(size);
    pos+=size;
    real_pos+=size;
+}
+
+int Http::Write(const void *buf,int size)
+{
+   size=CanWrite(size);
+   if(size<=0)
+      return size;
+
+   if(size+conn->send_buf->Size()>=max_buf)
+      size=max_buf-conn->send_buf->Size();
+   if(size<=0)
+      return 0;
+
+   conn->send_buf->Put((const char*)buf,size);
+   Written(size);
+   return(size);
+}
+
+// sendfile to the socket, the request body is sent as is.
+int Http::WriteFromFile(int fd,off_t at,int size)
+{
+   size=CanWrite(size);
+   if(size<=0)
+      return size;
+
+   size=conn->send_buf->SendFile(fd,at,size);
+   if(size<0)
+      return NOT_SUPP;
+   if(size==0)
+      return DO_AGAIN;
+   Written(size);
    return(size);
 }
 
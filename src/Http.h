@@ -194,6 +194,8 @@ class Http : public NetAccess
    int _Read(Buffer *,int);  // does not update pos, rate_limit, retries, does not check state.
    void _Skip(int to_skip); // skip in recv_buf or inflate (unless moved), update real_pos
    void _UpdatePos(int to_skip); // update real_pos, chunk_pos etc.
+   int CanWrite(int size); // checks state and limits before Write
+   void Written(int size); // updates pos, rate_limit, retries after Write
 
 protected:
    bool hftp;  // ftp over http proxy.
@@ -217,6 +219,8 @@ public:
    int Done();
    int Read(Buffer *,int);
    int Write(const void *,int);
+   int WriteFromFile(int fd,off_t at,int size);
+   int ReadToFile(int fd,off_t at,int size);
    int StoreStatus();
    int SendEOT();
    int Buffered();
@@ -373,6 +373,26 @@ read_again:
    return(res);
 }
 
+int LocalAccess::GetLocalFile(off_t *at,off_t *avail)
+{
+   if(mode!=RETRIEVE || ascii || error_code<0 || !stream)
+      return -1;
+   int fd=stream->fd;
+   if(fd==-1 || (real_pos!=-1 && real_pos!=pos))
+      return -1;
+   struct stat st;
+   if(fstat(fd,&st)==-1 || !S_ISREG(st.st_mode))
+      return -1;
+   *at=pos;
+   *avail=st.st_size-pos;
+   return fd;
+}
+void LocalAccess::SkipLocalFile(int len)
+{
+   pos+=len;
+   real_pos=-1;	// the file offset has not changed, seek on next Read.
+}
+
 int LocalAccess::Write(const void *vbuf,int len)
 {
    const char *buf=(const char *)vbuf;
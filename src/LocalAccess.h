@@ -47,6 +47,8 @@ public:
 
    int Read(Buffer *buf,int size);
    int Write(const void *buf,int size);
+   int GetLocalFile(off_t *at,off_t *avail);
+   void SkipLocalFile(int len);
    int StoreStatus();
    int Do();
    int Done();
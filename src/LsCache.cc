@@ -19,6 +19,7 @@
 
 #include <config.h>
 #include <assert.h>
+#include "c-ctype.h"
 #include "FileAccess.h"
 #include "LsCache.h"
 #include "plural.h"
@@ -55,7 +56,8 @@ LsCacheEntry::LsCacheEntry(const FileAccess *p_loc,const char *a,int m,int e,con
 void LsCacheEntryData::SetData(int e,const char *d,int l,const FileSet *fs)
 {
    afset=fs?new FileSet(fs):0;
-   data.nset(d,l);
+   has_data=(d || !fs);
+   data.nset(d?d:"",d?l:0);
    err_code=e;
 }
 void LsCacheEntryData::GetData(int *e,const char **d,int *l,const FileSet **fs)
@@ -73,20 +75,61 @@ bool LsCacheEntryLoc::Matches(const FileAccess *p_loc,const char *a,int m)
 {
    return (m==-1 || mode==m) && arg.eq(a) && p_loc->SameLocationAs(loc);
 }
+/* Hash of the part of location identity that SameLocationAs compares in
+ * every protocol: proto, host name (case insensitive) and cwd, plus the
+ * argument.  The mode is left out so that lookups with m==-1 find all
+ * modes in one bucket; Matches resolves the rest. */
+unsigned LsCacheEntryLoc::Hash(const FileAccess *p_loc,const char *a)
+{
+   unsigned h=0x12345678;
+   const char *s;
+   for(s=p_loc->GetProto(); *s; s++)
+      h+=(h<<5)+*s;
+   h+=(h<<5)+'/';
+   for(s=p_loc->GetHostName(); s && *s; s++)
+      h+=(h<<5)+c_tolower(*s);
+   h+=(h<<5)+'/';
+   for(s=p_loc->GetCwd(); s && *s; s++)
+      h+=(h<<5)+*s;
+   h+=(h<<5)+'/';
+   for(s=a; s && *s; s++)
+      h+=(h<<5)+*s;
+   return h;
+}
 
 ResDecl res_cache_empty_listings("cache:cache-empty-listings","no",ResMgr::BoolValidate,0);
 ResDecl res_cache_enable("cache:enable","yes",ResMgr::BoolValidate,0);
 ResDecl res_cache_expire("cache:expire","60m",ResMgr::TimeIntervalValidate,0);
 ResDecl res_cache_expire_neg("cache:expire-negative","1m",ResMgr::TimeIntervalValidate,0);
 ResDecl res_cache_size  ("cache:size","16M",ResMgr::UNumberValidate,ResMgr::NoClosure);
+ResDecl res_cache_persist("cache:persist","no",ResMgr::BoolValidate,0);
 
 LsCache::LsCache() : Cache(&res_cache_size,&res_cache_enable) {}
 
+LsCacheFile *LsCache::GetDisk(const FileAccess *p_loc)
+{
+   if(!strcmp(p_loc->GetProto(),"file"))
+      return 0;
+   if(!res_cache_persist.QueryBool(p_loc->GetHostName()))
+      return 0;
+   if(!disk)
+      disk=new LsCacheFile();
+   return disk.get_non_const();
+}
+
+void LsCache::Flush()
+{
+   Cache::Flush();
+   if(disk)
+      disk->Flush();
+}
+
 void LsCache::Add(const FileAccess *p_loc,const char *a,int m,int e,const char *d,int l,const FileSet *fs)
 {
    if(!strcmp(p_loc->GetProto(),"file"))
       return;  // don't cache local objects
-   if(l == 0 &&
+   bool empty=(d ? l==0 : (!fs || fs->count()==0));
+   if(empty &&
 	 !res_cache_empty_listings.QueryBool(p_loc->GetHostName()))
       return;
    if(e!=FA::OK && e!=FA::NO_FILE && e!=FA::NOT_SUPP)
@@ -99,12 +142,16 @@ void LsCache::Add(const FileAccess *p_loc,const char *a,int m,int e,const char *
    {
       if(!IsEnabled(p_loc->GetHostName()))
 	 return;
-      AddCacheEntry(new LsCacheEntry(p_loc,a,m,e,d,l,fs));
+      AddCacheEntry(new LsCacheEntry(p_loc,a,m,e,d,l,fs),LsCacheEntryLoc::Hash(p_loc,a));
    }
    else
    {
       c->SetData(e,d,l,fs);
+      Resized(c);
    }
+   LsCacheFile *f=(d?GetDisk(p_loc):0);
+   if(f)
+      f->Add(p_loc,a,m,e,d,l);
 }
 
 void LsCache::Add(const FileAccess *p_loc,const char *a,int m,int e,const Buffer *ubuf,const FileSet *fs)
@@ -129,24 +176,46 @@ LsCacheEntry *LsCache::Find(const FileAccess *p_loc,const char *a,int m)
    if(!IsEnabled(p_loc->GetHostName()))
       return 0;
 
+   unsigned h=LsCacheEntryLoc::Hash(p_loc,a);
    LsCacheEntry *c;
-   for(c=IterateFirst(); c; c=IterateNext())
+   for(c=HashFirst(h); c; c=HashNext(c))
    {
       if(c->Matches(p_loc,a,m))
 	 break;
    }
-   if(c && c->Stopped())
+   if(!c)
+      return m==-1 ? 0 : FindOnDisk(p_loc,a,m,h);
+   if(c->Stopped())
    {
-      Trim();
+      Delete(c);
       return 0;
    }
+   Touch(c);
+   return c;
+}
+
+// load a listing saved by this or an earlier lftp run
+LsCacheEntry *LsCache::FindOnDisk(const FileAccess *p_loc,const char *a,int m,unsigned h)
+{
+   LsCacheFile *f=GetDisk(p_loc);
+   if(!f)
+      return 0;
+   int e;
+   time_t stamp;
+   xstring data;
+   if(!f->Find(p_loc,a,m,&e,data,&stamp))
+      return 0;
+   LsCacheEntry *c=new LsCacheEntry(p_loc,a,m,e,data,data.length(),0);
+   c->Reset(Time(stamp)); // expire relative to the time of listing
+   Trim();
+   AddCacheEntry(c,h);
    return c;
 }
 
 bool LsCache::Find(const FileAccess *p_loc,const char *a,int m,int *e,const char **d,int *l,const FileSet **fs)
 {
    LsCacheEntry *c=Find(p_loc,a,m);
-   if(!c)
+   if(!c || !c->HasData())
       return false;
    c->GetData(e,d,l,fs);
    return true;
@@ -157,13 +226,15 @@ const FileSet *LsCache::FindFileSet(const FileAccess *p_loc,const char *a,int m)
    LsCacheEntry *c=Find(p_loc,a,m);
    if(!c)
       return 0;
-   return c->GetFileSet(c->loc);
+   const FileSet *fs=c->GetFileSet(c->loc);
+   Resized(c);
+   return fs;
 }
 const FileSet *LsCacheEntryData::GetFileSet(const FileAccess *parser)
 {
    if(afset)
       return afset;
-   if(err_code!=FA::OK)
+   if(err_code!=FA::OK || !has_data)
       return 0;
    afset=parser->ParseLongList(data, data.length());
    return afset;
@@ -177,15 +248,15 @@ void LsCache::UpdateFileSet(const FileAccess *p_loc,const char *a,int m,const Fi
    if(!c)
       return;
    c->UpdateFileSet(fs);
+   Resized(c);
 }
 
 void LsCache::List()
 {
+   Expire();
    Trim();
 
-   long vol=0;
-   for(LsCacheEntry *c=IterateFirst(); c; c=IterateNext())
-      vol+=c->EstimateSize();
+   long vol=TotalSize();
 
    printf(plural("%ld $#l#byte|bytes$ cached",vol),vol);
 
@@ -214,6 +285,9 @@ void LsCache::Changed(change_mode m,const FileAccess *f,const char *dir)
       else
 	 c=IterateNext();
    }
+   LsCacheFile *disk_file=GetDisk(f);
+   if(disk_file)
+      disk_file->Changed(m==TREE_CHANGED,f,fdir);
 }
 
 /* Mark a path as a directory or file. (We have other ways of knowing this;
@@ -23,6 +23,7 @@
 #include <time.h>
 #include "Cache.h"
 #include "FileAccess.h"
+#include "LsCacheFile.h"
 
 class Buffer;
 class FileAccess;
@@ -39,19 +40,22 @@ public:
    LsCacheEntryLoc(const FileAccess *p_loc,const char *a,int m);
    int EstimateSize() const { return xstrlen(arg)+(arg!=0); }
    const char *GetClosure() const;
+   static unsigned Hash(const FileAccess *p_loc,const char *a);
 };
 class LsCacheEntryData
 {
    int	 err_code;
    xstring data;
+   bool	 has_data;	  // false if only the file set is cached
    Ref<FileSet> afset;    // associated file set
 public:
+   bool HasData() const { return has_data; }
    LsCacheEntryData(int e,const char *d,int l,const FileSet *fs);
    void SetData(int e,const char *d,int l,const FileSet *fs);
    void GetData(int *e,const char **d,int *l,const FileSet **fs);
    const FileSet *GetFileSet(const FileAccess *parser);
    void UpdateFileSet(const FileSet *fs) { if(afset) afset->Merge(fs); }
-   int EstimateSize() const { return data.length()+(afset?afset->EstimateMemory():0); }
+   int EstimateSize() const { return data.capacity()+(afset?afset->EstimateMemory():0); }
 };
 
 class LsCacheEntry : public CacheEntry, public LsCacheEntryLoc, public LsCacheEntryData
@@ -63,16 +67,25 @@ public:
 
 class LsCache : public Cache
 {
+   Ref<LsCacheFile> disk;
+   LsCacheFile *GetDisk(const FileAccess *p_loc);
+   LsCacheEntry *FindOnDisk(const FileAccess *p_loc,const char *a,int m,unsigned h);
    LsCacheEntry *Find(const FileAccess *p_loc,const char *a,int m);
    LsCacheEntry *IterateFirst() { return (LsCacheEntry*)Cache::IterateFirst(); }
    LsCacheEntry *IterateNext()  { return (LsCacheEntry*)Cache::IterateNext(); }
    LsCacheEntry *IterateDelete(){ return (LsCacheEntry*)Cache::IterateDelete(); }
+   LsCacheEntry *HashFirst(unsigned h) { return (LsCacheEntry*)Cache::HashFirst(h); }
+   LsCacheEntry *HashNext(LsCacheEntry *c) { return (LsCacheEntry*)Cache::HashNext(c); }
 public:
    LsCache();
+   void Flush();
+   // d can be 0 to cache the file set only, it is not found by Find then.
    void Add(const FileAccess *p_loc,const char *a,int m,int err,const char *d,int l,const FileSet *f=0);
    void Add(const FileAccess *p_loc,const char *a,int m,int err,const Buffer *ubuf,const FileSet *f=0);
    bool Find(const FileAccess *p_loc,const char *a,int m,int *err,const char **d, int *l,const FileSet **f=0);
    const FileSet *FindFileSet(const FileAccess *p_loc,const char *a,int m);
+   // true if listings from p_loc are also saved on disk (cache:persist).
+   bool IsPersistent(const FileAccess *p_loc) { return GetDisk(p_loc)!=0; }
    void UpdateFileSet(const FileAccess *p_loc,const char *a,int m,const FileSet *fs);
 
    int IsDirectory(const FileAccess *p_loc,const char *dir);
@@ -0,0 +1,419 @@
+/*
+ * lftp - file transfer program
+ *
+ * Copyright (c) 1996-2017 by Alexander V. Lukyanov (lav@yars.free.net)
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <config.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdlib.h>
+#include "LsCacheFile.h"
+#include "ResMgr.h"
+#include "misc.h"
+#include "log.h"
+
+#define FIELD_UNSAFE " %"
+
+LsCacheFile::LsCacheFile()
+{
+   fd=-1;
+   dev=0;
+   ino=0;
+   loaded=0;
+   live_bytes=0;
+   refreshed=0;
+   const char *home=get_lftp_cache_dir();
+   if(home)
+      file.vset(home,"/ls_cache",NULL);
+}
+LsCacheFile::~LsCacheFile()
+{
+   Close();
+}
+
+bool LsCacheFile::Open()
+{
+   if(fd!=-1)
+      return true;
+   if(!file)
+      return false;
+   fd=open(file,O_RDWR|O_APPEND|O_CREAT,0600);
+   if(fd==-1)
+   {
+      debug((9,"%s: %s\n",file.get(),strerror(errno)));
+      file.unset(); // don't try again
+      return false;
+   }
+   fcntl(fd,F_SETFD,FD_CLOEXEC);
+   struct stat st;
+   fstat(fd,&st);
+   dev=st.st_dev;
+   ino=st.st_ino;
+   index.empty();
+   loaded=0;
+   live_bytes=0;
+   Refresh();
+   if(loaded>(1<<20) && live_bytes<loaded/2)
+      Compact();
+   return fd!=-1;
+}
+bool LsCacheFile::Replaced() const
+{
+   struct stat st;
+   return stat(file,&st)==-1 || st.st_dev!=dev || st.st_ino!=ino;
+}
+bool LsCacheFile::Lock(int type)
+{
+   struct flock lk;
+   memset(&lk,0,sizeof(lk));
+   lk.l_type=type;
+   lk.l_whence=SEEK_SET;
+   return fcntl(fd,type==F_UNLCK?F_SETLK:F_SETLKW,&lk)!=-1;
+}
+void LsCacheFile::Close()
+{
+   if(fd==-1)
+      return;
+   close(fd);
+   fd=-1;
+}
+
+/* The key has site, path and arg separated by NULs, followed by the mode. */
+const xstring& LsCacheFile::MakeKey(const FileAccess *p_loc,const char *a,int m)
+{
+   static xstring key;
+   key.set(p_loc->GetConnectURL(FA::NO_PATH|FA::NO_PASSWORD));
+   key.append('\0');
+   key.append(p_loc->GetCwd().path?p_loc->GetCwd().path.get():"");
+   key.append('\0');
+   key.append(a?a:"");
+   key.append('\0');
+   key.appendf("%d",m);
+   return key;
+}
+static void split_key(const xstring& key,const char **site,const char **path,const char **arg,int *m)
+{
+   *site=key;
+   *path=*site+strlen(*site)+1;
+   *arg=*path+strlen(*path)+1;
+   *m=atoi(*arg+strlen(*arg)+1);
+}
+
+void LsCacheFile::FormatRecord(xstring& rec,char op,time_t stamp,int e,int len,
+   const char *closure,const xstring& key)
+{
+   const char *site,*path,*arg;
+   int m;
+   split_key(key,&site,&path,&arg,&m);
+   rec.appendf("%c %ld %d %d %d ",op,(long)stamp,m,e,len);
+   rec.append_url_encoded(closure?closure:"",FIELD_UNSAFE).append(' ');
+   rec.append_url_encoded(site,FIELD_UNSAFE).append(' ');
+   rec.append_url_encoded(path,FIELD_UNSAFE).append(' ');
+   rec.append_url_encoded(arg,FIELD_UNSAFE).append('\n');
+}
+
+/* Index complete records in buf, which holds the file data starting at
+ * offset pos. Returns the number of bytes consumed, or -1 if the data is
+ * not in the expected format; a record cut by the end of buf is left for
+ * the next call. */
+int LsCacheFile::IndexRecords(const char *buf,int len,off_t pos)
+{
+   const char *scan=buf;
+   const char *end=buf+len;
+   while(scan<end)
+   {
+      const char *nl=(const char*)memchr(scan,'\n',end-scan);
+      if(!nl)
+	 break;
+      char op;
+      long stamp;
+      int m,e,dlen,n=0;
+      if(sscanf(scan,"%c %ld %d %d %d%n",&op,&stamp,&m,&e,&dlen,&n)<5
+      || n==0 || scan+n>=nl || scan[n]!=' ' || (op!='+' && op!='-') || dlen<0)
+	 return -1;
+      if(nl+1+dlen+1>end)
+	 break;
+      if(nl[1+dlen]!='\n')
+	 return -1;
+
+      // closure, site, path and arg
+      xstring field[4];
+      const char *f=scan+n+1;
+      for(int i=0; i<4; i++)
+      {
+	 const char *sp=(i<3?(const char*)memchr(f,' ',nl-f):nl);
+	 if(!sp)
+	    return -1;
+	 field[i].nset(f,sp-f);
+	 field[i].url_decode();
+	 f=sp+1;
+      }
+      xstring key;
+      key.nset(field[1],field[1].length());
+      key.append('\0').append(field[2]).append('\0').append(field[3]).append('\0');
+      key.appendf("%d",m);
+
+      Record *old=index.lookup(key);
+      if(old)
+      {
+	 live_bytes-=old->rec_len;
+	 index.remove(key);
+      }
+      if(op=='+')
+      {
+	 Record *r=new Record;
+	 r->data_pos=pos+(nl+1-buf);
+	 r->data_len=dlen;
+	 r->err_code=e;
+	 r->rec_len=nl+1+dlen+1-scan;
+	 r->stamp=stamp;
+	 r->closure.set(field[0][0]?field[0].get():0);
+	 index.add(key,r);
+	 live_bytes+=r->rec_len;
+      }
+      scan=nl+1+dlen+1;
+   }
+   return scan-buf;
+}
+
+/* Index the records added by other lftp processes. Unless forced, the file
+ * is checked at most once a second, the memory cache is tried first anyway. */
+void LsCacheFile::Refresh(bool force)
+{
+   if(fd==-1)
+      return;
+   time_t t=SMTask::now.UnixTime();
+   if(!force && refreshed==t)
+      return;
+   refreshed=t;
+   if(Replaced())
+   {
+      // the file was compacted or removed by another lftp
+      Close();
+      Open();
+      return;
+   }
+   struct stat st;
+   if(fstat(fd,&st)==-1)
+      return;
+   IndexTail(st.st_size);
+}
+void LsCacheFile::IndexTail(off_t size)
+{
+   if(size<loaded)
+   {
+      index.empty();
+      loaded=0;
+      live_bytes=0;
+   }
+   xstring buf;
+   int want=0x10000;
+   while(loaded<size)
+   {
+      buf.get_space(want);
+      int res=pread(fd,buf.get_non_const(),want,loaded);
+      if(res<=0)
+	 break;
+      buf.set_length(res);
+      int used=IndexRecords(buf,res,loaded);
+      if(used<0)
+      {
+	 debug((1,"%s: broken record at offset %lld\n",file.get(),(long long)loaded));
+	 loaded=size;
+	 break;
+      }
+      if(used==0)
+      {
+	 if(res<want)
+	    break;   // a record being written by another lftp
+	 want*=2;    // a record larger than the buffer
+	 continue;
+      }
+      loaded+=used;
+   }
+}
+
+bool LsCacheFile::Expired(const Record *r) const
+{
+   const char *res=(r->err_code==FA::OK?"cache:expire":"cache:expire-negative");
+   return TimeIntervalR(ResMgr::Query(res,r->closure)).Finished(Time(r->stamp));
+}
+
+void LsCacheFile::Append(const xstring& rec)
+{
+   // a compacting lftp holds the exclusive lock until the new file is in
+   // place; the old one must not be written after that.
+   for(int tries=0; ; tries++)
+   {
+      if(!Lock(F_RDLCK) || !Replaced() || tries>=2)
+	 break;
+      Close();
+      if(!Open())
+	 return;
+   }
+   if(write(fd,rec,rec.length())!=(int)rec.length())
+      debug((9,"%s: %s\n",file.get(),strerror(errno)));
+   Lock(F_UNLCK);
+}
+
+void LsCacheFile::Add(const FileAccess *p_loc,const char *a,int m,int e,const char *d,int l)
+{
+   if(!Open())
+      return;
+   xstring rec;
+   FormatRecord(rec,'+',SMTask::now.UnixTime(),e,l,p_loc->GetHostName(),MakeKey(p_loc,a,m));
+   rec.append(d,l).append('\n');
+   Append(rec);
+   Refresh();
+}
+
+bool LsCacheFile::Find(const FileAccess *p_loc,const char *a,int m,int *e,xstring& data,time_t *stamp)
+{
+   if(!Open())
+      return false;
+   Refresh(false);
+   const xstring& key=MakeKey(p_loc,a,m);
+   Record *r=index.lookup(key);
+   if(!r)
+      return false;
+   if(Expired(r))
+      return false;
+   data.get_space(r->data_len);
+   if(pread(fd,data.get_non_const(),r->data_len,r->data_pos)!=r->data_len)
+      return false;
+   data.set_length(r->data_len);
+   *e=r->err_code;
+   *stamp=r->stamp;
+   return true;
+}
+
+// dir is top or below it; top is len bytes long.
+static bool in_tree(const char *dir,const char *top,size_t len)
+{
+   if(strncmp(dir,top,len))
+      return false;
+   return len==0 || top[len-1]=='/' || dir[len]==0 || dir[len]=='/';
+}
+
+void LsCacheFile::Changed(bool tree,const FileAccess *f,const char *fdir)
+{
+   if(!Open())
+      return;
+   Refresh();
+   xstring site(f->GetConnectURL(FA::NO_PATH|FA::NO_PASSWORD));
+   const char *cwd=f->GetCwd();
+   size_t fdir_len=strlen(fdir);
+   xstring recs;
+   for(Record *r=index.each_begin(); r; r=index.each_next())
+   {
+      const xstring& key=index.each_key();
+      const char *k_site,*k_path,*k_arg;
+      int k_mode;
+      split_key(key,&k_site,&k_path,&k_arg,&k_mode);
+      if(strcmp(k_site,site))
+	 continue;
+      if(xstrcmp(k_path,cwd))
+      {
+	 const char *dir=dir_file(k_path,k_arg);
+	 if(tree ? !in_tree(dir,fdir,fdir_len) : strcmp(fdir,dir))
+	    continue;
+      }
+      FormatRecord(recs,'-',SMTask::now.UnixTime(),0,0,r->closure,key);
+      recs.append('\n');
+   }
+   if(!recs)
+      return;
+   Append(recs);
+   Refresh();
+}
+
+void LsCacheFile::Flush()
+{
+   if(!Open())
+      return;
+   if(ftruncate(fd,0)==-1)
+      return;
+   index.empty();
+   loaded=0;
+   live_bytes=0;
+}
+
+/* Rewrite the file with the live records only. */
+void LsCacheFile::Compact()
+{
+   struct flock lk;
+   memset(&lk,0,sizeof(lk));
+   lk.l_type=F_WRLCK;
+   lk.l_whence=SEEK_SET;
+   if(fcntl(fd,F_SETLK,&lk)==-1)
+      return;  // another lftp is compacting or appending
+   if(Replaced())
+   {
+      Lock(F_UNLCK);
+      return;  // compacted by another lftp
+   }
+   // appenders are blocked now, take the records added since the snapshot.
+   struct stat st;
+   if(fstat(fd,&st)==-1)
+   {
+      Lock(F_UNLCK);
+      return;
+   }
+   IndexTail(st.st_size);
+
+   xstring new_file;
+   new_file.vset(file.get(),".new",NULL);
+   int nfd=open(new_file,O_WRONLY|O_CREAT|O_TRUNC,0600);
+   if(nfd==-1)
+   {
+      Lock(F_UNLCK);
+      return;
+   }
+   xstring rec;
+   for(Record *r=index.each_begin(); r; r=index.each_next())
+   {
+      if(Expired(r))
+	 continue;
+      rec.truncate();
+      FormatRecord(rec,'+',r->stamp,r->err_code,r->data_len,r->closure,index.each_key());
+      int hlen=rec.length();
+      rec.get_space(hlen+r->data_len+1);
+      if(pread(fd,rec.get_non_const()+hlen,r->data_len,r->data_pos)!=r->data_len)
+	 continue;
+      rec.set_length(hlen+r->data_len);
+      rec.append('\n');
+      if(write(nfd,rec,rec.length())!=(int)rec.length())
+      {
+	 close(nfd);
+	 unlink(new_file);
+	 Lock(F_UNLCK);
+	 return;
+      }
+   }
+   close(nfd);
+   if(rename(new_file,file)==-1)
+   {
+      unlink(new_file);
+      Lock(F_UNLCK);
+      return;
+   }
+   Close();
+   Open();
+}
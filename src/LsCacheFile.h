@@ -0,0 +1,85 @@
+/*
+ * lftp - file transfer program
+ *
+ * Copyright (c) 1996-2017 by Alexander V. Lukyanov (lav@yars.free.net)
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef LSCACHEFILE_H
+#define LSCACHEFILE_H
+
+#include "xmap.h"
+#include "FileAccess.h"
+
+/* Append-only file with directory listings, shared by lftp processes.
+ *
+ * Every record is a header line
+ *    <op> <time> <mode> <error> <length> <closure> <site> <path> <arg>
+ * followed by <length> bytes of listing data and a newline. The op is `+'
+ * for a new listing and `-' for an invalidated one; text fields are url
+ * encoded. Only the header is kept in memory, the data is read back when
+ * the listing is requested.
+ *
+ * Appenders hold a shared lock on the file; compaction takes an exclusive
+ * one and replaces the file by rename, so an appender finding the file
+ * replaced reopens it. */
+class LsCacheFile
+{
+   struct Record
+   {
+      off_t data_pos;
+      int data_len;
+      int rec_len;
+      int err_code;
+      time_t stamp;
+      xstring_c closure;
+   };
+   xmap_p<Record> index;
+
+   xstring file;
+   int fd;
+   dev_t dev;
+   ino_t ino;
+   off_t loaded;     // the file is indexed up to this offset
+   off_t live_bytes; // bytes of records still in the index
+   time_t refreshed; // when the file was last checked for changes
+
+   bool Open();
+   void Close();
+   bool Replaced() const;
+   bool Lock(int type);
+   void Refresh(bool force=true);
+   void IndexTail(off_t size);
+   int IndexRecords(const char *buf,int len,off_t pos);
+   void Compact();
+   bool Expired(const Record *r) const;
+
+   static const xstring& MakeKey(const FileAccess *p_loc,const char *a,int m);
+   static void FormatRecord(xstring& rec,char op,time_t stamp,int e,int len,
+	    const char *closure,const xstring& key);
+   void Append(const xstring& rec);
+
+public:
+   LsCacheFile();
+   ~LsCacheFile();
+
+   void Add(const FileAccess *p_loc,const char *a,int m,int e,const char *d,int l);
+   bool Find(const FileAccess *p_loc,const char *a,int m,int *e,xstring& data,time_t *stamp);
+   void Changed(bool tree,const FileAccess *f,const char *fdir);
+   void Flush();
+   int Count() const { return index.count(); }
+};
+
+#endif//LSCACHEFILE_H
@@ -302,14 +302,21 @@ void  MirrorJob::HandleFile(FileInfo *file)
 	 bool remove_target=false;
 	 bool cont_this=false;
 	 bool use_pget=(pget_n>1) && target_is_local;
+	 bool use_delta=false;
 	 if(file->Has(file->SIZE) && file->size<pget_minchunk*2)
 	    use_pget=false;
 	 if(target_is_local)
 	 {
 	    if(lstat(target_name,&st)!=-1)
 	    {
+	       // update the old file in place sending only the changes.
+	       // That is only allowed where the file would be overwritten
+	       // anyway, not removed first or replaced by a temp file.
+	       use_delta=source_is_local && S_ISREG(st.st_mode) && !FlagSet(ASCII)
+		  && FlagSet(OVERWRITE) && ResMgr::QueryBool("xfer:delta",0)
+		  && FileCopy::TempFileName(file->name)==file->name;
 	       // few safety checks.
-	       FileInfo *old=new_files_set->FindByName(file->name);
+	       const FileInfo *old=new_files_set->FindByName(file->name);
 	       if(old)
 		  goto skip;  // file has appeared after mirror start
 	       old=old_files_set->FindByName(file->name);
@@ -339,7 +346,9 @@ void  MirrorJob::HandleFile(FileInfo *file)
 	    }
 	    else if(!to_rm_mismatched->FindByName(file->name))
 	    {
-	       if(!FlagSet(OVERWRITE)) {
+	       if(use_delta) {
+		  Report(_("Updating old file `%s'"),target_name_rel);
+	       } else if(!FlagSet(OVERWRITE)) {
 		  remove_target=true;
 		  Report(_("Removing old file `%s'"),target_name_rel);
 	       } else {
@@ -386,14 +395,21 @@ void  MirrorJob::HandleFile(FileInfo *file)
 	       goto skip;
 	 }
 
+	 if(cont_this)
+	    use_delta=false;
+
 	 FileCopyPeer *src_peer=0;
-	 if(source_is_local)
+	 if(use_delta)
+	    src_peer=new FileCopyPeerDeltaGet(source_name,target_name);
+	 else if(source_is_local)
 	    src_peer=new FileCopyPeerFDStream(new FileStream(source_name,O_RDONLY),FileCopyPeer::GET);
 	 else
 	    src_peer=new FileCopyPeerFA(source_session->Clone(),file->name,FA::RETRIEVE);
 
 	 FileCopyPeer *dst_peer=0;
-	 if(target_is_local)
+	 if(use_delta)
+	    dst_peer=new FileCopyPeerDeltaPut(target_name);
+	 else if(target_is_local)
 	    dst_peer=new FileCopyPeerFDStream(new FileStream(target_name,O_WRONLY|O_CREAT|(cont_this?0:O_TRUNC)),FileCopyPeer::PUT);
 	 else
 	    dst_peer=new FileCopyPeerFA(target_session->Clone(),dst_name,FA::STORE);
@@ -405,10 +421,13 @@ void  MirrorJob::HandleFile(FileInfo *file)
 	    c->RemoveTargetFirst();
 	 if(FlagSet(ASCII))
 	    c->Ascii();
+	 if(use_delta)
+	    use_pget=false;
 	 CopyJob *cp=(use_pget ? new pgetJob(c,file->name,pget_n) : new CopyJob(c,file->name,"mirror"));
 	 if(file->Has(file->DATE))
 	    cp->SetDate(file->date);
-	 if(file->Has(file->SIZE) && !FlagSet(IGNORE_SIZE))
+	 // the delta is shorter than the file.
+	 if(file->Has(file->SIZE) && !FlagSet(IGNORE_SIZE) && !use_delta)
 	    cp->SetSize(file->size);
 	 TransferStarted(cp);
 	 cp->cmdline.vset("\\transfer `",source_name_rel,"'",NULL);
@@ -567,15 +586,19 @@ void  MirrorJob::HandleFile(FileInfo *file)
 	 Report(_("Making symbolic link `%s' to `%s'"),target_name_rel,file->symlink.get());
 	 res=symlink(file->symlink,target_name);
 	 if(res==-1)
+	 {
 	    eprintf("mirror: symlink(%s): %s\n",target_name,strerror(errno));
+	    goto skip;
+	 }
 	 RemoveSourceLater(file);
 	 break;
       }
    case FileInfo::UNKNOWN:
       break;
    }
-skip:
    return;
+skip:
+   SkipFile(file);
 }
 
 void  MirrorJob::InitSets(Ref<FileSet>& source,const FileSet *dest)
@@ -637,12 +660,14 @@ void  MirrorJob::InitSets(Ref<FileSet>& source,const FileSet *dest)
    if(skip_noaccess)
       to_transfer->ExcludeUnaccessible(source_session->GetUser());
 
-   new_files_set=new FileSet(to_transfer);
-   new_files_set->SubtractAny(dest);
-   old_files_set=new FileSet(dest);
-   old_files_set->SubtractNotIn(to_transfer);
+   Ref<FileSet> new_files(new FileSet(to_transfer));
+   new_files->SubtractAny(dest);
+   Ref<FileSet> old_files(new FileSet(dest));
+   old_files->SubtractNotIn(to_transfer);
+   // these are only searched for the files to transfer.
+   old_files_set=new PackedFileSet(old_files);
 
-   to_rm_mismatched=new FileSet(old_files_set);
+   to_rm_mismatched=old_files.borrow();
    to_rm_mismatched->SubtractSameType(to_transfer);
    to_rm_mismatched->SubtractNotDirs();
 
@@ -655,8 +680,9 @@ void  MirrorJob::InitSets(Ref<FileSet>& source,const FileSet *dest)
       to_transfer->SubtractDirs();
       same->UnsortFlat();
       to_mkdir->Empty();
-      new_files_set->UnsortFlat();
+      new_files->UnsortFlat();
    }
+   new_files_set=new PackedFileSet(new_files);
 
    const char *sort_by=ResMgr::Query("mirror:sort-by",0);
    bool desc=strstr(sort_by,"-desc");
@@ -687,6 +713,28 @@ void  MirrorJob::InitSets(Ref<FileSet>& source,const FileSet *dest)
    root_transfer_count is initialized once in ctor, so that change of
    mirror:parallel-directories setting won't disbalance the count.
 */
+/* The target directory as left by this directory's run, for the journal.
+ * Transferred files are expected to have the source size and date; the
+ * files HandleFile skipped keep their old entries. It is only called when
+ * no job has failed. Excluded target files are kept too, so that a run
+ * using the journal finds them in target_set_excluded. */
+FileSet *MirrorJob::MakeJournalSet()
+{
+   FileSet *set=new FileSet(target_set);
+   set->Merge(target_set_excluded);
+   if(FlagSet(DELETE))
+   {
+      set->SubtractAny(to_rm);
+      set->SubtractAny(to_rm_mismatched);
+   }
+   Ref<FileSet> changed(new FileSet(to_transfer));
+   changed->Merge(to_scan);
+   changed->SubtractAny(skipped);
+   set->SubtractAny(changed);
+   set->Merge(changed);
+   return set;
+}
+
 void MirrorJob::MirrorStarted()
 {
    if(!parent_mirror)
@@ -695,12 +743,80 @@ void MirrorJob::MirrorStarted()
 }
 void MirrorJob::MirrorFinished()
 {
+   ScanFinished();
    if(!parent_mirror)
       return;
    assert(transfer_count>=root_transfer_count);
    transfer_count-=root_transfer_count;
 }
 
+/* The scan queue is kept in the root mirror in creation order; entries of
+   mirrors which have got a slot or were deleted are zeroed. */
+bool MirrorJob::ScanSlotReady()
+{
+   if(!scan_queued)
+      return true;
+   xarray<MirrorJob*>& q=root_mirror->scan_queue;
+   int& head=root_mirror->scan_queue_head;
+   while(head<q.count() && !q[head])
+      head++;
+   if(root_mirror->scan_count>=scan_parallel || q[head]!=this)
+      return false;
+   q[head++]=0;
+   if(head==q.count() || head>=1024)
+   {
+      q.remove(0,head);
+      head=0;
+   }
+   scan_queued=false;
+   scan_slot=true;
+   root_mirror->scan_count++;
+   return true;
+}
+void MirrorJob::ScanFinished()
+{
+   if(!scan_slot)
+      return;
+   scan_slot=false;
+   root_mirror->scan_count--;
+}
+void MirrorJob::ScanDequeue()
+{
+   if(!scan_queued)
+      return;
+   xarray<MirrorJob*>& q=root_mirror->scan_queue;
+   for(int i=root_mirror->scan_queue_head; i<q.count(); i++)
+   {
+      if(q[i]==this)
+      {
+	 q[i]=0;
+	 break;
+      }
+   }
+   scan_queued=false;
+}
+// keep the scan queue short, the sub-mirrors are not cheap
+bool MirrorJob::QueueSubdirs()
+{
+   bool queued=false;
+   while(to_scan && to_scan->curr())
+   {
+      const xarray<MirrorJob*>& q=root_mirror->scan_queue;
+      if(q.count()-root_mirror->scan_queue_head>=scan_parallel*16)
+	 break;
+      HandleFile(to_scan->curr());
+      to_scan->next();
+      queued=true;
+   }
+   return queued;
+}
+void MirrorJob::PrepareToDie()
+{
+   ScanDequeue();
+   ScanFinished();
+   Job::PrepareToDie();
+}
+
 void MirrorJob::HandleChdir(FileAccessRef& session, int &redirections)
 {
    if(!session->IsOpen())
@@ -829,6 +945,7 @@ void MirrorJob::HandleListInfo(SMTaskRef<ListInfo>& list_info, Ref<FileSet>& set
       *fsx=list_info->GetExcluded();
    list_info=0;
    set->ExcludeDots(); // don't need .. and .
+   set->Compact();
 }
 
 int   MirrorJob::Do()
@@ -841,6 +958,19 @@ int   MirrorJob::Do()
    switch(state)
    {
    case(INITIAL_STATE):
+      if(parent_mirror && root_mirror->journal
+      && root_mirror->journal->Finished(target_relative_dir))
+      {
+	 Report(_("Skipping directory `%s' (done by the interrupted run)"),target_relative_dir.get());
+	 ScanDequeue();
+	 MirrorFinished();
+	 transfer_count++; // parent mirror will decrement it.
+	 goto pre_DONE;
+      }
+      if(!ScanSlotReady())
+	 return m;
+      if(!parent_mirror && journal && !script_only)
+	 journal->StartRun();
       remove_this_source_dir=(remove_source_dirs && source_dir.last_char()!='/');
       if(!strcmp(target_dir,".") || !strcmp(target_dir,"..") || (FlagSet(SCAN_ALL_FIRST) && parent_mirror))
 	 create_target_dir=false;
@@ -951,7 +1081,18 @@ int   MirrorJob::Do()
       if(!target_set && !create_target_dir
       && (!FlagSet(DEPTH_FIRST) || FlagSet(ONLY_EXISTING))
       && !(FlagSet(TARGET_FLAT) && parent_mirror))
-	 HandleListInfoCreation(target_session,target_list_info,target_relative_dir);
+      {
+	 // trust the journal instead of listing the target again
+	 if(root_mirror->journal)
+	    target_set=root_mirror->journal->GetSet(target_relative_dir);
+	 if(target_set)
+	 {
+	    target_set_excluded=new FileSet;
+	    target_set->Exclude(target_relative_dir,top_exclude?top_exclude:exclude,target_set_excluded.get_non_const());
+	 }
+	 else
+	    HandleListInfoCreation(target_session,target_list_info,target_relative_dir);
+      }
       if(state!=GETTING_LIST_INFO)
       {
 	 source_list_info=0;
@@ -968,6 +1109,9 @@ int   MirrorJob::Do()
 
       MirrorFinished(); // leave room for transfers.
 
+      if(root_mirror->journal && !script_only)
+	 root_mirror->journal->Changing(target_relative_dir);
+
       if(FlagSet(DEPTH_FIRST) && source_set && !target_set)
       {
 	 // transfer directories first
@@ -1070,6 +1214,15 @@ int   MirrorJob::Do()
       break;
 
    pre_WAITING_FOR_TRANSFER:
+      if(scan_parallel>0 && !FlagSet(NO_RECURSION))
+      {
+	 // subdirectories are queued for scanning without waiting for
+	 // transfer slots
+	 to_scan=new FileSet(to_transfer);
+	 to_scan->SubtractNotDirs();
+	 to_scan->rewind();
+	 to_transfer->SubtractDirs();
+      }
       to_transfer->rewind();
       set_state(WAITING_FOR_TRANSFER);
       m=MOVED;
@@ -1082,13 +1235,15 @@ int   MirrorJob::Do()
       }
       if(max_error_count>0 && stats.error_count>=max_error_count)
 	 goto pre_FINISHING;
+      if(QueueSubdirs())
+	 m=MOVED;
       while(transfer_count<parallel && state==WAITING_FOR_TRANSFER)
       {
 	 file=to_transfer->curr();
 	 if(!file)
 	 {
 	    // go to the next step only when all transfers have finished
-	    if(waiting_num>0)
+	    if(waiting_num>0 || (to_scan && to_scan->curr()))
 	       break;
 	    if(FlagSet(DEPTH_FIRST))
 	    {
@@ -1192,6 +1347,8 @@ int   MirrorJob::Do()
 	       }
 	       else
 		  j->Recurse();
+	       if(root_mirror->journal)
+		  root_mirror->journal->Removed(dir_file(target_relative_dir,file->name));
 	    }
 	 }
 	 const char *target_name_rel=dir_file(target_relative_dir,file->name);
@@ -1325,6 +1482,21 @@ int   MirrorJob::Do()
 
       // all jobs finished and src dir removed, if needed.
 
+      if(root_mirror->journal && !script_only)
+      {
+	 if(!stats.error_count && source_set && target_set)
+	 {
+	    Ref<FileSet> done(MakeJournalSet());
+	    root_mirror->journal->Done(target_relative_dir,done);
+	 }
+	 if(!parent_mirror)
+	 {
+	    journal->FinishRun();
+	    if(journal->ErrorText())
+	       eprintf("mirror: %s\n",journal->ErrorText());
+	 }
+      }
+
       transfer_count++; // parent mirror will decrement it.
       if(parent_mirror)
 	 parent_mirror->stats.Add(stats);
@@ -1408,6 +1580,8 @@ int   MirrorJob::Do()
 	 stats.Reset();
 	 source_set=0;
 	 target_set=0;
+	 if(journal && !script_only)
+	    journal->StartRun();
 	 goto pre_GETTING_LIST_INFO;
       }
       /*fallthrough*/
@@ -1469,6 +1643,12 @@ MirrorJob::MirrorJob(MirrorJob *parent,
    source_redirections=0;
    target_redirections=0;
 
+   scan_parallel=0;
+   scan_count=0;
+   scan_queue_head=0;
+   scan_queued=false;
+   scan_slot=false;
+
    if(parent_mirror)
    {
       bool parallel_dirs=ResMgr::QueryBool("mirror:parallel-directories",0);
@@ -1503,6 +1683,15 @@ MirrorJob::MirrorJob(MirrorJob *parent,
       script_only=parent->script_only;
 
       max_error_count=parent->max_error_count;
+
+      scan_parallel=parent->scan_parallel;
+      if(scan_parallel>0)
+      {
+	 // scanning is limited by the scan queue, not by transfer slots
+	 root_transfer_count=0;
+	 root_mirror->scan_queue.append(this);
+	 scan_queued=true;
+      }
    }
    MirrorStarted();
 }
@@ -1665,6 +1854,16 @@ const char *MirrorJob::SetScriptFile(const char *n)
    return 0;
 }
 
+const char *MirrorJob::SetJournal(const char *f)
+{
+   journal=new MirrorJournal();
+   xstring_c source_url(source_session->GetFileURL(source_dir,FA::NO_PASSWORD));
+   const char *err=journal->Open(f,source_url,target_session->GetFileURL(target_dir,FA::NO_PASSWORD));
+   if(err)
+      journal=0;
+   return err;
+}
+
 void MirrorJob::SetOnChange(const char *oc)
 {
    on_change.set(oc);
@@ -1795,6 +1994,8 @@ CMD(mirror)
       OPT_UPLOAD_OLDER,
       OPT_TRANSFER_ALL,
       OPT_TARGET_FLAT,
+      OPT_PARALLEL_SCAN,
+      OPT_JOURNAL,
    };
    static const struct option mirror_opts[]=
    {
@@ -1829,6 +2030,8 @@ CMD(mirror)
       {"Remove-source-dirs",no_argument,0,OPT_REMOVE_SOURCE_DIRS},
       {"Move",no_argument,0,OPT_REMOVE_SOURCE_DIRS},
       {"parallel",optional_argument,0,'P'},
+      {"parallel-scan",optional_argument,0,OPT_PARALLEL_SCAN},
+      {"journal",required_argument,0,OPT_JOURNAL},
       {"ignore-time",no_argument,0,OPT_IGNORE_TIME},
       {"ignore-size",no_argument,0,OPT_IGNORE_SIZE},
       {"only-missing",no_argument,0,OPT_ONLY_MISSING},
@@ -1876,11 +2079,13 @@ CMD(mirror)
    bool  remove_source_dirs=false;
    bool	 skip_noaccess=ResMgr::QueryBool("mirror:skip-noaccess",0);
    int	 parallel=ResMgr::Query("mirror:parallel-transfer-count",0);
+   int	 parallel_scan=ResMgr::Query("mirror:parallel-scan-count",0);
    int	 use_pget=ResMgr::Query("mirror:use-pget-n",0);
    bool	 reverse=false;
    bool	 script_only=false;
    bool	 no_empty_dirs=ResMgr::QueryBool("mirror:no-empty-dirs",0);
    const char *script_file=0;
+   const char *journal_file=0;
    const char *on_change=0;
    const char *recursion_mode=0;
    bool single_file=false;
@@ -2042,6 +2247,15 @@ CMD(mirror)
 	 else
 	    parallel=3;
 	 break;
+      case(OPT_PARALLEL_SCAN):
+	 if(optarg)
+	    parallel_scan=atoi(optarg);
+	 else
+	    parallel_scan=3;
+	 break;
+      case(OPT_JOURNAL):
+	 journal_file=optarg;
+	 break;
       case(OPT_USE_PGET_N):
 	 if(optarg)
 	    use_pget=atoi(optarg);
@@ -2252,6 +2466,11 @@ CMD(mirror)
       parallel=64;   // a (in)sane limit.
    if(parallel)
       j->SetParallel(parallel);
+   if(parallel_scan<0)
+      parallel_scan=0;
+   if(parallel_scan>64)
+      parallel_scan=64;
+   j->SetParallelScan(parallel_scan);
    if(use_pget>1 && !(flags&MirrorJob::ASCII))
       j->SetPGet(use_pget);
 
@@ -2280,6 +2499,19 @@ CMD(mirror)
       if(!script_file)
 	 j->SetScriptFile("-");
    }
+   if(journal_file)
+   {
+      if(flags&MirrorJob::SCAN_ALL_FIRST) {
+	 eprintf("%s: --journal conflicts with other specified options\n",args->a0());
+	 return 0;
+      }
+      const char *err=j->SetJournal(journal_file);
+      if(err)
+      {
+	 eprintf("%s: %s\n",args->a0(),err);
+	 return 0;
+      }
+   }
    j->SetMaxErrorCount(max_error_count);
    if(on_change)
       j->SetOnChange(on_change);
@@ -22,6 +22,7 @@
 
 #include "FileAccess.h"
 #include "FileSet.h"
+#include "MirrorJournal.h"
 #include "Job.h"
 #include "PatternSet.h"
 #include "misc.h"
@@ -73,10 +74,13 @@ private:
    Ref<FileSet> same;
    Ref<FileSet> to_rm;
    Ref<FileSet> to_rm_mismatched;
-   Ref<FileSet> old_files_set;
-   Ref<FileSet> new_files_set;
+   Ref<PackedFileSet> old_files_set;
+   Ref<PackedFileSet> new_files_set;
    Ref<FileSet> to_rm_src;
+   Ref<FileSet> to_scan;
+   Ref<FileSet> skipped;   // queued files left alone, kept out of the journal
    void	 InitSets(Ref<FileSet>& src,const FileSet *dst);
+   FileSet *MakeJournalSet();
    bool only_dirs;
 
    void RemoveSourceLater(const FileInfo *fi) {
@@ -86,6 +90,13 @@ private:
 	 to_rm_src=new FileSet();
       to_rm_src->Add(new FileInfo(*fi));
    }
+   void SkipFile(const FileInfo *fi) {
+      if(!root_mirror->journal)
+	 return;
+      if(!skipped)
+	 skipped=new FileSet();
+      skipped->Add(new FileInfo(*fi));
+   }
 
    void AddBytesTransferred(long long b) {
       bytes_transferred+=b;
@@ -168,6 +179,23 @@ private:
    int pget_n;
    int pget_minchunk;
 
+   /* With parallel scan, up to scan_parallel mirrors list their directories
+    * at once, independently of the transfers. Sub-mirrors are queued in the
+    * root mirror as soon as the parent directory is compared, so the tree is
+    * scanned breadth first. */
+   int scan_parallel;
+   int scan_count;			 // in the root mirror
+   xarray<MirrorJob*> scan_queue;	 // in the root mirror
+   int scan_queue_head;
+   bool scan_queued;
+   bool scan_slot;
+   bool ScanSlotReady();
+   void ScanFinished();
+   void ScanDequeue();
+   bool QueueSubdirs();
+
+   Ref<MirrorJournal> journal;	 // in the root mirror
+
    xstring_c on_change;
 
    mode_t get_mode_mask();
@@ -182,6 +210,7 @@ private:
 
    void MirrorStarted();
    void MirrorFinished();
+   void PrepareToDie();
    void TransferStarted(class CopyJob *cp);
    void JobStarted(Job *j);
    void TransferFinished(Job *j);
@@ -260,6 +289,7 @@ public:
    void	 SkipNoAccess() { skip_noaccess=true; }
 
    void  SetParallel(int p) { parallel=p; }
+   void  SetParallelScan(int p) { scan_parallel=p; }
    void  SetPGet(int n) { pget_n=n; }
 
    void Fg();
@@ -267,6 +297,7 @@ public:
 
    const char *SetRecursionMode(const char *r);
    const char *SetScriptFile(const char *n);
+   const char *SetJournal(const char *f);
    void	 ScriptOnly(bool yes=true)
       {
 	 script_only=yes;
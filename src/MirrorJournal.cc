@@ -0,0 +1,400 @@
+/*
+ * lftp - file transfer program
+ *
+ * Copyright (c) 1996-2017 by Alexander V. Lukyanov (lav@yars.free.net)
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <config.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdio.h>
+#include "MirrorJournal.h"
+#include "SMTask.h"
+#include "misc.h"
+#include "StringSet.h"
+#include "log.h"
+
+#define FIELD_UNSAFE " %"
+
+MirrorJournal::MirrorJournal()
+{
+   fd=-1;
+   size=0;
+   run=0;
+   run_open=false;
+   resumed=false;
+}
+MirrorJournal::~MirrorJournal()
+{
+   if(fd!=-1)
+      close(fd);
+}
+
+static bool lock_file(int fd)
+{
+   struct flock lk;
+   memset(&lk,0,sizeof(lk));
+   lk.l_type=F_WRLCK;
+   lk.l_whence=SEEK_SET;
+   return fcntl(fd,F_SETLK,&lk)!=-1;
+}
+
+const char *MirrorJournal::Open(const char *f,const char *source_url,const char *target_url)
+{
+   file.set(f);
+   header.set("lftp-mirror-journal 1 ");
+   header.append_url_encoded(source_url,FIELD_UNSAFE).append(' ');
+   header.append_url_encoded(target_url,FIELD_UNSAFE).append('\n');
+
+   fd=open(file,O_RDWR|O_APPEND|O_CREAT,0600);
+   if(fd==-1)
+      return xstring::format("%s: %s",f,strerror(errno));
+   fcntl(fd,F_SETFD,FD_CLOEXEC);
+   if(!lock_file(fd))
+      return xstring::format(_("%s: the journal is in use by another mirror"),f);
+
+   struct stat st;
+   if(fstat(fd,&st)==-1)
+      return xstring::format("%s: %s",f,strerror(errno));
+   if(st.st_size==0)
+   {
+      Append(header);
+      return 0;
+   }
+
+   xstring buf;
+   int hlen=header.length();
+   buf.get_space(hlen);
+   if(pread(fd,buf.get_non_const(),hlen,0)!=hlen
+   || memcmp(buf,header,hlen))
+      return xstring::format(_("%s: the journal belongs to another mirror"),f);
+
+   off_t pos=hlen;
+   int want=0x10000;
+   while(pos<st.st_size)
+   {
+      buf.get_space(want);
+      int res=pread(fd,buf.get_non_const(),want,pos);
+      if(res<=0)
+	 break;
+      int used=IndexRecords(buf,res,pos);
+      if(used<0)
+	 break;
+      if(used==0)
+      {
+	 if(res<want)
+	    break;
+	 want*=2;    // a record larger than the buffer
+	 continue;
+      }
+      pos+=used;
+   }
+   if(pos<st.st_size)
+   {
+      // the tail was cut or broken when the last run was interrupted
+      debug((3,"%s: dropping %lld bytes after offset %lld\n",f,
+	 (long long)(st.st_size-pos),(long long)pos));
+      if(ftruncate(fd,pos)==-1)
+	 return xstring::format("%s: %s",f,strerror(errno));
+   }
+   size=pos;
+   return 0;
+}
+
+/* Index complete records in buf, which holds the file data starting at
+ * offset pos. Returns the number of bytes consumed, or -1 if the data is
+ * not in the expected format. */
+int MirrorJournal::IndexRecords(const char *buf,int len,off_t pos)
+{
+   const char *scan=buf;
+   const char *end=buf+len;
+   while(scan<end)
+   {
+      const char *nl=(const char*)memchr(scan,'\n',end-scan);
+      if(!nl)
+	 break;
+      if(nl-scan<2 || scan[1]!=' ')
+	 return -1;
+      const char *arg=scan+2;
+      xstring dir;
+      switch(scan[0])
+      {
+      case 'S':
+	 run++;
+	 run_open=true;
+	 scan=nl+1;
+	 break;
+      case '-':
+	 dir.nset(arg,nl-arg);
+	 dir.url_decode();
+	 index.remove(dir);
+	 scan=nl+1;
+	 break;
+      case 'D':
+      {
+	 // buf is not NUL-terminated, parse a copy of the line
+	 const xstring& line=xstring::get_tmp(arg,nl-arg);
+	 int dlen,n=0;
+	 if(sscanf(line,"%d%n",&dlen,&n)<1 || dlen<0 || line[n]!=' ')
+	    return -1;
+	 if(nl+1+dlen+1>end)
+	    return scan-buf;
+	 if(nl[1+dlen]!='\n')
+	    return -1;
+	 dir.nset(arg+n+1,nl-(arg+n+1));
+	 dir.url_decode();
+	 Record *r=new Record;
+	 r->data_pos=pos+(nl+1-buf);
+	 r->data_len=dlen;
+	 r->run=run;
+	 index.add(dir,r);
+	 scan=nl+1+dlen+1;
+	 break;
+      }
+      default:
+	 return -1;
+      }
+   }
+   return scan-buf;
+}
+
+void MirrorJournal::Fail()
+{
+   if(!error_text)
+      error_text.vset(file.get(),": ",strerror(errno),NULL);
+   close(fd);
+   fd=-1;
+}
+void MirrorJournal::Append(const xstring& rec)
+{
+   if(fd==-1)
+      return;
+   if(write(fd,rec,rec.length())!=(int)rec.length())
+   {
+      Fail();
+      return;
+   }
+   size+=rec.length();
+}
+
+void MirrorJournal::StartRun()
+{
+   if(run_open)
+   {
+      // continue the interrupted run
+      resumed=true;
+      return;
+   }
+   Append(xstring::format("S %ld\n",(long)SMTask::now.UnixTime()));
+   run++;
+   run_open=true;
+}
+void MirrorJournal::FinishRun()
+{
+   if(!run_open)
+      return;
+   Compact();
+   run_open=false;
+   resumed=false;
+}
+
+/* Returns true if the directory has been completed by the interrupted run
+ * being resumed now. */
+bool MirrorJournal::Finished(const char *dir)
+{
+   if(!resumed)
+      return false;
+   const Record *r=index.lookup(dir?dir:"");
+   return r && r->run==run;
+}
+
+FileSet *MirrorJournal::GetSet(const char *dir)
+{
+   const Record *r=index.lookup(dir?dir:"");
+   if(!r || fd==-1)
+      return 0;
+   xstring data;
+   data.get_space(r->data_len);
+   if(pread(fd,data.get_non_const(),r->data_len,r->data_pos)!=r->data_len)
+      return 0;
+   data.set_length(r->data_len);
+
+   FileSet *set=new FileSet;
+   char *scan=data.get_non_const();
+   const char *end=scan+data.length();
+   while(scan<end)
+   {
+      char *nl=(char*)memchr(scan,'\n',end-scan);
+      if(!nl)
+	 break;
+      // end the line for sscanf, so that it neither scans the rest of
+      // the data nor goes past the entry.
+      *nl=0;
+      unsigned defined,mode;
+      int type,prec,n=0;
+      long long date,size;
+      if(sscanf(scan,"%o %d %o %lld %d %lld%n",&defined,&type,&mode,&date,&prec,&size,&n)<6
+      || scan+n>=nl || scan[n]!=' ')
+      {
+	 debug((1,"%s: broken entry in `%s'\n",file.get(),dir?dir:""));
+	 delete set;
+	 return 0;
+      }
+      const char *name=scan+n+1;
+      const char *sp=(const char*)memchr(name,' ',nl-name);
+      xstring n_buf;
+      n_buf.nset(name,(sp?sp:nl)-name);
+      FileInfo *fi=new FileInfo(n_buf.url_decode());
+      if(defined&fi->TYPE)
+	 fi->SetType((FileInfo::type)type);
+      if(defined&fi->MODE)
+	 fi->SetMode(mode);
+      if(defined&fi->DATE)
+	 fi->SetDate(date,prec);
+      if(defined&fi->SIZE)
+	 fi->SetSize(size);
+      if((defined&fi->SYMLINK_DEF) && sp)
+      {
+	 n_buf.nset(sp+1,nl-(sp+1));
+	 if(type==FileInfo::REDIRECT)
+	    fi->SetRedirect(n_buf.url_decode());
+	 else
+	    fi->SetSymlink(n_buf.url_decode());
+      }
+      set->Add(fi);
+      scan=nl+1;
+   }
+   return set;
+}
+
+/* The directory is about to be changed, its recorded entries are no longer
+ * valid. */
+void MirrorJournal::Changing(const char *dir)
+{
+   if(!dir)
+      dir="";
+   if(!index.lookup(dir))
+      return;
+   xstring rec("- ");
+   rec.append_url_encoded(dir,FIELD_UNSAFE).append('\n');
+   Append(rec);
+   index.remove(dir);
+}
+
+/* The directory has been removed from the target (mirror --delete), drop
+ * its records and the records of its subdirectories. */
+void MirrorJournal::Removed(const char *dir)
+{
+   int dir_len=strlen(dir);
+   StringSet gone;
+   for(Record *r=index.each_begin(); r; r=index.each_next())
+   {
+      const xstring& key=index.each_key();
+      if(key.begins_with(dir,dir_len)
+      && (key.length()==(size_t)dir_len || key[dir_len]=='/'))
+	 gone.Append(key);
+   }
+   xstring rec;
+   for(int i=0; i<gone.Count(); i++)
+   {
+      rec.set("- ");
+      rec.append_url_encoded(gone[i],FIELD_UNSAFE).append('\n');
+      Append(rec);
+      index.remove(gone[i]);
+   }
+}
+
+void MirrorJournal::Done(const char *dir,const FileSet *set)
+{
+   if(fd==-1)
+      return;
+   if(!dir)
+      dir="";
+   xstring data;
+   for(int i=0; i<set->count(); i++)
+   {
+      const FileInfo *fi=(*set)[i];
+      unsigned defined=fi->defined&(fi->TYPE|fi->MODE|fi->DATE|fi->SIZE|fi->SYMLINK_DEF);
+      data.appendf("%o %d %o %lld %d %lld ",defined,(int)fi->filetype,(unsigned)fi->mode,
+	 (long long)fi->date.ts,fi->date.ts_prec,(long long)fi->size);
+      data.append_url_encoded(fi->name,FIELD_UNSAFE);
+      if(defined&fi->SYMLINK_DEF)
+	 data.append(' ').append_url_encoded(fi->symlink,FIELD_UNSAFE);
+      data.append('\n');
+   }
+   xstring rec;
+   rec.appendf("D %d ",(int)data.length());
+   rec.append_url_encoded(dir,FIELD_UNSAFE).append('\n');
+   Record *r=new Record;
+   r->data_pos=size+rec.length();
+   r->data_len=data.length();
+   r->run=run;
+   rec.append(data).append('\n');
+   Append(rec);
+   index.add(dir,r);
+}
+
+/* Rewrite the file with the header and the live directory records only. */
+void MirrorJournal::Compact()
+{
+   if(fd==-1)
+      return;
+   xstring new_file;
+   new_file.vset(file.get(),".new",NULL);
+   int nfd=open(new_file,O_RDWR|O_CREAT|O_TRUNC,0600);
+   if(nfd==-1)
+      return;
+   off_t new_size=0;
+   bool ok=(write(nfd,header,header.length())==(int)header.length());
+   new_size+=header.length();
+   xstring rec;
+   for(Record *r=index.each_begin(); r && ok; r=index.each_next())
+   {
+      rec.set("D ");
+      rec.appendf("%d ",r->data_len);
+      rec.append_url_encoded(index.each_key(),FIELD_UNSAFE).append('\n');
+      int hlen=rec.length();
+      rec.get_space(hlen+r->data_len+1);
+      if(pread(fd,rec.get_non_const()+hlen,r->data_len,r->data_pos)!=r->data_len)
+      {
+	 ok=false;
+	 break;
+      }
+      rec.set_length(hlen+r->data_len);
+      rec.append('\n');
+      ok=(write(nfd,rec,rec.length())==(int)rec.length());
+      r->data_pos=new_size+hlen;
+      r->run=0;
+      new_size+=rec.length();
+   }
+   if(!ok || !lock_file(nfd) || rename(new_file,file)==-1)
+   {
+      // the positions may be updated partially, stop using the journal
+      Fail();
+      close(nfd);
+      unlink(new_file);
+      return;
+   }
+   close(fd);
+   fd=nfd;
+   fcntl(fd,F_SETFL,O_APPEND);
+   fcntl(fd,F_SETFD,FD_CLOEXEC);
+   size=new_size;
+   run=0;
+}
@@ -0,0 +1,82 @@
+/*
+ * lftp - file transfer program
+ *
+ * Copyright (c) 1996-2017 by Alexander V. Lukyanov (lav@yars.free.net)
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef MIRRORJOURNAL_H
+#define MIRRORJOURNAL_H
+
+#include "xmap.h"
+#include "FileSet.h"
+
+/* State of the mirror target, kept between mirror runs (mirror --journal).
+ *
+ * The file starts with a line
+ *    lftp-mirror-journal 1 <source-url> <target-url>
+ * followed by records
+ *    S <time>            a run has started
+ *    D <length> <dir>    the directory is complete; <length> bytes of its
+ *                        entries and a newline follow
+ *    - <dir>             the directory is being changed
+ * Each entry is a line
+ *    <defined> <type> <mode> <date> <prec> <size> <name> [<symlink>]
+ * Text fields are url encoded. A run which has finished compacts the file
+ * to the header and the live directory records, so a start record without
+ * a compaction marks an interrupted run. Only the record positions are kept
+ * in memory, the entries are read back when a directory is requested. */
+class MirrorJournal
+{
+   struct Record
+   {
+      off_t data_pos;
+      int data_len;
+      int run;
+   };
+   xmap_p<Record> index;
+
+   xstring file;
+   xstring header;
+   xstring error_text;
+   int fd;
+   off_t size;
+   int run;	     // number of the current run
+   bool run_open;    // the last run has not finished
+   bool resumed;     // continuing an interrupted run
+
+   int IndexRecords(const char *buf,int len,off_t pos);
+   void Fail();
+   void Append(const xstring& rec);
+   void Compact();
+
+public:
+   MirrorJournal();
+   ~MirrorJournal();
+
+   const char *Open(const char *f,const char *source_url,const char *target_url);
+   void StartRun();
+   void FinishRun();
+
+   FileSet *GetSet(const char *dir);
+   bool Finished(const char *dir);
+   void Changing(const char *dir);
+   void Removed(const char *dir);
+   void Done(const char *dir,const FileSet *set);
+
+   const char *ErrorText() const { return error_text; }
+};
+
+#endif//MIRRORJOURNAL_H
@@ -463,24 +463,34 @@ do_again:
 	    SetErrorCached(cache_buffer);
 	    return MOVED;
 	 }
-	 if(cache_fset) {
-	    Log::global->Write(11,"ListInfo: using cached file set\n");
-	    set=new FileSet(cache_fset);
-	    old_mode=mode;
-	    goto got_fileset;
+	 if(!cache_fset)
+	 {
+	    ubuf=new IOBuffer(IOBuffer::GET);
+	    ubuf->Put(cache_buffer,cache_buffer_size);
+	    ubuf->PutEOF();
 	 }
-	 ubuf=new IOBuffer(IOBuffer::GET);
-	 ubuf->Put(cache_buffer,cache_buffer_size);
-	 ubuf->PutEOF();
       }
-      else
+      else if(use_cache)
+	 cache_fset=FileAccess::cache->FindFileSet(session,"",mode);
+      if(cache_fset)
+      {
+	 Log::global->Write(11,"ListInfo: using cached file set\n");
+	 set=new FileSet(cache_fset);
+	 old_mode=mode;
+	 goto got_fileset;
+      }
+      if(!ubuf)
       {
 	 session->Open("",mode);
 	 session->UseCache(use_cache);
 	 ubuf=new IOBufferFileAccess(session);
 	 ubuf->SetSpeedometer(new Speedometer());
-	 if(FileAccess::cache->IsEnabled(session->GetHostName()))
+	 // the parsed set is cached, not the listing; the buffer keeps
+	 // only the data not parsed yet. The disk cache stores listings,
+	 // so keep the whole listing when it is enabled.
+	 if(FileAccess::cache->IsPersistent(session))
 	    ubuf->Save(FileAccess::cache->SizeLimit());
+	 from_session=true;
 	 session->Roll();
 	 ubuf->Roll();
       }
@@ -490,7 +500,12 @@ do_again:
    {
       if(ubuf->Error())
       {
-	 FileAccess::cache->Add(session,"",mode,session->GetErrorCode(),ubuf);
+	 if(from_session)
+	 {
+	    const char *err=ubuf->ErrorText();
+	    FileAccess::cache->Add(session,"",mode,session->GetErrorCode(),err,strlen(err)+1);
+	 }
+	 from_session=false;
 	 if(mode==FA::MP_LIST)
 	 {
 	    mode=FA::LONG_LIST;
@@ -503,18 +518,34 @@ do_again:
 	 return MOVED;
       }
 
+      const char *b;
+      int len;
       if(!ubuf->Eof())
+      {
+	 ubuf->Get(&b,&len);
+	 int parsed=ParseMore(b,len);
+	 if(parsed>0)
+	 {
+	    ubuf->Skip(parsed);
+	    m=MOVED;
+	 }
 	 return m;
+      }
 
-      // now we have all the index in ubuf; parse it.
-      const char *b;
-      int len;
+      // now we have the rest of the index in ubuf; parse it.
       ubuf->Get(&b,&len);
       old_mode=mode;
-      set=Parse(b,len);
+      set=ParseEnd(b,len);
 
-      // cache the list and the set.
-      FileAccess::cache->Add(session,"",old_mode,FA::OK,ubuf,set);
+      // cache the set, and the listing if it was kept.
+      if(from_session)
+      {
+	 if(ubuf->IsSaving())
+	    FileAccess::cache->Add(session,"",old_mode,FA::OK,ubuf,set);
+	 else
+	    FileAccess::cache->Add(session,"",old_mode,FA::OK,set?0:"",0,set);
+      }
+      from_session=false;
 
 got_fileset:
       if(set)
@@ -646,7 +677,8 @@ bool GenericParseListInfo::ResolveRedirect(const FileInfo *fi)
 
 GenericParseListInfo::GenericParseListInfo(FileAccess *s,const char *p)
    : ListInfo(s,p), redir_resolution(false), redir_count(0),
-     max_redir(ResMgr::Query("xfer:max-redirections",0))
+     max_redir(ResMgr::Query("xfer:max-redirections",0)),
+     from_session(false)
 {
    get_time_for_dirs=true;
    can_get_prec_time=true;
@@ -119,12 +119,17 @@ class GenericParseListInfo : public ListInfo
 protected:
    int mode;
    SMTaskRef<IOBuffer> ubuf;
+   bool from_session;	// ubuf reads from the session, not the cache
 
    bool get_time_for_dirs;
    bool can_get_prec_time;
 
    virtual FileSet *Parse(const char *buf,int len)
       { return session->ParseLongList(buf,len); }
+   // A parser can take the listing as it arrives: ParseMore returns the
+   // length of the data it has consumed, ParseEnd gets the rest at EOF.
+   virtual int ParseMore(const char *buf,int len) { return 0; }
+   virtual FileSet *ParseEnd(const char *buf,int len) { return Parse(buf,len); }
 
 public:
    GenericParseListInfo(FileAccess *session,const char *path);
@@ -18,9 +18,20 @@
  */
 
 #include <config.h>
+#include <errno.h>
+#include <string.h>
+#include <limits.h>
+#include <time.h>
 #include "trio.h"
 #include "PollVec.h"
 
+#if defined(HAVE_SYS_EPOLL_H) && defined(HAVE_EPOLL_CREATE1)
+# include <sys/epoll.h>
+# define USE_EPOLL 1
+#else
+# define USE_EPOLL 0
+#endif
+
 static inline bool operator<(const timeval& a,const timeval& b)
 {
    if(a.tv_sec!=b.tv_sec)
@@ -28,6 +39,83 @@ static inline bool operator<(const timeval& a,const timeval& b)
    return a.tv_usec<b.tv_usec;
 }
 
+static const struct {
+   const char *name;
+   PollVec::method_t method;
+} method_names[]={
+   {"select",PollVec::SELECT},
+   {"poll",  PollVec::POLL},
+#if USE_EPOLL
+   {"epoll", PollVec::EPOLL},
+#endif
+   {0}
+};
+
+PollVec::PollVec()
+{
+   method=(USE_EPOLL?EPOLL:POLL);
+   epoll_fd=-1;
+   Empty();
+}
+PollVec::~PollVec()
+{
+   EpollClose();
+}
+
+bool PollVec::FindMethod(const char *name,method_t *m)
+{
+   if(!strcmp(name,"auto"))
+   {
+      *m=(USE_EPOLL?EPOLL:POLL);
+      return true;
+   }
+   for(int i=0; method_names[i].name; i++)
+   {
+      if(!strcmp(name,method_names[i].name))
+      {
+	 *m=method_names[i].method;
+	 return true;
+      }
+   }
+   return false;
+}
+const char *PollVec::GetMethodName() const
+{
+   for(int i=0; method_names[i].name; i++)
+      if(method_names[i].method==method)
+	 return method_names[i].name;
+   return "?";
+}
+void PollVec::SetMethod(method_t m)
+{
+   if(method==m)
+      return;
+   if(method==EPOLL)
+      EpollClose();
+   method=m;
+}
+
+PollVec::FDState &PollVec::State(int fd)
+{
+   int old=fd_state.count();
+   if(fd>=old)
+   {
+      fd_state.grow_space(fd+1);
+      memset(fd_state.get_non_const()+old,0,(fd+1-old)*sizeof(FDState));
+      fd_state.set_length(fd+1);
+   }
+   return fd_state[fd];
+}
+
+void PollVec::Empty()
+{
+   for(int i=0; i<fds.count(); i++)
+      fd_state[fds[i]].bits&=~(WANT_IN|WANT_OUT);
+   fds.truncate();
+   tv_timeout.tv_sec=-1;
+   tv_timeout.tv_usec=0;
+}
+
 void PollVec::AddTimeoutU(unsigned t)
 {
    struct timeval new_timeout={t/1000000,t%1000000};
@@ -37,43 +125,339 @@ void PollVec::AddTimeoutU(unsigned t)
 
 void PollVec::AddFD(int fd,int mask)
 {
+   if(fd<0)
+      return;
+   unsigned short &st=State(fd).bits;
+   if(!(st&(WANT_IN|WANT_OUT)))
+      fds.append(fd);
    if(mask&IN)
-      FD_SET(fd,&in);
+      st|=WANT_IN;
    if(mask&OUT)
-      FD_SET(fd,&out);
-   if(nfds<=fd)
-      nfds=fd+1;
+      st|=WANT_OUT;
+}
+void PollVec::HoldFD(int fd,int mask)
+{
+   if(fd<0)
+      return;
+   FDState &st=State(fd);
+   if(mask&IN)
+      st.hold_in++;
+   if(mask&OUT)
+      st.hold_out++;
+   if(!(st.bits&HELD))
+   {
+      held.append(fd);
+      st.bits|=HELD;
+   }
+}
+void PollVec::ReleaseFD(int fd,int mask)
+{
+   if(fd<0 || fd>=fd_state.count())
+      return;
+   FDState &st=fd_state[fd];
+   if((mask&IN) && st.hold_in>0)
+      st.hold_in--;
+   if((mask&OUT) && st.hold_out>0)
+      st.hold_out--;
+   // the fd is removed from `held' lazily in AddHeld
+}
+void PollVec::AddHeld()
+{
+   int j=0;
+   for(int i=0; i<held.count(); i++)
+   {
+      int fd=held[i];
+      FDState &st=fd_state[fd];
+      if(!st.hold_in && !st.hold_out)
+      {
+	 st.bits&=~HELD;
+	 continue;
+      }
+      held[j++]=fd;
+      AddFD(fd,(st.hold_in?IN:0)|(st.hold_out?OUT:0));
+   }
+   held.set_length(j);
 }
 bool PollVec::FDReady(int fd,int mask)
 {
+   if(fd<0 || fd>=fd_state.count())
+      return true;   // not polled
+   unsigned st=fd_state[fd].bits;
    bool res=false;
    if(mask&IN)
-      res|=(!FD_ISSET(fd,&in_polled) || FD_ISSET(fd,&in_ready));
+      res|=(!(st&POLLED_IN) || (st&READY_IN));
    if(mask&OUT)
-      res|=(!FD_ISSET(fd,&out_polled) || FD_ISSET(fd,&out_ready));
+      res|=(!(st&POLLED_OUT) || (st&READY_OUT));
    return res;
 }
 void PollVec::FDSetNotReady(int fd,int mask)
 {
+   if(fd<0 || fd>=fd_state.count())
+      return;
    if(mask&IN)
-      FD_CLR(fd,&in_ready);
+      fd_state[fd].bits&=~READY_IN;
    if(mask&OUT)
-      FD_CLR(fd,&out_ready);
+      fd_state[fd].bits&=~READY_OUT;
+}
+void PollVec::ForgetFD(int fd)
+{
+   if(fd<0 || fd>=fd_state.count())
+      return;
+   // closing removes the fd from the epoll set, so a new fd with the same
+   // number has to be registered again. It is dropped from the lists lazily.
+   fd_state[fd].bits&=~(KERNEL_IN|KERNEL_OUT|POLLED_IN|POLLED_OUT|READY_IN|READY_OUT);
+}
+
+void PollVec::SetReady(int fd,bool in,bool out)
+{
+   unsigned short &st=fd_state[fd].bits;
+   bool was_ready=(st&(READY_IN|READY_OUT));
+   if(in && (st&POLLED_IN))
+      st|=READY_IN;
+   if(out && (st&POLLED_OUT))
+      st|=READY_OUT;
+   if(!was_ready && (st&(READY_IN|READY_OUT)))
+      ready.append(fd);
+}
+void PollVec::SetAllReady()
+{
+   // on error we don't know which fds are ready, let the tasks find out.
+   for(int i=0; i<polled.count(); i++)
+      SetReady(polled[i],true,true);
+}
+int PollVec::MaxFD() const
+{
+   int max=-1;
+   for(int i=0; i<fds.count(); i++)
+      if(max<fds[i])
+	 max=fds[i];
+   return max;
+}
+int PollVec::TimeoutMS() const
+{
+   if(tv_timeout.tv_sec<0)
+      return -1;
+   if(tv_timeout.tv_sec>=INT_MAX/1000-1)
+      return INT_MAX;
+   return tv_timeout.tv_sec*1000+(tv_timeout.tv_usec+999)/1000;
 }
 
 void  PollVec::Block()
 {
-   if(nfds<1 && tv_timeout.tv_sec<0)
+   AddHeld();
+   if(fds.count()==0 && tv_timeout.tv_sec<0)
    {
       /* dead lock */
       fprintf(stderr,_("%s: BUG - deadlock detected\n"),"PollVec::Block");
       tv_timeout.tv_sec=1;
    }
 
-   in_ready=in_polled=in;
-   out_ready=out_polled=out;
+   // forget the results of the previous poll
+   for(int i=0; i<polled.count(); i++)
+      fd_state[polled[i]].bits&=~(POLLED_IN|POLLED_OUT|READY_IN|READY_OUT);
+   polled.nset(fds.get(),fds.count());
+   ready.truncate();
+   for(int i=0; i<fds.count(); i++)
+   {
+      unsigned short &st=fd_state[fds[i]].bits;
+      st|=(st&(WANT_IN|WANT_OUT))<<2;
+   }
+
+   switch(method)
+   {
+   case SELECT:
+      if(MaxFD()<FD_SETSIZE)
+      {
+	 BlockSelect();
+	 break;
+      }
+      /* fall through: select cannot handle such fds */
+   case POLL:
+      BlockPoll(TimeoutMS());
+      break;
+   case EPOLL:
+      BlockEpoll(TimeoutMS());
+      break;
+   }
+}
+
+void PollVec::BlockSelect()
+{
+   fd_set in,out;
+   FD_ZERO(&in);
+   FD_ZERO(&out);
+   int nfds=0;
+   for(int i=0; i<fds.count(); i++)
+   {
+      int fd=fds[i];
+      unsigned st=fd_state[fd].bits;
+      if(st&WANT_IN)
+	 FD_SET(fd,&in);
+      if(st&WANT_OUT)
+	 FD_SET(fd,&out);
+      if(nfds<=fd)
+	 nfds=fd+1;
+   }
+   timeval tv=tv_timeout;
    timeval *select_timeout=0;
-   if(tv_timeout.tv_sec!=-1)
-      select_timeout=&tv_timeout;
-   select(nfds,&in_ready,&out_ready,0,select_timeout);
+   if(tv.tv_sec!=-1)
+      select_timeout=&tv;
+   if(select(nfds,&in,&out,0,select_timeout)==-1)
+   {
+      SetAllReady();
+      return;
+   }
+   for(int i=0; i<fds.count(); i++)
+   {
+      int fd=fds[i];
+      SetReady(fd,FD_ISSET(fd,&in),FD_ISSET(fd,&out));
+   }
+}
+
+void PollVec::BlockPoll(int timeout_ms)
+{
+   int n=fds.count();
+   pfd.get_space(n);
+   pfd.set_length(n);
+   for(int i=0; i<n; i++)
+   {
+      unsigned st=fd_state[fds[i]].bits;
+      pfd[i].fd=fds[i];
+      pfd[i].events=((st&WANT_IN)?POLLIN:0)|((st&WANT_OUT)?POLLOUT:0);
+      pfd[i].revents=0;
+   }
+   if(poll(pfd.get_non_const(),n,timeout_ms)==-1)
+   {
+      SetAllReady();
+      return;
+   }
+   for(int i=0; i<n; i++)
+   {
+      int r=pfd[i].revents;
+      if(!r)
+	 continue;
+      // errors are reported as readiness, as select does.
+      bool err=(r&(POLLERR|POLLHUP|POLLNVAL));
+      SetReady(pfd[i].fd,err||(r&POLLIN),err||(r&POLLOUT));
+   }
+}
+
+#if USE_EPOLL
+static xarray<epoll_event> epoll_events;
+
+bool PollVec::EpollInit()
+{
+   epoll_fd=epoll_create1(EPOLL_CLOEXEC);
+   return epoll_fd!=-1;
+}
+void PollVec::EpollClose()
+{
+   if(epoll_fd==-1)
+      return;
+   close(epoll_fd);
+   epoll_fd=-1;
+   for(int i=0; i<registered.count(); i++)
+      fd_state[registered[i]].bits&=~(KERNEL_IN|KERNEL_OUT|REGISTERED);
+   registered.truncate();
+}
+
+// Bring the epoll set in line with the wanted fds. Unchanged fds are not
+// touched, so the cost is proportional to the number of changes. Closing an
+// fd silently drops it from the epoll set, so the code closing a polled fd
+// has to call SMTask::FDClosed to make it registered again on reuse.
+// Returns true if some fd cannot be watched by epoll (e.g. a regular file);
+// such fds are reported as ready, as select does.
+bool PollVec::EpollSync()
+{
+   struct epoll_event ev;
+   memset(&ev,0,sizeof(ev));
+
+   int j=0;
+   for(int i=0; i<registered.count(); i++)
+   {
+      int fd=registered[i];
+      unsigned short &st=fd_state[fd].bits;
+      if(st&(WANT_IN|WANT_OUT))
+      {
+	 registered[j++]=fd;
+	 continue;
+      }
+      if(st&(KERNEL_IN|KERNEL_OUT))
+	 epoll_ctl(epoll_fd,EPOLL_CTL_DEL,fd,&ev); // fails if fd is closed
+      st&=~(KERNEL_IN|KERNEL_OUT|REGISTERED);
+   }
+   registered.set_length(j);
+
+   bool unwatched=false;
+   for(int i=0; i<fds.count(); i++)
+   {
+      int fd=fds[i];
+      unsigned short &st=fd_state[fd].bits;
+      unsigned want=(st&(WANT_IN|WANT_OUT))<<6;
+      unsigned have=st&(KERNEL_IN|KERNEL_OUT);
+      if(want==have)
+	 continue;
+      ev.events=((want&KERNEL_IN)?EPOLLIN:0)|((want&KERNEL_OUT)?EPOLLOUT:0);
+      ev.data.fd=fd;
+      int res=epoll_ctl(epoll_fd,have?EPOLL_CTL_MOD:EPOLL_CTL_ADD,fd,&ev);
+      if(res==-1 && errno==ENOENT)
+	 res=epoll_ctl(epoll_fd,EPOLL_CTL_ADD,fd,&ev);
+      else if(res==-1 && errno==EEXIST)
+	 res=epoll_ctl(epoll_fd,EPOLL_CTL_MOD,fd,&ev);
+      if(!(st&REGISTERED))
+      {
+	 registered.append(fd);
+	 st|=REGISTERED;
+      }
+      st&=~(KERNEL_IN|KERNEL_OUT);
+      if(res==-1)
+      {
+	 SetReady(fd,true,true);
+	 unwatched=true;
+	 continue;
+      }
+      st|=want;
+   }
+   return unwatched;
+}
+
+void PollVec::BlockEpoll(int timeout_ms)
+{
+   if(epoll_fd==-1 && !EpollInit())
+   {
+      method=POLL;
+      BlockPoll(timeout_ms);
+      return;
+   }
+   if(EpollSync())
+      timeout_ms=0;
+
+   int max=registered.count()+1;
+   xarray<epoll_event> &ev=epoll_events;
+   ev.get_space(max);
+   int n=epoll_wait(epoll_fd,ev.get_non_const(),max,timeout_ms);
+   if(n==-1)
+   {
+      SetAllReady();
+      return;
+   }
+   for(int i=0; i<n; i++)
+   {
+      unsigned e=ev[i].events;
+      int fd=ev[i].data.fd;
+      if(fd<0 || fd>=fd_state.count())
+	 continue;
+      bool err=(e&(EPOLLERR|EPOLLHUP));
+      SetReady(fd,err||(e&EPOLLIN),err||(e&EPOLLOUT));
+   }
+}
+#else // !USE_EPOLL
+bool PollVec::EpollInit() { return false; }
+void PollVec::EpollClose() {}
+bool PollVec::EpollSync() { return false; }
+void PollVec::BlockEpoll(int timeout_ms)
+{
+   method=POLL;
+   BlockPoll(timeout_ms);
 }
+#endif // !USE_EPOLL
@@ -27,35 +27,67 @@
 CDECL_BEGIN
 #include <poll.h>
 CDECL_END
+#include "xarray.h"
 
 class PollVec
 {
-   fd_set in;
-   fd_set out;
-   fd_set in_polled;
-   fd_set out_polled;
-   fd_set in_ready;
-   fd_set out_ready;
-   int nfds;
+public:
+   enum method_t {
+      SELECT,
+      POLL,
+      EPOLL,
+   };
+
+private:
+   // per-fd state bits, indexed by fd
+   enum {
+      WANT_IN=0x01,	// requested since last Empty()
+      WANT_OUT=0x02,
+      POLLED_IN=0x04,	// polled by last Block()
+      POLLED_OUT=0x08,
+      READY_IN=0x10,	// reported ready by last Block()
+      READY_OUT=0x20,
+      KERNEL_IN=0x40,	// registered in epoll set
+      KERNEL_OUT=0x80,
+      REGISTERED=0x100,	// listed in `registered'
+      HELD=0x200,	// listed in `held'
+   };
+   struct FDState {
+      unsigned short bits;
+      unsigned short hold_in;	// number of HoldFD for IN
+      unsigned short hold_out;
+   };
+   xarray<FDState> fd_state;
+   xarray<int> fds;	   // fds with WANT_* bits set
+   xarray<int> polled;	   // fds with POLLED_* bits set
+   xarray<int> registered; // fds with KERNEL_* bits set
+   xarray<int> held;	   // fds with HELD bit set
+   xarray<int> ready;	   // fds which became ready in last Block()
+   xarray<pollfd> pfd;
    struct timeval tv_timeout;
 
+   method_t method;
+   int epoll_fd;
+
+   FDState &State(int fd);
+   void AddHeld();
+   void SetReady(int fd,bool in,bool out);
+   void SetAllReady();
+   int MaxFD() const;
+
+   void BlockSelect();
+   void BlockPoll(int timeout_ms);
+   void BlockEpoll(int timeout_ms);
+   bool EpollInit();
+   void EpollClose();
+   bool EpollSync();
+   int  TimeoutMS() const;
+
 public:
-   PollVec() {
-      Empty();
-      FD_ZERO(&in_polled);
-      FD_ZERO(&out_polled);
-      FD_ZERO(&in_ready);
-      FD_ZERO(&out_ready);
-   }
+   PollVec();
+   ~PollVec();
 
-   void	 Empty()
-      {
-	 FD_ZERO(&in);
-	 FD_ZERO(&out);
-	 nfds=0;
-	 tv_timeout.tv_sec=-1;
-	 tv_timeout.tv_usec=0;
-      }
+   void	 Empty();
    void	 Block();
 
    enum {
@@ -72,8 +104,22 @@ public:
    void AddFD(int fd,int events);
    bool FDReady(int fd,int events);
    void FDSetNotReady(int fd,int events);
+   void ForgetFD(int fd); // fd is closed
    void NoWait() { tv_timeout.tv_sec=tv_timeout.tv_usec=0; }
    bool WillNotBlock() { return tv_timeout.tv_sec==0 && tv_timeout.tv_usec==0; }
+
+   // held fds are polled in every Block() until released.
+   void HoldFD(int fd,int events);
+   void ReleaseFD(int fd,int events);
+
+   int  ReadyFDCount() const { return ready.count(); }
+   int  ReadyFD(int i) const { return ready[i]; }
+   void ClearReadyFDs() { ready.truncate(); }
+
+   void SetMethod(method_t m);
+   method_t GetMethod() const { return method; }
+   const char *GetMethodName() const;
+   static bool FindMethod(const char *name,method_t *m);
 };
 
 #endif /* POLLVEC_H */
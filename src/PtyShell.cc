@@ -221,12 +221,18 @@ PtyShell::PtyShell(ArgV *a1)
 
 PtyShell::~PtyShell()
 {
-   if(fd!=-1)
+   if(fd!=-1) {
       close(fd);
-   if(pipe_in!=-1)
+      SMTask::FDClosed(fd);
+   }
+   if(pipe_in!=-1) {
       close(pipe_in);
-   if(pipe_out!=-1)
+      SMTask::FDClosed(pipe_in);
+   }
+   if(pipe_out!=-1) {
       close(pipe_out);
+      SMTask::FDClosed(pipe_out);
+   }
    if(w) {
       w->Kill();
       w.borrow()->Auto();
@@ -240,6 +246,7 @@ bool PtyShell::Done()
    if(fd!=-1)
    {
       close(fd);
+      SMTask::FDClosed(fd);
       fd=-1;
       closed=true;
    }
@@ -24,21 +24,35 @@
 
 // RateLimit class implementation.
 int RateLimit::total_xfer_number;
-RateLimit::BytesPool RateLimit::total[2];
+RateLimit::Node RateLimit::total;
+xmap_p<RateLimit::Node> RateLimit::hosts;
 bool RateLimit::total_reconfig_needed=true;
 
 RateLimit::RateLimit(const char *c)
 {
    if(total_xfer_number==0)
+      total.Reset();
+   total_xfer_number++;
+
+   host_name.set(c?c:"");
+   host=hosts.lookup(host_name);
+   if(!host)
    {
-      total[GET].Reset();
-      total[PUT].Reset();
+      host=new Node;
+      hosts.add(host_name,host);
+      host->Attach(&total);
    }
-   total_xfer_number++;
+   one.Attach(host);
    Reconfig(0,c);
 }
 RateLimit::~RateLimit()
 {
+   one.Detach();
+   if(host->children.count()==0)
+   {
+      host->Detach();
+      hosts.remove(host_name);
+   }
    total_xfer_number--;
 }
 
@@ -50,107 +64,232 @@ void RateLimit::BytesPool::AdjustTime()
 
    if(dif>0)
    {
-      // prevent overflow
-      if((LARGE-pool)/dif < rate)
-	 pool = pool_max;
-      else
-	 pool += int(dif*rate+0.5);
-
+      pool+=dif*rate;
       if(pool>pool_max)
 	 pool=pool_max;
 
       t=SMTask::now;
    }
 }
+int RateLimit::BytesPool::Available() const
+{
+   return pool<LARGE ? int(pool) : LARGE;
+}
+void RateLimit::BytesPool::Used(int bytes)
+{
+   pool-=bytes;
+   if(pool<0)
+      pool=0;
+}
+void RateLimit::BytesPool::Reset()
+{
+   pool=rate;
+   t=SMTask::now;
+}
+void RateLimit::BytesPool::Set(int r,int m)
+{
+   rate=r;
+   pool_max=(m>0 ? m : rate*DEFAULT_MAX_COEFF);
+   Reset(); // to cut bytes_pool.
+}
 
-int RateLimit::BytesAllowed(dir_t dir)
+RateLimit::Node::Node()
+   : parent(0), weight(1), children_weight(0), reconfig_needed(true)
 {
-   if(total_reconfig_needed)
-      ReconfigTotal();
+   for(int d=GET; d<=PUT; d++)
+   {
+      limit[d].Set(0,0);
+      share[d].Set(0,0);
+   }
+}
+void RateLimit::Node::Attach(Node *p)
+{
+   parent=p;
+   parent->children.append(this);
+   parent->children_weight+=weight;
+}
+void RateLimit::Node::Detach()
+{
+   for(int i=0; i<parent->children.count(); i++)
+   {
+      if(parent->children[i]==this)
+      {
+	 parent->children.remove(i);
+	 break;
+      }
+   }
+   parent->children_weight-=weight;
+   parent=0;
+}
+void RateLimit::Node::Reset()
+{
+   for(int d=GET; d<=PUT; d++)
+   {
+      limit[d].Reset();
+      share[d].Reset();
+   }
+}
 
-   if(one[dir].rate==0 && total[dir].rate==0) // unlimited
-      return LARGE;
+// The rate the node can count on; 0 means unlimited.
+double RateLimit::Node::Rate(dir_t d) const
+{
+   double r=0;
+   if(parent)
+   {
+      r=parent->Rate(d);
+      if(parent->children_weight>0)
+	 r=r*weight/parent->children_weight;
+   }
+   if(limit[d].rate>0 && (r==0 || r>limit[d].rate))
+      r=limit[d].rate;
+   return r;
+}
 
-   one  [dir].AdjustTime();
-   total[dir].AdjustTime();
+void RateLimit::Node::Refill(dir_t d,double parent_rate)
+{
+   int r=0;
+   if(parent_rate>0 && parent->children_weight>0)
+      r=int(parent_rate*weight/parent->children_weight+1);
+   if(share[d].rate!=r)
+   {
+      share[d].rate=r;
+      share[d].pool_max=r;   // reserve no more than a second of the rate
+   }
+   share[d].AdjustTime();
+}
 
+int RateLimit::Node::Allowed(dir_t d)
+{
    int ret=LARGE;
-   if(total[dir].rate>0)
-      ret=total[dir].pool/total_xfer_number;
-   if(one[dir].rate>0 && ret>one[dir].pool)
-      ret=one[dir].pool;
+   if(parent)
+      ret=parent->AllowedFor(this,d);
+   limit[d].AdjustTime();
+   if(limit[d].rate>0 && ret>limit[d].Available())
+      ret=limit[d].Available();
    return ret;
 }
 
-bool RateLimit::Relaxed(dir_t dir)
+/* A child can use its guaranteed share and borrow the tokens which are not
+ * reserved for the other children. */
+int RateLimit::Node::AllowedFor(const Node *child,dir_t d)
 {
-   if(total_reconfig_needed)
-      ReconfigTotal();
+   int allowed=Allowed(d);
+   if(allowed>=LARGE)
+      return LARGE;
+   double r=Rate(d);
+   double reserved=0;
+   for(int i=0; i<children.count(); i++)
+   {
+      children[i]->Refill(d,r);
+      reserved+=children[i]->share[d].pool;
+   }
+   double spare=allowed-reserved;
+   if(spare<0)
+      spare=0;
+   double ret=child->share[d].pool+spare;
+   return ret<allowed ? int(ret) : allowed;
+}
 
-   if(one[dir].rate==0 && total[dir].rate==0) // unlimited
-      return true;
-   one  [dir].AdjustTime();
-   total[dir].AdjustTime();
+void RateLimit::Node::Used(int bytes,dir_t d)
+{
+   for(Node *n=this; n; n=n->parent)
+   {
+      if(n->limit[d].rate>0)
+	 n->limit[d].Used(bytes);
+      n->share[d].Used(bytes);
+   }
+}
 
-   if(total[dir].rate>0 && total[dir].pool < total[dir].pool_max/2)
-      return false;
-   if(one[dir].rate>0 && one[dir].pool < one[dir].pool_max/2)
-      return false;
+bool RateLimit::Node::Relaxed(dir_t d) const
+{
+   for(const Node *n=this; n; n=n->parent)
+   {
+      const BytesPool& l=n->limit[d];
+      if(l.rate>0 && l.pool < l.pool_max/2)
+	 return false;
+   }
    return true;
 }
 
-void RateLimit::BytesPool::Used(int bytes)
+int RateLimit::BytesAllowed(dir_t dir)
 {
-   if(pool<bytes)
-      pool=0;
-   else
-      pool-=bytes;
+   if(total_reconfig_needed)
+      ReconfigTotal();
+   if(host->reconfig_needed)
+      ReconfigHost();
+
+   if(one.Rate(dir)==0) // unlimited
+      return LARGE;
+
+   return one.Allowed(dir);
 }
 
-void RateLimit::BytesUsed(int bytes,dir_t dir)
+bool RateLimit::Relaxed(dir_t dir)
 {
-   total[dir].Used(bytes);
-   one  [dir].Used(bytes);
+   if(total_reconfig_needed)
+      ReconfigTotal();
+   if(host->reconfig_needed)
+      ReconfigHost();
+
+   if(one.Rate(dir)==0) // unlimited
+      return true;
+   BytesAllowed(dir);  // refill the pools
+   return one.Relaxed(dir);
 }
 
-void RateLimit::BytesPool::Reset()
+void RateLimit::BytesUsed(int bytes,dir_t dir)
 {
-   pool=rate;
-   t=SMTask::now;
+   one.Used(bytes,dir);
 }
+
 void RateLimit::Reconfig(const char *name,const char *c)
 {
    if(name && strncmp(name,"net:limit-",10))
       return;
-   ResMgr::Query("net:limit-rate",c).ToNumberPair(one[GET].rate,one[PUT].rate);
-   ResMgr::Query("net:limit-max",c) .ToNumberPair(one[GET].pool_max,one[PUT].pool_max);
-   if(one[GET].pool_max==0)
-      one[GET].pool_max=one[GET].rate*DEFAULT_MAX_COEFF;
-   if(one[PUT].pool_max==0)
-      one[PUT].pool_max=one[PUT].rate*DEFAULT_MAX_COEFF;
-   one[GET].Reset(); // to cut bytes_pool.
-   one[PUT].Reset();
+   int rate[2],max[2];
+   ResMgr::Query("net:limit-rate",c).ToNumberPair(rate[GET],rate[PUT]);
+   ResMgr::Query("net:limit-max",c) .ToNumberPair(max[GET],max[PUT]);
+   one.limit[GET].Set(rate[GET],max[GET]);
+   one.limit[PUT].Set(rate[PUT],max[PUT]);
 
+   if(name && (!strncmp(name,"net:limit-host-",15) || !strcmp(name,"net:limit-share")))
+      host->reconfig_needed=true;
    if(name && !strncmp(name,"net:limit-total-",16))
       total_reconfig_needed=true;
 }
+void RateLimit::ReconfigHost()
+{
+   const char *c=host_name;
+   int rate[2],max[2];
+   ResMgr::Query("net:limit-host-rate",c).ToNumberPair(rate[GET],rate[PUT]);
+   ResMgr::Query("net:limit-host-max",c) .ToNumberPair(max[GET],max[PUT]);
+   host->limit[GET].Set(rate[GET],max[GET]);
+   host->limit[PUT].Set(rate[PUT],max[PUT]);
+
+   int weight=ResMgr::Query("net:limit-share",c);
+   if(weight<1)
+      weight=1;
+   total.children_weight+=weight-host->weight;
+   host->weight=weight;
+   host->reconfig_needed=false;
+}
 void RateLimit::ReconfigTotal()
 {
-   ResMgr::Query("net:limit-total-rate",0).ToNumberPair(total[GET].rate,total[PUT].rate);
-   ResMgr::Query("net:limit-total-max",0) .ToNumberPair(total[GET].pool_max,total[PUT].pool_max);
-   if(total[GET].pool_max==0)
-      total[GET].pool_max=total[GET].rate*DEFAULT_MAX_COEFF;
-   if(total[PUT].pool_max==0)
-      total[PUT].pool_max=total[PUT].rate*DEFAULT_MAX_COEFF;
-   total[GET].Reset();
-   total[PUT].Reset();
+   int rate[2],max[2];
+   ResMgr::Query("net:limit-total-rate",0).ToNumberPair(rate[GET],rate[PUT]);
+   ResMgr::Query("net:limit-total-max",0) .ToNumberPair(max[GET],max[PUT]);
+   total.limit[GET].Set(rate[GET],max[GET]);
+   total.limit[PUT].Set(rate[PUT],max[PUT]);
    total_reconfig_needed = false;
 }
 
 int RateLimit::LimitBufferSize(int size,dir_t d) const
 {
-   if(one[d].rate!=0 && size>one[d].pool_max)
-      size=one[d].pool_max;
+   for(const Node *n=&one; n; n=n->parent)
+   {
+      if(n->limit[d].rate!=0 && size>n->limit[d].pool_max)
+	 size=n->limit[d].pool_max;
+   }
    return size;
 }
 void RateLimit::SetBufferSize(IOBuffer *buf,int size) const
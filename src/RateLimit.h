@@ -22,7 +22,14 @@
 
 #include "TimeDate.h"
 #include "buffer.h"
+#include "xmap.h"
 
+/* Transfer rate limits form a tree of token buckets: all connections
+ * (net:limit-total-*), then connections to a host (net:limit-host-*), then
+ * a single connection (net:limit-*). A node can be limited by its own
+ * rate, and it is guaranteed a part of the parent's rate proportional to
+ * its weight (net:limit-share for hosts, equal parts for the connections of
+ * a host). The tokens not reserved by other nodes can be borrowed. */
 class RateLimit
 {
 public:
@@ -30,7 +37,7 @@ public:
    {
       friend class RateLimit;
 
-      int pool;
+      double pool;   // fractions of bytes are kept for smooth small rates
       int rate;
       int pool_max;
       Time t;
@@ -38,21 +45,51 @@ public:
       void AdjustTime();
       void Reset();
       void Used(int);
+      int Available() const;
+      void Set(int r,int m);
    };
 
+   enum dir_t { GET=0, PUT=1 };
+
 private:
+   class Node
+   {
+   public:
+      Node *parent;
+      xarray<Node*> children;
+      int weight;
+      int children_weight;
+      BytesPool limit[2];  // own limit, rate 0 means none
+      BytesPool share[2];  // the guaranteed part of the parent's rate
+      bool reconfig_needed;
+
+      Node();
+      void Attach(Node *p);
+      void Detach();
+      double Rate(dir_t d) const;
+      void Refill(dir_t d,double parent_rate);
+      int Allowed(dir_t d);
+      int AllowedFor(const Node *child,dir_t d);
+      void Used(int bytes,dir_t d);
+      bool Relaxed(dir_t d) const;
+      void Reset();
+   };
+
    static int total_xfer_number;
    static bool total_reconfig_needed;
    static void ReconfigTotal();
-   static BytesPool total[2];
-   BytesPool one[2];
+   static Node total;
+   static xmap_p<Node> hosts;
+   xstring host_name;
+   Node *host;
+   Node one;
+
+   void ReconfigHost();
 
 public:
    RateLimit(const char *closure);
    ~RateLimit();
 
-   enum dir_t { GET=0, PUT=1 };
-
    int BytesAllowed(dir_t how);
    int BytesAllowedToGet() { return BytesAllowed(GET); }
    int BytesAllowedToPut() { return BytesAllowed(PUT); }
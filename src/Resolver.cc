@@ -30,6 +30,7 @@
 #include <sys/socket.h>
 #include <netdb.h>
 #include <ctype.h>
+#include "c-ctype.h"
 #include <fcntl.h>
 
 #include <netinet/in.h>
@@ -115,8 +116,10 @@ Resolver::Resolver(const char *h,const char *p,const char *defp,
 
 Resolver::~Resolver()
 {
-   if(pipe_to_child[0]!=-1)
+   if(pipe_to_child[0]!=-1) {
       close(pipe_to_child[0]);
+      SMTask::FDClosed(pipe_to_child[0]);
+   }
    if(pipe_to_child[1]!=-1)
       close(pipe_to_child[1]);
 
@@ -931,10 +934,13 @@ void ResolverCache::Reconfig(const char *r)
 }
 ResolverCacheEntry *ResolverCache::Find(const char *h,const char *p,const char *defp,const char *ser,const char *pr)
 {
-   for(ResolverCacheEntry *c=IterateFirst(); c; c=IterateNext())
+   for(ResolverCacheEntry *c=HashFirst(ResolverCacheEntryLoc::Hash(h)); c; c=HashNext(c))
    {
       if(c->Matches(h,p,defp,ser,pr))
+      {
+	 Touch(c);
 	 return c;
+      }
    }
    return 0;
 }
@@ -949,7 +955,7 @@ void ResolverCache::Add(const char *h,const char *p,const char *defp,
    {
       if(!IsEnabled(h))
 	 return;
-      AddCacheEntry(new ResolverCacheEntry(h,p,defp,ser,pr,a,n));
+      AddCacheEntry(new ResolverCacheEntry(h,p,defp,ser,pr,a,n),ResolverCacheEntryLoc::Hash(h));
    }
 }
 bool ResolverCacheEntryLoc::Matches(const char *h,const char *p,
@@ -961,6 +967,13 @@ bool ResolverCacheEntryLoc::Matches(const char *h,const char *p,
       && !xstrcmp(service,ser)
       && !xstrcmp(proto,pr));
 }
+unsigned ResolverCacheEntryLoc::Hash(const char *h)
+{
+   unsigned hash=0x12345678;
+   for( ; h && *h; h++)
+      hash+=(hash<<5)+c_tolower(*h);
+   return hash;
+}
 void ResolverCache::Find(const char *h,const char *p,const char *defp,
 	 const char *ser,const char *pr,const sockaddr_u **a,int *n)
 {
@@ -976,7 +989,7 @@ void ResolverCache::Find(const char *h,const char *p,const char *defp,
    {
       if(c->Stopped())
       {
-	 Trim();
+	 Delete(c);
 	 return;
       }
       c->GetData(a,n);
@@ -96,6 +96,7 @@ public:
       : hostname(h), portname(p), defport(defp), service(ser), proto(pr) {}
    const char *GetClosure() const { return hostname; }
    bool Matches(const char *h,const char *p,const char *defp,const char *ser,const char *pr);
+   static unsigned Hash(const char *h);
 };
 class ResolverCacheEntryData
 {
@@ -126,6 +127,8 @@ class ResolverCache : public Cache, public ResClient
    ResolverCacheEntry *IterateFirst() { return (ResolverCacheEntry*)Cache::IterateFirst(); }
    ResolverCacheEntry *IterateNext()  { return (ResolverCacheEntry*)Cache::IterateNext(); }
    ResolverCacheEntry *IterateDelete(){ return (ResolverCacheEntry*)Cache::IterateDelete(); }
+   ResolverCacheEntry *HashFirst(unsigned h) { return (ResolverCacheEntry*)Cache::HashFirst(h); }
+   ResolverCacheEntry *HashNext(ResolverCacheEntry *c) { return (ResolverCacheEntry*)Cache::HashNext(c); }
 public:
    void Add(const char *h,const char *p,const char *defp,
          const char *ser,const char *pr,const sockaddr_u *a,int n);
@@ -258,7 +258,7 @@ int SFtp::Do()
 	 return m;
       if(s<size_write && !eof && !flush_timer.Stopped())
 	 return m;   // wait for more data before sending.
-      if(RespQueueSize()>max_packets_in_flight)
+      if(RespQueueSize()>window.Get())
 	 return m;
       if(s==0)
       {
@@ -302,6 +302,7 @@ void SFtp::MoveConnectionHere(SFtp *o)
    send_translate=o->send_translate.borrow();
    rate_limit=o->rate_limit.borrow();
    expect_queue.move_here(o->expect_queue);
+   window=o->window;
    timeout_timer.Reset(o->timeout_timer);
    ssh_id=o->ssh_id;
    state=CONNECTED;
@@ -324,6 +325,7 @@ void SFtp::DisconnectLL()
    send_translate=0;
    recv_translate=0;
    ssh_id=0;
+   window.Reset();
    home_auto.set(FindHomeAuto());
    // may have to resend file info queries.
    if(fileset_for_info)
@@ -561,6 +563,7 @@ const char *SFtp::WirePath(const char *path)
 void SFtp::SendRequest()
 {
    max_packets_in_flight_slow_start=1;
+   window.Restart();
    ExpandTildeInCWD();
    switch((open_mode)mode)
    {
@@ -669,7 +672,7 @@ void SFtp::SendRequest()
 void SFtp::SendArrayInfoRequests()
 {
    for(FileInfo *fi=fileset_for_info->curr();
-      fi && RespQueueSize()<max_packets_in_flight;
+      fi && RespQueueSize()<window.Get();
       fi=fileset_for_info->next())
    {
       if(fi->need&(fi->SIZE|fi->DATE|fi->MODE|fi->TYPE|fi->USER|fi->GROUP)) {
@@ -866,7 +869,7 @@ void SFtp::HandleExpect(Expect *e)
       }
       break;
    case Expect::DATA:
-      if(max_packets_in_flight_slow_start<max_packets_in_flight)
+      if(max_packets_in_flight_slow_start<window.Get())
 	 max_packets_in_flight_slow_start++;
       if(reply->TypeIs(SSH_FXP_DATA))
       {
@@ -894,7 +897,7 @@ void SFtp::HandleExpect(Expect *e)
 	 {
 	    LogNote(9,"put a packet with id=%d on out-of-order chain (need_pos=%lld packet_pos=%lld)",
 	       reply->GetID(),(long long)(pos+file_buf->Size()),(long long)r->pos);
-	    if(ooo_chain.count()>=64)
+	    if(ooo_chain.count()>=64 && ooo_chain.count()>=window.Get())
 	    {
 	       LogError(0,"Too many out-of-order packets");
 	       Disconnect();
@@ -1106,6 +1109,10 @@ int SFtp::HandleReplies()
       delete reply;
       return MOVED;
    }
+   if(e->tag==Expect::DATA && mode==RETRIEVE)
+      window.Sample(e->sent,reply->GetLength(),size_read);
+   else if(e->tag==Expect::WRITE_STATUS)
+      window.Sample(e->sent,e->request->GetLength(),size_write);
    HandleExpect(e);
    return MOVED;
 }
@@ -1174,12 +1181,13 @@ int SFtp::Read(Buffer *buf,int size)
    if(state==FILE_RECV)
    {
       // keep some packets in flight.
-      int limit=(entity_size>=0?max_packets_in_flight:max_packets_in_flight_slow_start);
-      if(RespQueueSize()<limit && !file_buf->Eof())
+      int limit=(entity_size>=0?window.Get():max_packets_in_flight_slow_start);
+      while(RespQueueSize()<limit && !file_buf->Eof())
       {
 	 // but don't request much after possible EOF.
-	 if(entity_size<0 || request_pos<entity_size || RespQueueSize()<2)
-	    RequestMoreData();
+	 if(entity_size>=0 && request_pos>=entity_size && RespQueueSize()>=2)
+	    break;
+	 RequestMoreData();
       }
    }
 
@@ -1327,15 +1335,74 @@ const char *SFtp::CurrentStatus()
    case WAITING:
       return _("Waiting for response...");
    case FILE_RECV:
-      return _("Receiving data");
+      return WindowStatus(_("Receiving data"));
    case FILE_SEND:
-      return _("Sending data");
+      return WindowStatus(_("Sending data"));
    case DONE:
       return _("Done");
    }
    return "";
 }
 
+void SFtpWindow::Reset()
+{
+   window=INITIAL;
+   slow_start=true;
+   min_rtt=srtt=0;
+   interval_start=SMTask::now;
+   interval_bytes=0;
+   Clamp();
+}
+void SFtpWindow::Restart()
+{
+   slow_start=true;
+   interval_start=SMTask::now;
+   interval_bytes=0;
+}
+void SFtpWindow::Clamp()
+{
+   if(window>max_window)
+      window=max_window;
+   if(window<MIN)
+      window=MIN;
+}
+void SFtpWindow::Sample(const Time& sent,int bytes,int packet_size)
+{
+   double rtt=TimeDiff(SMTask::now,sent);
+   if(rtt<0.0001)
+      rtt=0.0001;
+   if(min_rtt==0 || rtt<min_rtt)
+      min_rtt=rtt;
+   srtt=(srtt==0 ? rtt : (srtt*7+rtt)/8);
+
+   interval_bytes+=bytes;
+   double elapsed=TimeDiff(SMTask::now,interval_start);
+   if(elapsed>=srtt && elapsed>0)
+   {
+      // a round trip has passed, check how much was delivered.
+      double bdp=interval_bytes/elapsed*min_rtt/packet_size;
+      interval_start=SMTask::now;
+      interval_bytes=0;
+      if(Queueing())
+      {
+	 slow_start=false;
+	 window=int(bdp*1.25)+2;
+      }
+      else if(!slow_start)
+	 window+=window/8+1;  // probe for more bandwidth
+   }
+   if(slow_start)
+      window++;  // doubles every round trip
+   Clamp();
+}
+
+const char *SFtp::WindowStatus(const char *s)
+{
+   if(window.RTTms()==0)
+      return s;
+   return xstring::format(_("%s (window: %d, rtt: %dms)"),s,window.Get(),window.RTTms());
+}
+
 bool SFtp::SameSiteAs(const FileAccess *fa) const
 {
    if(!SameProtoAs(fa))
@@ -1383,6 +1450,7 @@ void SFtp::Reconfig(const char *name)
       max_packets_in_flight=1;
    if(max_packets_in_flight_slow_start>max_packets_in_flight)
       max_packets_in_flight_slow_start=max_packets_in_flight;
+   window.SetMax(max_packets_in_flight);
    size_read=Query("size-read",c);
    size_write=Query("size-write",c);
    if(size_read<16)
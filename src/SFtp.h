@@ -26,6 +26,31 @@
 #include <sys/stat.h>
 #include "FileSet.h"
 
+// Number of requests to keep in flight. It grows like TCP slow start
+// until the round trip time starts to grow (the requests are queued
+// somewhere), then follows the measured bandwidth-delay product.
+class SFtpWindow
+{
+   enum { INITIAL=16, MIN=2 };
+   int window;
+   int max_window;
+   bool slow_start;
+   double min_rtt;   // seconds, 0 if not measured yet
+   double srtt;
+   Time interval_start;
+   long long interval_bytes;
+   bool Queueing() const { return srtt>min_rtt*1.5+0.002; }
+   void Clamp();
+public:
+   SFtpWindow() : max_window(INITIAL) { Reset(); }
+   void Reset();	// new connection
+   void Restart();	// new transfer
+   void SetMax(int m) { max_window=m; Clamp(); }
+   void Sample(const Time& sent,int bytes,int packet_size);
+   int Get() const { return window; }
+   int RTTms() const { return int(srtt*1000+0.5); }
+};
+
 class SFtp : public SSH_Access
 {
    int	 protocol_version;
@@ -705,7 +730,8 @@ private:
       Ref<Packet> reply;
       int i;
       expect_t tag;
-      Expect(Packet *req,expect_t t,int j=0) : request(req), i(j), tag(t) {}
+      Time sent;
+      Expect(Packet *req,expect_t t,int j=0) : request(req), i(j), tag(t), sent(SMTask::now) {}
 
       bool has_data_at_pos(off_t pos) const {
 	 if(!reply->TypeIs(SSH_FXP_DATA) || !request->TypeIs(SSH_FXP_READ))
@@ -751,7 +777,9 @@ private:
    FileInfo *MakeFileInfo(const NameAttrs *a);
 
    int max_packets_in_flight;
-   int max_packets_in_flight_slow_start;
+   int max_packets_in_flight_slow_start;  // when the file size is unknown
+   SFtpWindow window;
+   const char *WindowStatus(const char *s);
    int size_read;
    int size_write;
    bool use_full_path;
@@ -40,6 +40,13 @@ xlist_head<SMTask>  SMTask::all_tasks;
 xlist_head<SMTask>  SMTask::ready_tasks;
 xlist_head<SMTask>  SMTask::new_tasks;
 xlist_head<SMTask>  SMTask::deleted_tasks;
+xlist_head<SMTask>  SMTask::idle_tasks;
+int SMTask::idle_count;
+xarray_p< xarray<SMTask*> > SMTask::fd_waiters;
+
+unsigned long long SMTask::total_do_count;
+unsigned long long SMTask::total_stall_count;
+unsigned long long SMTask::total_wakeup_count;
 
 SMTask	 *SMTask::current;
 
@@ -64,6 +71,13 @@ SMTask::SMTask()
    running=0;
    ref_count=0;
    deleting=false;
+   wait_for_events=false;
+   idle=false;
+   wait_timeout_us=-1;
+   wait_timer=false;
+   wake_timer=0;
+   do_count=0;
+   stall_count=0;
    new_tasks.add(new_tasks_node);
    DEBUG(("new SMTask %p (count=%d)\n",this,all_tasks.count()));
 }
@@ -104,6 +118,7 @@ void  SMTask::ResumeSlave()
 }
 void SMTask::ResumeInternal()
 {
+   Wake();
    if(!new_tasks_node.listed() && !ready_tasks_node.listed())
       new_tasks.add_tail(new_tasks_node);
 }
@@ -115,6 +130,11 @@ SMTask::~SMTask()
    assert(!ref_count);
    assert(deleting);
 
+   Unpark();
+   delete wake_timer;
+   xlist_for_each_safe(Timer,wait_timers,node,timer,next)
+      timer->ClearWaiter();
+
    if(ready_tasks_node.listed())
       ready_tasks_node.remove();
    if(new_tasks_node.listed())
@@ -167,6 +187,7 @@ int SMTask::Roll(SMTask *task)
    int m=STALL;
    if(task->running || task->deleting)
       return m;
+   task->Wake();
    Enter(task);
    while(!task->deleting && task->Do()==MOVED)
       m=MOVED;
@@ -205,12 +226,132 @@ int SMTask::ScheduleThis()
       ready_tasks_node.remove();
       return STALL;
    }
+   if(wait_for_events)
+   {
+      wait_fds.truncate();
+      wait_timeout_us=-1;
+      wait_timer=false;
+   }
    Enter();	   // mark it current and running.
    int res=Do();   // let it run.
    Leave();	   // unmark it running and change current.
+   do_count++;
+   total_do_count++;
+   if(res==STALL)
+   {
+      stall_count++;
+      total_stall_count++;
+      if(wait_for_events && !deleting && !IsSuspended())
+	 Park();
+   }
    return res;
 }
 
+xarray<SMTask*>& SMTask::FDWaiters(int fd)
+{
+   while(fd_waiters.count()<=fd)
+      fd_waiters.append(0);
+   if(!fd_waiters[fd])
+      fd_waiters[fd]=new xarray<SMTask*>;
+   return *fd_waiters[fd];
+}
+void SMTask::AddWaitFD(int fd,int mask)
+{
+   if(fd<0)
+      return;
+   for(int i=0; i<wait_fds.count(); i++)
+   {
+      if(wait_fds[i].fd==fd)
+      {
+	 wait_fds[i].mask|=mask;
+	 return;
+      }
+   }
+   WaitFD w={fd,mask};
+   wait_fds.append(w);
+}
+void SMTask::AddWaitTimeoutU(int us)
+{
+   if(us<0)
+      us=0;
+   if(wait_timeout_us<0 || us<wait_timeout_us)
+      wait_timeout_us=us;
+}
+
+// Move the task to idle_tasks if it waits for something we can detect.
+bool SMTask::Park()
+{
+   if(wait_fds.count()==0 && !wait_timer)
+      return false;
+   if(wait_timeout_us==0)
+      return false;
+   ready_tasks_node.remove();
+   idle_tasks.add(ready_tasks_node);
+   idle=true;
+   idle_count++;
+   for(int i=0; i<wait_fds.count(); i++)
+   {
+      FDWaiters(wait_fds[i].fd).append(this);
+      block.HoldFD(wait_fds[i].fd,wait_fds[i].mask);
+   }
+   if(wait_timeout_us>0)
+   {
+      if(!wake_timer)
+	 wake_timer=new Timer;
+      wake_timer->SetMicroSeconds(wait_timeout_us);
+      wake_timer->SetWaiter(this);
+   }
+   return true;
+}
+void SMTask::Unpark()
+{
+   if(!idle)
+      return;
+   idle=false;
+   idle_count--;
+   ready_tasks_node.remove();
+   for(int i=0; i<wait_fds.count(); i++)
+   {
+      int fd=wait_fds[i].fd;
+      xarray<SMTask*>& w=FDWaiters(fd);
+      int j=w.search(this);
+      if(j>=0)
+	 w.remove(j);
+      block.ReleaseFD(fd,wait_fds[i].mask);
+   }
+   wait_fds.truncate();
+   if(wake_timer)
+      wake_timer->Stop();
+}
+void SMTask::Wake()
+{
+   if(!idle)
+      return;
+   Unpark();
+   total_wakeup_count++;
+   if(!new_tasks_node.listed())
+      new_tasks.add_tail(new_tasks_node);
+}
+void SMTask::WakeAll()
+{
+   xlist_for_each_safe(SMTask,idle_tasks,node,task,next)
+      task->Wake();
+}
+// wake up the tasks waiting for fds found ready by last Block().
+void SMTask::WakeReady()
+{
+   for(int i=0; i<block.ReadyFDCount(); i++)
+   {
+      int fd=block.ReadyFD(i);
+      if(fd>=fd_waiters.count() || !fd_waiters[fd])
+	 continue;
+      xarray<SMTask*>& w=*fd_waiters[fd];
+      while(w.count()>0)
+	 w.last()->Wake();  // removes it from w
+   }
+   block.ClearReadyFDs();
+}
+
 int SMTask::ScheduleNew()
 {
    int res=STALL;
@@ -235,6 +376,7 @@ void SMTask::Schedule()
    // get time once and assume Do() don't take much time
    UpdateNow();
 
+   WakeReady();
    timeval timer_timeout=Timer::GetTimeoutTV();
    if(timer_timeout.tv_sec>=0)
       block.SetTimeout(timer_timeout);
@@ -258,8 +400,11 @@ void SMTask::Schedule()
 void SMTask::Block()
 {
    // use timer to force periodic select to find out which FDs are ready.
-   if(block.WillNotBlock() && last_block==now.UnixTime())
+   // idle tasks are only woken up by a poll, so don't skip it then.
+   if(block.WillNotBlock() && last_block==now.UnixTime() && idle_count==0)
       return;
+   if(!poll_method_config)
+      SetPollMethod();
    block.Block();
    last_block=now.UnixTime();
 }
@@ -287,11 +432,39 @@ void SMTask::Cleanup()
    CollectGarbage();
    Delete(init_task);
    CollectGarbage();
+   delete poll_method_config;
+   poll_method_config=0;
 }
 
 #include <errno.h>
 #include "ResMgr.h"
 ResDecl enospc_fatal ("xfer:disk-full-fatal","no",ResMgr::BoolValidate,ResMgr::NoClosure);
+
+static const char *PollMethodValidate(xstring_c *s)
+{
+   PollVec::method_t m;
+   if(!PollVec::FindMethod(*s,&m))
+      return _("invalid poll method, must be one of: auto, select, poll, epoll");
+   return 0;
+}
+ResDecl poll_method ("cmd:poll-method","auto",PollMethodValidate,ResMgr::NoClosure);
+class PollMethodConfig : public ResClient
+{
+   void Reconfig(const char *name)
+      {
+	 if(!name || !strcmp(name,"cmd:poll-method"))
+	    SMTask::SetPollMethod();
+      }
+};
+PollMethodConfig *SMTask::poll_method_config;
+void SMTask::SetPollMethod()
+{
+   if(!poll_method_config)
+      poll_method_config=new PollMethodConfig; // to get notified of changes
+   PollVec::method_t m;
+   if(PollVec::FindMethod(poll_method.Query(0),&m))
+      block.SetMethod(m);
+}
 bool SMTask::NonFatalError(int err)
 {
    if(E_RETRY(err))
@@ -327,7 +500,14 @@ void SMTask::PrintTasks()
    {
       const char *c=scan->GetLogContext();
       if(!c) c="";
-      printf("%p\t%c%c%c\t%d\t%s\n",scan,scan->running?'R':' ',
-	 scan->suspended?'S':' ',scan->deleting?'D':' ',scan->ref_count,c);
+      printf("%p\t%c%c%c%c\t%d\t%lu/%lu\t%s\n",scan,scan->running?'R':' ',
+	 scan->suspended?'S':' ',scan->deleting?'D':' ',scan->idle?'I':' ',
+	 scan->ref_count,scan->stall_count,scan->do_count,c);
    }
 }
+void SMTask::PrintStats()
+{
+   printf("idle_tasks=%d poll_method=%s\n",idle_count,block.GetMethodName());
+   printf("do_calls=%llu stalled=%llu wakeups=%llu\n",
+      total_do_count,total_stall_count,total_wakeup_count);
+}
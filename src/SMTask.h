@@ -29,8 +29,12 @@
 #include "Error.h"
 #include <errno.h>
 
+class Timer;
+
 class SMTask
 {
+   friend class Timer;
+
    virtual int Do() = 0;
 
    // all tasks list
@@ -49,6 +53,14 @@ class SMTask
    static xlist_head<SMTask> deleted_tasks;
    xlist<SMTask> deleted_tasks_node;
 
+   // tasks waiting for events, linked by ready_tasks_node
+   static xlist_head<SMTask> idle_tasks;
+   static int idle_count;
+
+   // event to task map: tasks waiting for each fd
+   static xarray_p< xarray<SMTask*> > fd_waiters;
+   static xarray<SMTask*>& FDWaiters(int fd);
+
    static PollVec block;
    enum { SMTASK_MAX_DEPTH=64 };
    static SMTask *stack[SMTASK_MAX_DEPTH];
@@ -61,8 +73,34 @@ class SMTask
    int	 ref_count;
    bool	 deleting;
 
+   // events the task waits for, collected during Do()
+   bool	 wait_for_events;
+   bool	 idle;
+   struct WaitFD { int fd; int mask; };
+   xarray<WaitFD> wait_fds;
+   int	 wait_timeout_us;
+   bool	 wait_timer;
+   xlist_head<Timer> wait_timers;   // timers which wake this task up
+   Timer *wake_timer;
+   void AddWaitFD(int fd,int mask);
+   void AddWaitTimeoutU(int us);
+   bool Park();
+   void Unpark();
+   static void WakeReady();
+   static void WakeAll();
+
+   // statistics
+   unsigned long do_count;
+   unsigned long stall_count;
+   static unsigned long long total_do_count;
+   static unsigned long long total_stall_count;
+   static unsigned long long total_wakeup_count;
+
    int ScheduleThis();
    static int ScheduleNew();
+   static class PollMethodConfig *poll_method_config;
+   static void SetPollMethod();
+   friend class PollMethodConfig;
 
 protected:
    enum
@@ -77,16 +115,32 @@ protected:
    virtual void ResumeInternal();
    virtual void PrepareToDie() {}  // it is called from Delete no matter of running and ref_count
 
+   // When set, a task which returns STALL after waiting for some fds or
+   // checking a running Timer is not run again until one of those events
+   // happens or Wake() is called. Only use it for tasks which don't depend
+   // on state changed by other tasks without a Wake().
+   void SetWaitForEvents(bool yes=true) { wait_for_events=yes; }
+
    bool Deleted() const { return deleting; }
    virtual ~SMTask();
 
 public:
-   static void Block(int fd,int mask) { block.AddFD(fd,mask); }
-   static void TimeoutU(int us) { block.AddTimeoutU(us); }
+   static void Block(int fd,int mask) {
+      block.AddFD(fd,mask);
+      if(current && current->wait_for_events)
+	 current->AddWaitFD(fd,mask);
+   }
+   static void TimeoutU(int us) {
+      block.AddTimeoutU(us);
+      if(current && current->wait_for_events)
+	 current->AddWaitTimeoutU(us);
+   }
    static void Timeout(int ms) { TimeoutU(1000*ms); }
    static void TimeoutS(int s) { TimeoutU(1000000*s); }
    static bool Ready(int fd,int mask) { return block.FDReady(fd,mask); }
    static void SetNotReady(int fd,int mask) { block.FDSetNotReady(fd,mask); }
+   // must be called when a polled fd is closed, its number can be reused.
+   static void FDClosed(int fd) { block.ForgetFD(fd); }
 
    static TimeDate now;
    static void UpdateNow() { now.SetToCurrentTime(); }
@@ -106,6 +160,10 @@ public:
 
    bool IsSuspended() { return suspended|suspended_slave; }
 
+   // make an idle task run again
+   void Wake();
+   bool IsIdle() const { return idle; }
+
    virtual const char *GetLogContext() { return 0; }
    static const char *GetCurrentLogContext() { return current->GetLogContext(); }
 
@@ -132,6 +190,7 @@ public:
 
    static int TaskCount();
    static void PrintTasks();
+   static void PrintStats();
    static bool NonFatalError(int err);
    static bool TemporaryNetworkError(int err) { return temporary_network_error(err); }
    static Error *SysError(int e=errno) { return new Error(e,strerror(e),!NonFatalError(e)); }
@@ -33,7 +33,10 @@ timeval Timer::GetTimeoutTV()
 {
    Timer *t;
    while((t=running_timers.get_min())!=0 && t->Stopped())
+   {
       running_timers.pop_min();
+      t->WakeWaiter();
+   }
    if(!t) {
       timeval tv={infty_count?HOUR:-1, 0};
       return tv;
@@ -115,7 +118,44 @@ bool Timer::Stopped() const
 {
    if(IsInfty())
       return false;
-   return now>=stop;
+   if(now>=stop)
+      return true;
+   SMTask *task=SMTask::current;
+   if(task && task->wait_for_events)
+      SetWaiter(task);
+   return false;
+}
+void Timer::SetWaiter(SMTask *task) const
+{
+   task->wait_timer=true;
+   if(waiter==task)
+      return;
+   if(waiter)
+   {
+      // more than one task checks this timer, wake them all.
+      waiter_shared=true;
+      return;
+   }
+   waiter=task;
+   task->wait_timers.add(waiter_node);
+}
+void Timer::ClearWaiter() const
+{
+   if(!waiter)
+      return;
+   waiter_node.remove();
+   waiter=0;
+}
+void Timer::WakeWaiter()
+{
+   if(waiter_shared)
+   {
+      waiter_shared=false;
+      SMTask::WakeAll();
+   }
+   else if(waiter)
+      waiter->Wake();
+   ClearWaiter();
 }
 void Timer::reconfig(const char *r)
 {
@@ -127,28 +167,31 @@ void Timer::init()
    resource=0;
    closure=0;
    random_max=0;
+   waiter=0;
+   waiter_shared=false;
    all_timers.add(all_timers_node);
 }
 Timer::~Timer()
 {
+   ClearWaiter();
    running_timers.remove(running_timers_node);
    all_timers_node.remove();
    infty_count-=IsInfty();
 }
 Timer::Timer() : last_setting(1,0),
-   all_timers_node(this), running_timers_node(this)
+   all_timers_node(this), running_timers_node(this), waiter_node(this)
 {
    init();
 }
 Timer::Timer(const TimeInterval &d) : last_setting(d),
-   all_timers_node(this), running_timers_node(this)
+   all_timers_node(this), running_timers_node(this), waiter_node(this)
 {
    init();
    infty_count+=IsInfty();
    re_set();
 }
 Timer::Timer(const char *r,const char *c) : last_setting(0,0),
-   all_timers_node(this), running_timers_node(this)
+   all_timers_node(this), running_timers_node(this), waiter_node(this)
 {
    init();
    resource=r;
@@ -157,7 +200,7 @@ Timer::Timer(const char *r,const char *c) : last_setting(0,0),
    reconfig(r);
 }
 Timer::Timer(int s,int ms) :
-   all_timers_node(this), running_timers_node(this)
+   all_timers_node(this), running_timers_node(this), waiter_node(this)
 {
    init();
    Set(TimeInterval(s,ms));
@@ -27,6 +27,8 @@
 
 class Timer
 {
+   friend class SMTask;
+
    Time start;
    Time stop;
    TimeInterval last_setting;
@@ -40,6 +42,14 @@ class Timer
    static xheap<Timer> running_timers;
    xheap<Timer>::node running_timers_node;
 
+   // the task to wake up when the timer expires (see SMTask::Wake)
+   mutable SMTask *waiter;
+   mutable bool waiter_shared;
+   mutable xlist<Timer> waiter_node;
+   void SetWaiter(SMTask *) const;
+   void ClearWaiter() const;
+   void WakeWaiter();
+
    void re_sort();
    void re_set();
    void add_random();
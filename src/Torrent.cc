@@ -28,6 +28,8 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <limits.h>
+#include <sys/uio.h>
 #include <sha1.h>
 #include <dirent.h>
 
@@ -38,6 +40,8 @@
 #include "url.h"
 #include "misc.h"
 #include "plural.h"
+#include "lftp_sha1.h"
+#include "FileLayout.h"
 CDECL_BEGIN
 #include "human.h"
 CDECL_END
@@ -54,6 +58,8 @@ static ResType torrent_vars[] = {
    {"torrent:retracker", ""},
    {"torrent:use-dht", "yes", ResMgr::BoolValidate, ResMgr::NoClosure},
    {"torrent:timeout", "7d", ResMgr::TimeIntervalValidate, ResMgr::NoClosure},
+   {"torrent:read-cache-size", "16M", ResMgr::UNumberValidate},
+   {"torrent:write-cache-size", "16M", ResMgr::UNumberValidate},
 #if INET6
    {"torrent:ipv6", "", ResMgr::IPv6AddrValidate, ResMgr::NoClosure},
 #endif
@@ -225,7 +231,7 @@ Torrent::Torrent(const char *mf,const char *c,const char *od)
      timeout_timer("torrent:timeout",0),
      optimistic_unchoke_timer(30), peers_scan_timer(1),
      am_interested_timer(1), shutting_down_timer(60),
-     dht_announce_timer(10*60),
+     dht_announce_timer(10*60), write_back_timer(5),
      dht_announce_count(0), dht_announce_count_ipv6(0)
 {
    shutting_down=false;
@@ -239,6 +245,7 @@ Torrent::Torrent(const char *mf,const char *c,const char *od)
    stop_if_known=false;
    md_saved=false;
    validate_index=0;
+   validate_next=0;
    metadata_size=0;
    info=0;
    pieces=0;
@@ -265,6 +272,14 @@ Torrent::Torrent(const char *mf,const char *c,const char *od)
    pieces_available_pct=0;
    current_min_ppr=0;
    current_max_ppr=0;
+   write_cache_max=0;
+   write_cache_size=0;
+   blocks_stored=0;
+   write_calls=0;
+   read_cache_max=0;
+   read_cache_size=0;
+   read_cache_hits=0;
+   read_cache_misses=0;
    Reconfig(0);
 
    if(!my_peer_id) {
@@ -283,6 +298,9 @@ Torrent::Torrent(const char *mf,const char *c,const char *od)
 
 Torrent::~Torrent()
 {
+   for(int i=0; i<hash_jobs.count(); i++)
+      WorkerPool::Cancel(hash_jobs[i]);
+   CancelValidation();
 }
 
 bool Torrent::TrackersDone() const
@@ -346,6 +364,7 @@ void Torrent::RemoveTorrent(Torrent *t)
 
 void Torrent::PrepareToDie()
 {
+   FlushWriteBack();
    metainfo_copy=0;
    building=0;
    peers.unset();
@@ -378,6 +397,8 @@ double Torrent::GetRatio() const
 void Torrent::SetDownloader(unsigned piece,unsigned block,const TorrentPeer *o,const TorrentPeer *n)
 {
    piece_info[piece].set_downloader(block,o,n,BlocksInPiece(piece));
+   if(!n && my_bitfield->get_bit(piece))
+      piece_info[piece].cleanup();
 }
 
 void Torrent::AccountSend(unsigned p,unsigned len)
@@ -441,22 +462,20 @@ void Torrent::TranslateStringFromUTF8(BeNode *node) const
 void Torrent::SHA1(const xstring& str,xstring& buf)
 {
    buf.get_space(SHA1_DIGEST_SIZE);
-   sha1_buffer(str.get(),str.length(),buf.get_non_const());
+   lftp_sha1_buffer(str.get(),str.length(),buf.get_non_const());
    buf.set_length(SHA1_DIGEST_SIZE);
 }
 
-void Torrent::ValidatePiece(unsigned p)
+// sha1 is null when the piece could not be read completely
+void Torrent::PieceValidated(unsigned p,const xstring *sha1)
 {
-   const xstring& buf=Torrent::RetrieveBlock(p,0,PieceLength(p));
    bool valid=false;
-   if(buf.length()==PieceLength(p)) {
-      xstring& sha1=xstring::get_tmp();
-      SHA1(buf,sha1);
+   if(sha1) {
       if(building) {
-	 building->SetPiece(p,sha1);
+	 building->SetPiece(p,*sha1);
 	 valid=true;
       } else {
-	 valid=!memcmp(pieces->get()+p*SHA1_DIGEST_SIZE,sha1,SHA1_DIGEST_SIZE);
+	 valid=!memcmp(pieces->get()+p*SHA1_DIGEST_SIZE,sha1->get(),SHA1_DIGEST_SIZE);
       }
    }
    if(!valid) {
@@ -464,12 +483,21 @@ void Torrent::ValidatePiece(unsigned p)
 	 SetError("File validation error");
 	 return;
       }
-      if(buf.length()==PieceLength(p))
+      if(sha1)
 	 LogError(11,"piece %u digest mismatch",p);
       if(my_bitfield->get_bit(p)) {
 	 total_left+=PieceLength(p);
 	 complete_pieces--;
 	 my_bitfield->set_bit(p,0);
+	 pieces_needed.Add(p,piece_info[p].get_sources_count());
+	 for(int i=0; i<read_cache.count(); i++) {
+	    if(read_cache[i]==p) {
+	       read_cache.remove(i);
+	       piece_info[p].set_data(0);
+	       read_cache_size-=PieceLength(p);
+	       break;
+	    }
+	 }
       }
       SetBlocksAbsent(p);
    } else {
@@ -479,6 +507,8 @@ void Torrent::ValidatePiece(unsigned p)
 	 complete_pieces++;
 	 my_bitfield->set_bit(p,1);
 	 piece_info[p].free_block_map();
+	 piece_info[p].cleanup();
+	 pieces_needed.Remove(p,piece_info[p].get_sources_count());
       }
    }
 }
@@ -493,15 +523,6 @@ static inline int cmp(T a,T b)
    return 0;
 }
 
-static Torrent *cmp_torrent;
-int Torrent::PiecesNeededCmp(const unsigned *a,const unsigned *b)
-{
-   int ra=cmp_torrent->piece_info[*a].get_sources_count();
-   int rb=cmp_torrent->piece_info[*b].get_sources_count();
-   int c=cmp(ra,rb);
-   if(c) return c;
-   return cmp(*a,*b);
-}
 int Torrent::PeersCompareActivity(const SMTaskRef<TorrentPeer> *p1,const SMTaskRef<TorrentPeer> *p2)
 {
    TimeDiff i1((*p1)->activity_timer.TimePassed());
@@ -773,14 +794,72 @@ void Torrent::SetTotalLength(off_t tl)
    blocks_in_last_piece=(last_piece_length+BLOCK_SIZE-1)/BLOCK_SIZE;
 
    piece_info=new TorrentPiece[total_pieces]();
+   pieces_needed.Init(total_pieces);
 }
 
 void Torrent::StartValidating()
 {
+   CancelValidation();
    validate_index=0;
+   validate_next=0;
+   validate_start=now;
    validating=true;
    recv_rate.Reset();
 }
+void Torrent::CancelValidation()
+{
+   for(int i=0; i<validate_jobs.count(); i++)
+      WorkerPool::Cancel(validate_jobs[i]);
+   validate_jobs.truncate();
+}
+
+// Pieces are read and hashed by the worker threads, several at once;
+// the results are applied in piece order as TorrentBuild requires.
+// Returns true when all pieces are validated.
+bool Torrent::ContinueValidation()
+{
+   while(validate_jobs.count()>0 && !validate_jobs[0]->Pending()) {
+      TorrentPieceHash *job=validate_jobs[0];
+      validate_jobs.remove(0);
+      if(job->read_errno)
+	 SetError(xstring::format("pread(%s): %s",job->read_errno_file,strerror(job->read_errno)));
+      PieceValidated(job->piece,job->Complete()?&job->sha1:0);
+      recv_rate.Add(PieceLength(job->piece));
+      validate_index++;
+      delete job;
+   }
+   if(validate_index>=total_pieces)
+      return true;
+
+   // keep all workers busy, but limit the memory used by piece data
+   int window=2*WorkerPool::GetThreads();
+   int mem_window=0x10000000/piece_length;
+   if(window>mem_window)
+      window=mem_window;
+   if(window<2)
+      window=2;
+   while(validate_next<total_pieces && validate_jobs.count()<window) {
+      unsigned p=validate_next++;
+      unsigned len=PieceLength(p);
+      TorrentPieceHash *job=new TorrentPieceHash(this,p,len);
+      unsigned begin=0;
+      while(begin<len) {
+	 off_t f_pos=0;
+	 off_t f_rest=0;
+	 const char *file=FindFileByPosition(p,begin,&f_pos,&f_rest);
+	 if(!file || f_rest<=0)
+	    break;
+	 off_t f_len=len-begin;
+	 if(f_len>f_rest)
+	    f_len=f_rest;
+	 job->AddFileRange(dir_file(output_dir,file),f_pos,f_len);
+	 begin+=f_len;
+      }
+      validate_jobs.append(job);
+      WorkerPool::Submit(job,this);
+   }
+   return false;
+}
 
 bool Torrent::SetMetadata(const xstring& md)
 {
@@ -1019,16 +1098,16 @@ void Torrent::CalcPiecesStats()
    min_piece_sources=INT_MAX;
    avg_piece_sources=0;
    pieces_available_pct=0;
-   for(unsigned i=0; i<total_pieces; i++) {
-      if(my_bitfield->get_bit(i))
+   for(int sc=0; sc<pieces_needed.Buckets(); sc++) {
+      unsigned n=pieces_needed.BucketSize(sc);
+      if(n==0)
 	 continue;
-      unsigned sc=piece_info[i].get_sources_count();
-      if(min_piece_sources>sc)
+      if(min_piece_sources>(unsigned)sc)
 	 min_piece_sources=sc;
       if(sc==0)
 	 continue;
-      pieces_available_pct++;
-      avg_piece_sources+=sc;
+      pieces_available_pct+=n;
+      avg_piece_sources+=n*sc;
    }
    avg_piece_sources=avg_piece_sources*256/(total_pieces-complete_pieces);
    pieces_available_pct=pieces_available_pct*100/(total_pieces-complete_pieces);
@@ -1048,30 +1127,96 @@ void Torrent::CalcPerPieceRatio()
    }
 }
 
-void Torrent::RebuildPiecesNeeded()
+void Torrent::ScanPiecesNeeded()
 {
-   pieces_needed.truncate();
    bool enter_end_game=true;
-   for(unsigned i=0; i<total_pieces; i++) {
-      if(!my_bitfield->get_bit(i)) {
-	 if(!piece_info[i].has_a_downloader())
-	    enter_end_game=false;
-	 if(piece_info[i].has_no_sources())
-	    continue;
-	 pieces_needed.append(i);
-      }
-      piece_info[i].cleanup();
+   for(int i=0; i<pieces_needed.count(); i++) {
+      TorrentPiece& piece=piece_info[pieces_needed[i]];
+      if(!piece.has_a_downloader())
+	 enter_end_game=false;
+      piece.cleanup();
    }
    if(!end_game && enter_end_game) {
       LogNote(1,"entering End Game mode");
       end_game=true;
    }
-   cmp_torrent=this;
-   pieces_needed.qsort(PiecesNeededCmp);
    CalcPiecesStats();
    pieces_timer.Reset();
 }
 
+// TorrentPiecesNeeded
+void TorrentPiecesNeeded::Init(unsigned total)
+{
+   order.truncate();
+   pos.truncate();
+   start.truncate();
+   order.get_space(total);
+   pos.get_space(total);
+   for(unsigned i=0; i<total; i++) {
+      order.append(i);
+      pos.append(i);
+   }
+   start.append(0);
+   AddBucket();
+}
+void TorrentPiecesNeeded::Swap(unsigned i,unsigned j)
+{
+   if(i==j)
+      return;
+   unsigned a=order[i];
+   unsigned b=order[j];
+   order[i]=b;
+   order[j]=a;
+   pos[b]=i;
+   pos[a]=j;
+}
+void TorrentPiecesNeeded::Add(unsigned p,unsigned sources)
+{
+   while((unsigned)Buckets()<=sources)
+      AddBucket();
+   unsigned i=order.count();
+   order.append(p);
+   pos[p]=i;
+   int b=Buckets();
+   start[b]++;
+   // move down to the bucket through the first places of higher buckets
+   while(--b>(int)sources) {
+      Swap(i,start[b]);
+      i=start[b]++;
+   }
+}
+void TorrentPiecesNeeded::Remove(unsigned p,unsigned sources)
+{
+   unsigned i=pos[p];
+   if(i==NONE)
+      return;
+   // move up to the end through the last places of higher buckets
+   for(int b=sources+1; b<=Buckets(); b++) {
+      Swap(i,start[b]-1);
+      i=--start[b];
+   }
+   order.chop();
+   pos[p]=NONE;
+}
+void TorrentPiecesNeeded::AddSource(unsigned p,unsigned sources)
+{
+   unsigned i=pos[p];
+   if(i==NONE)
+      return;
+   if((unsigned)Buckets()<=sources+1)
+      AddBucket();
+   unsigned j=--start[sources+1];
+   Swap(i,j);
+}
+void TorrentPiecesNeeded::RemoveSource(unsigned p,unsigned sources)
+{
+   unsigned i=pos[p];
+   if(i==NONE)
+      return;
+   unsigned j=start[sources]++;
+   Swap(i,j);
+}
+
 TorrentBuild::TorrentBuild(const char *path) :
    top_path(path),
    name(basename_ptr(path)),
@@ -1390,14 +1535,16 @@ int Torrent::Do()
    if(peers_scan_timer.Stopped())
       ScanPeers();
    if(validating) {
-      ValidatePiece(validate_index++);
-      if(validate_index<total_pieces) {
-	 recv_rate.Add(piece_length);
-	 return MOVED;
-      }
-      recv_rate.Add(last_piece_length);
+      unsigned old_index=validate_index;
+      if(!ContinueValidation())
+	 return validate_index!=old_index ? MOVED : m;
       validating=false;
       recv_rate.Reset();
+      double elapsed=TimeDiff(now,validate_start);
+      if(elapsed<1e-3)
+	 elapsed=1e-3;
+      LogNote(3,"validated %u pieces in %.1fs (%s)",total_pieces,elapsed,
+	 Speedometer::GetStrS(total_length/elapsed));
       if(total_left==0) {
 	 complete=true;
 	 seed_timer.Reset();
@@ -1407,6 +1554,8 @@ int Torrent::Do()
 	    return MOVED;
 	 }
       }
+      if(!complete && !building)
+	 PreallocateFiles();
       if(building) {
 	 if(!complete) {
 	    SetError("File validation error");
@@ -1447,9 +1596,12 @@ int Torrent::Do()
    if(optimistic_unchoke_timer.Stopped())
       OptimisticUnchoke();
 
-   // rebuild lists of needed pieces
-   if(!complete && (pieces_needed.count()==0 || pieces_timer.Stopped()))
-      RebuildPiecesNeeded();
+   if(write_back.count()>0 && write_back_timer.Stopped())
+      FlushWriteBack();
+
+   // check for end game and update statistics
+   if(!complete && pieces_timer.Stopped())
+      ScanPiecesNeeded();
 
    if(complete) {
       if(pieces_timer.Stopped()) {
@@ -1489,6 +1641,7 @@ void Torrent::Accept(int s,const sockaddr_u *addr,IOBuffer *rb)
       LogNote(4,"declining new connection");
       Delete(rb);
       close(s);
+      SMTask::FDClosed(s);
       return;
    }
    TorrentPeer *p=new TorrentPeer(this,addr,TorrentPeer::TR_ACCEPTED);
@@ -1745,16 +1898,6 @@ int FDCache::OpenFile(const char *file,int m,off_t size)
       fcntl(fd,F_SETFD,FD_CLOEXEC);
    if(fd==-1 || size==0)
       return fd;
-   if(ci==O_RDWR && QueryBool("file:use-fallocate",0)) {
-      struct stat st;
-      // check if it is newly created file, then allocate space
-      if(fstat(fd,&st)!=-1 && st.st_size==0) {
-	 if(lftp_fallocate(fd,size)==-1 && errno!=ENOSYS && errno!=EOPNOTSUPP) {
-	    ProtoLog::LogError(9,"space allocation for %s (%lld bytes) failed: %s",
-	       file,(long long)size,strerror(errno));
-	 }
-      }
-   }
 #ifdef HAVE_POSIX_FADVISE
    if(ci==O_RDONLY) {
       // validation mode (when validating, size>0)
@@ -1797,6 +1940,32 @@ try_again:
    }
    return fd;
 }
+// Pieces come in random order; allocating all files before the download
+// lets the file system place them contiguously.
+void Torrent::PreallocateFiles()
+{
+   if(!QueryBool("file:use-fallocate",0))
+      return;
+   for(int i=0; i<files->count(); i++) {
+      const TorrentFile *f=files->file(i);
+      if(f->length==0)
+	 continue;
+      int fd=OpenFile(f->path,O_RDWR|O_CREAT,f->length);
+      if(fd==-1) {
+	 LogError(9,"open(%s): %s",f->path,strerror(errno));
+	 return;
+      }
+      if(FileLayout::Preallocate(fd,f->length,f->path)==-1) {
+	 int saved_errno=errno;	 // LogError can change errno
+	 if(saved_errno==ENOSYS || saved_errno==EOPNOTSUPP)
+	    continue;
+	 LogError(9,"space allocation for %s (%lld bytes) failed: %s",
+	    f->path,(long long)f->length,strerror(saved_errno));
+	 if(saved_errno==ENOSPC)
+	    return;
+      }
+   }
+}
 void Torrent::CloseFile(const char *file) const
 {
    if(!fd_cache)
@@ -1804,15 +1973,6 @@ void Torrent::CloseFile(const char *file) const
    fd_cache->Close(dir_file(output_dir,file));
 }
 
-void Torrent::SetPieceNotWanted(unsigned piece)
-{
-   for(int j=0; j<pieces_needed.count(); j++) {
-      if(pieces_needed[j]==piece) {
-	 pieces_needed.remove(j);
-	 break;
-      }
-   }
-}
 
 #define MIN(a,b) ((a)<(b)?(a):(b))
 
@@ -1821,9 +1981,52 @@ void Torrent::StoreBlock(unsigned piece,unsigned begin,unsigned len,const char *
    for(int i=0; i<peers.count(); i++)
       peers[i]->CancelBlock(piece,begin);
 
+   // late duplicates in end game
+   if(my_bitfield->get_bit(piece) || PieceHashing(piece))
+      return;
+
    unsigned b=begin/BLOCK_SIZE;
    int bc=(len+BLOCK_SIZE-1)/BLOCK_SIZE;
 
+   TorrentPiece& pi=piece_info[piece];
+   if(!pi.get_data() && AllBlocksAbsent(piece))
+      CacheNewPiece(piece);
+   if(pi.get_data())
+      memcpy(pi.get_data()->get_non_const()+begin,buf,len);
+   else if(!WriteBlock(piece,begin,len,buf))
+      return;
+   blocks_stored+=bc;
+
+   while(bc-->0) {
+      SetBlockPresent(piece,b++);
+   }
+   if(!AllBlocksPresent(piece))
+      return;
+
+   // hashing is CPU-bound, let a worker thread do it
+   TorrentPieceHash *job;
+   if(pi.get_data()) {
+      for(int i=0; i<write_cache_pieces.count(); i++) {
+	 if(write_cache_pieces[i]==piece) {
+	    write_cache_pieces.remove(i);
+	    break;
+	 }
+      }
+      job=new TorrentPieceHash(this,piece,src_peer->peer_id,pi.get_data());
+      pi.set_data(0);
+   } else {
+      const xstring& buf=RetrieveBlock(piece,0,PieceLength(piece));
+      if(buf.length()!=PieceLength(piece)) {
+	 NewPieceChecked(piece,0,src_peer->peer_id);
+	 return;
+      }
+      job=new TorrentPieceHash(this,piece,src_peer->peer_id,buf);
+   }
+   hash_jobs.append(job);
+   WorkerPool::Submit(job,this);
+}
+bool Torrent::WriteBlock(unsigned piece,unsigned begin,unsigned len,const char *buf)
+{
    off_t f_pos=0;
    off_t f_rest=len;
    while(len>0) {
@@ -1831,47 +2034,303 @@ void Torrent::StoreBlock(unsigned piece,unsigned begin,unsigned len,const char *
       int fd=OpenFile(file,O_RDWR|O_CREAT,f_pos+f_rest);
       if(fd==-1) {
 	 SetError(xstring::format("open(%s): %s",file,strerror(errno)));
-	 return;
+	 return false;
       }
       int w=pwrite(fd,buf,MIN(f_rest,len),f_pos);
       int saved_errno=errno;
       if(w==-1) {
 	 SetError(xstring::format("pwrite(%s): %s",file,strerror(saved_errno)));
-	 return;
+	 return false;
       }
       if(w==0) {
 	 SetError(xstring::format("pwrite(%s): write error - disk full?",file));
-	 return;
+	 return false;
       }
+      write_calls++;
       buf+=w;
       begin+=w;
       len-=w;
    }
+   return true;
+}
 
-   while(bc-->0) {
-      SetBlockPresent(piece,b++);
+bool Torrent::CacheNewPiece(unsigned piece)
+{
+   unsigned len=PieceLength(piece);
+   if(write_cache_size+len>write_cache_max)
+      FlushWriteBack();
+   while(write_cache_size+len>write_cache_max && write_cache_pieces.count()>0)
+      EvictPiece();
+   if(write_cache_size+len>write_cache_max)
+      return false;
+   xstring *data=new xstring;
+   data->get_space(len);
+   data->set_length(len);
+   piece_info[piece].set_data(data);
+   write_cache_pieces.append(piece);
+   write_cache_size+=len;
+   return true;
+}
+// The oldest piece being assembled is likely stalled. Its blocks are
+// written out and the rest of the piece goes directly to the files.
+void Torrent::EvictPiece()
+{
+   unsigned piece=write_cache_pieces[0];
+   write_cache_pieces.remove(0);
+   TorrentPiece& pi=piece_info[piece];
+   const char *data=pi.get_data()->get();
+   unsigned blocks=BlocksInPiece(piece);
+   LogNote(10,"evicting piece %u from the write cache",piece);
+   for(unsigned b=0; b<blocks; b++) {
+      if(!BlockPresent(piece,b))
+	 continue;
+      unsigned e=b+1;
+      while(e<blocks && BlockPresent(piece,e))
+	 e++;
+      unsigned begin=b*BLOCK_SIZE;
+      unsigned end=MIN(e*BLOCK_SIZE,PieceLength(piece));
+      if(!WriteBlock(piece,begin,end-begin,data+begin))
+	 break;
+      b=e;
    }
-   if(AllBlocksPresent(piece) && !my_bitfield->get_bit(piece)) {
-      ValidatePiece(piece);
-      if(!my_bitfield->get_bit(piece)) {
-	 LogError(0,"new piece %u digest mismatch",piece);
-	 src_peer->MarkPieceInvalid(piece);
+   pi.set_data(0);
+   write_cache_size-=PieceLength(piece);
+}
+
+#ifndef IOV_MAX
+# define IOV_MAX 16
+#endif
+
+// returns -1 on error and 0 if nothing could be written
+static int write_iov(int fd,struct iovec *iov,int cnt,off_t pos,unsigned long long *calls)
+{
+   while(cnt>0) {
+#ifdef HAVE_PWRITEV
+      ssize_t w=pwritev(fd,iov,MIN(cnt,IOV_MAX),pos);
+#else
+      ssize_t w=pwrite(fd,iov->iov_base,iov->iov_len,pos);
+#endif
+      if(w==-1 && errno==EINTR)
+	 continue;
+      if(w<=0)
+	 return w;
+      ++*calls;
+      pos+=w;
+      while(cnt>0 && (size_t)w>=iov->iov_len) {
+	 w-=iov->iov_len;
+	 iov++;
+	 cnt--;
+      }
+      if(w>0) {
+	 iov->iov_base=(char*)iov->iov_base+w;
+	 iov->iov_len-=w;
+      }
+   }
+   return 1;
+}
+// writes n consecutive pieces from the write cache
+bool Torrent::WritePieces(const unsigned *p,int n)
+{
+   off_t left=(off_t)(p[n-1]-p[0])*piece_length+PieceLength(p[n-1]);
+   int k=0;
+   unsigned begin=0;
+   xarray<struct iovec> iov;
+   while(left>0) {
+      off_t f_pos=0;
+      off_t f_rest=0;
+      const char *file=FindFileByPosition(p[k],begin,&f_pos,&f_rest);
+      int fd=OpenFile(file,O_RDWR|O_CREAT,f_pos+f_rest);
+      if(fd==-1) {
+	 SetError(xstring::format("open(%s): %s",file,strerror(errno)));
+	 return false;
+      }
+      if(f_rest>left)
+	 f_rest=left;
+      iov.truncate();
+      for(off_t seg=f_rest; seg>0; ) {
+	 unsigned len=PieceLength(p[k])-begin;
+	 if(len>seg)
+	    len=seg;
+	 struct iovec v={piece_info[p[k]].get_data()->get_non_const()+begin,len};
+	 iov.append(v);
+	 seg-=len;
+	 begin+=len;
+	 if(begin==PieceLength(p[k])) {
+	    k++;
+	    begin=0;
+	 }
+      }
+      int w=write_iov(fd,iov.get_non_const(),iov.count(),f_pos,&write_calls);
+      if(w==-1) {
+	 SetError(xstring::format("pwrite(%s): %s",file,strerror(errno)));
+	 return false;
+      }
+      if(w==0) {
+	 SetError(xstring::format("pwrite(%s): write error - disk full?",file));
+	 return false;
+      }
+      left-=f_rest;
+   }
+   return true;
+}
+static int unsigned_cmp(const unsigned *a,const unsigned *b)
+{
+   return *a<*b ? -1 : *a>*b;
+}
+void Torrent::FlushWriteBack()
+{
+   if(write_back.count()==0)
+      return;
+   // an error can get us here again
+   xarray<unsigned> pieces;
+   pieces.move_here(write_back);
+   pieces.qsort(unsigned_cmp);
+   for(int i=0; i<pieces.count(); ) {
+      int j=i+1;
+      while(j<pieces.count() && pieces[j]==pieces[j-1]+1)
+	 j++;
+      if(!WritePieces(pieces.get()+i,j-i))
+	 break;
+      i=j;
+   }
+   // new pieces are likely to be requested by other peers
+   for(int i=0; i<pieces.count(); i++) {
+      TorrentPiece& pi=piece_info[pieces[i]];
+      write_cache_size-=PieceLength(pieces[i]);
+      xstring *data=pi.borrow_data();
+      if(!ReadCacheAdd(pieces[i],data))
+	 delete data;
+   }
+}
+const char *Torrent::WriteCacheStatus() const
+{
+   xstring& buf=xstring::format("%llu blocks in %llu writes",blocks_stored,write_calls);
+   if(write_cache_max>0)
+      buf.appendf(", cache %s/%s",xhuman(write_cache_size),xhuman(write_cache_max));
+   return buf;
+}
+bool Torrent::PieceHashing(unsigned piece) const
+{
+   for(int i=0; i<hash_jobs.count(); i++) {
+      if(hash_jobs[i]->piece==piece)
+	 return true;
+   }
+   return false;
+}
+void TorrentPieceHash::AddFileRange(const char *path,off_t pos,off_t len)
+{
+   paths.Append(path);
+   FileRange r={pos,len};
+   ranges.append(r);
+}
+// called in a worker thread, so the torrent's fd cache cannot be used
+void TorrentPieceHash::ReadFiles()
+{
+   data.get_space(length);
+   for(int i=0; i<ranges.count(); i++) {
+      const char *path=paths[i];
+      int fd=open(path,O_RDONLY);
+      if(fd==-1)
+	 return;  // missing files make the piece invalid
+      fcntl(fd,F_SETFD,FD_CLOEXEC);
+      off_t pos=ranges[i].pos;
+      off_t len=ranges[i].len;
+#ifdef HAVE_POSIX_FADVISE
+      posix_fadvise(fd,pos,len,POSIX_FADV_SEQUENTIAL);
+      posix_fadvise(fd,pos,len,POSIX_FADV_WILLNEED);
+#endif
+      while(len>0) {
+	 int r=pread(fd,data.add_space(len),len,pos);
+	 if(r==-1) {
+	    if(errno==EINTR)
+	       continue;
+	    read_errno=errno;
+	    read_errno_file=path;
+	    close(fd);
+	    return;
+	 }
+	 if(r==0)
+	    break;
+	 data.add_commit(r);
+	 pos+=r;
+	 len-=r;
+      }
+#ifdef HAVE_POSIX_FADVISE
+      posix_fadvise(fd,ranges[i].pos,ranges[i].len,POSIX_FADV_DONTNEED);
+#endif
+      close(fd);
+      if(len>0)
 	 return;
+   }
+}
+void TorrentPieceHash::Run()
+{
+   if(validation) {
+      ReadFiles();
+      if(!Complete())
+	 return;
+   }
+   Torrent::SHA1(data,sha1);
+}
+void TorrentPieceHash::Finish()
+{
+   // validation results are collected by the torrent in order
+   if(validation)
+      return;
+   parent->PieceHashed(this);
+}
+void Torrent::PieceHashed(TorrentPieceHash *job)
+{
+   for(int i=0; i<hash_jobs.count(); i++) {
+      if(hash_jobs[i]==job) {
+	 hash_jobs.remove(i);
+	 break;
       }
-      LogNote(3,"piece %u complete",piece);
-      timeout_timer.Reset();
-      SetPieceNotWanted(piece);
-      for(int i=0; i<peers.count(); i++)
-	 peers[i]->Have(piece);
-      if(my_bitfield->has_all_set() && !complete) {
-	 complete=true;
-	 seed_timer.Reset();
-	 end_game=false;
-	 ScanPeers();
-	 SendTrackersRequest("completed");
-	 recv_rate.Reset();
+   }
+   NewPieceChecked(job->piece,&job->sha1,job->src_peer_id);
+   if(job->cached) {
+      unsigned p=job->piece;
+      if(my_bitfield->get_bit(p)) {
+	 xstring *data=new xstring;
+	 data->move_here(job->data);
+	 piece_info[p].set_data(data);
+	 if(write_back.count()==0)
+	    write_back_timer.Reset();
+	 write_back.append(p);
+	 if(complete || shutting_down)
+	    FlushWriteBack();
+      } else {
+	 write_cache_size-=PieceLength(p);
       }
    }
+   delete job;
+}
+void Torrent::NewPieceChecked(unsigned piece,const xstring *sha1,const xstring& src_peer_id)
+{
+   if(my_bitfield->get_bit(piece))
+      return;
+   PieceValidated(piece,sha1);
+   if(!my_bitfield->get_bit(piece)) {
+      LogError(0,"new piece %u digest mismatch",piece);
+      // the peer could have gone while the piece was hashed, and
+      // another one could have taken its memory; find it by the id.
+      TorrentPeer *src_peer=(src_peer_id ? FindPeerById(src_peer_id) : 0);
+      if(src_peer)
+	 src_peer->MarkPieceInvalid(piece);
+      return;
+   }
+   LogNote(3,"piece %u complete",piece);
+   timeout_timer.Reset();
+   for(int i=0; i<peers.count(); i++)
+      peers[i]->Have(piece);
+   if(my_bitfield->has_all_set() && !complete) {
+      complete=true;
+      seed_timer.Reset();
+      end_game=false;
+      ScanPeers();
+      SendTrackersRequest("completed");
+      recv_rate.Reset();
+   }
 }
 void Torrent::SendTrackersRequest(const char *event) const
 {
@@ -1885,7 +2344,21 @@ const xstring& Torrent::RetrieveBlock(unsigned piece,unsigned begin,unsigned len
 {
    static xstring buf;
    buf.truncate(0);
-   buf.get_space(len);
+
+   if(!validating && my_bitfield->get_bit(piece)) {
+      const xstring *data=CachedPiece(piece);
+      if(data) {
+	 buf.nset(data->get()+begin,len);
+	 return buf;
+      }
+   }
+   if(!ReadBlock(piece,begin,len,buf))
+      return xstring::null;
+   return buf;
+}
+bool Torrent::ReadBlock(unsigned piece,unsigned begin,unsigned len,xstring& buf)
+{
+   buf.get_space(buf.length()+len);
 
    off_t f_pos=0;
    off_t f_rest=len;
@@ -1893,11 +2366,11 @@ const xstring& Torrent::RetrieveBlock(unsigned piece,unsigned begin,unsigned len
       const char *file=FindFileByPosition(piece,begin,&f_pos,&f_rest);
       int fd=OpenFile(file,O_RDONLY,validating?f_pos+f_rest:0);
       if(fd==-1)
-	 return xstring::null;
+	 return false;
       int w=pread(fd,buf.add_space(len),MIN(f_rest,len),f_pos);
       if(w==-1) {
 	 SetError(xstring::format("pread(%s): %s",file,strerror(errno)));
-	 return xstring::null;
+	 return false;
       }
       if(w==0) {
 // 	 buf.append_padding(len,'\0');
@@ -1909,6 +2382,67 @@ const xstring& Torrent::RetrieveBlock(unsigned piece,unsigned begin,unsigned len
       if(validating && w==f_rest)
 	 CloseFile(file);
    }
+   return true;
+}
+
+// Returns a complete piece from memory. A piece not in memory is read as a
+// whole, peers usually request all blocks of a piece in a row. When the
+// cache is too small for that, 0 is returned and the block is read alone.
+const xstring *Torrent::CachedPiece(unsigned piece)
+{
+   TorrentPiece& pi=piece_info[piece];
+   if(pi.get_data()) {
+      read_cache_hits++;
+      int n=read_cache.count();
+      if(n>0 && read_cache[n-1]!=piece) {
+	 for(int i=0; i<n; i++) {
+	    if(read_cache[i]==piece) {
+	       read_cache.remove(i);
+	       read_cache.append(piece);
+	       break;
+	    }
+	 }
+      }
+      return pi.get_data();
+   }
+   read_cache_misses++;
+   unsigned len=PieceLength(piece);
+   int ahead=am_not_choking_peers_count;
+   if(ahead<READ_AHEAD_MIN_PIECES)
+      ahead=READ_AHEAD_MIN_PIECES;
+   if((unsigned long long)len*ahead>read_cache_max)
+      return 0;
+   xstring *data=new xstring;
+   if(!ReadBlock(piece,0,len,*data) || data->length()!=len || !ReadCacheAdd(piece,data)) {
+      delete data;
+      return 0;
+   }
+   return data;
+}
+bool Torrent::ReadCacheAdd(unsigned piece,xstring *data)
+{
+   unsigned len=PieceLength(piece);
+   if(len>read_cache_max)
+      return false;
+   while(read_cache_size+len>read_cache_max && read_cache.count()>0) {
+      unsigned p=read_cache[0];
+      read_cache.remove(0);
+      piece_info[p].set_data(0);
+      read_cache_size-=PieceLength(p);
+   }
+   piece_info[piece].set_data(data);
+   read_cache.append(piece);
+   read_cache_size+=len;
+   return true;
+}
+const char *Torrent::ReadCacheStatus() const
+{
+   unsigned long long total=read_cache_hits+read_cache_misses;
+   xstring& buf=xstring::format("%llu hits, %llu misses",read_cache_hits,read_cache_misses);
+   if(total>0)
+      buf.appendf(" (%u%% hit rate)",unsigned(read_cache_hits*100/total));
+   if(read_cache_max>0)
+      buf.appendf(", cache %s/%s",xhuman(read_cache_size),xhuman(read_cache_max));
    return buf;
 }
 
@@ -2092,6 +2626,8 @@ void Torrent::Reconfig(const char *name)
    seed_min_peers=ResMgr::Query("torrent:seed-min-peers",c);
    stop_on_ratio=ResMgr::Query("torrent:stop-on-ratio",c);
    stop_min_ppr=ResMgr::Query("torrent:stop-min-ppr",c);
+   write_cache_max=(unsigned long)ResMgr::Query("torrent:write-cache-size",c);
+   read_cache_max=(unsigned long)ResMgr::Query("torrent:read-cache-size",c);
    rate_limit.Reconfig(name,metainfo_url);
    if(listener)
       StartDHT();
@@ -2159,6 +2695,7 @@ const xstring& Torrent::Status()
 TorrentPeer::TorrentPeer(Torrent *p,const sockaddr_u *a,int t_no)
    : timeout_timer(360), retry_timer(30), keepalive_timer(120),
      choke_timer(10), interest_timer(10), activity_timer(300),
+     queue_len_timer(1),
      msg_ext_metadata(0), msg_ext_pex(0), metadata_size(0)
 {
    parent=p;
@@ -2186,6 +2723,7 @@ TorrentPeer::TorrentPeer(Torrent *p,const sockaddr_u *a,int t_no)
    peer_bytes_pool[0]=peer_bytes_pool[1]=0;
    peer_recv=peer_sent=0;
    invalid_piece_count=0;
+   ResetQueueLen();
 }
 TorrentPeer::~TorrentPeer()
 {
@@ -2238,6 +2776,7 @@ void TorrentPeer::Disconnect(const char *dc)
    send_buf=0;
    if(sock!=-1) {
       close(sock);
+      SMTask::FDClosed(sock);
       sock=-1;
       connected=false;
       last_dc.set(dc);
@@ -2336,7 +2875,7 @@ void TorrentPeer::SendExtensions()
    ext.add("m",new BeNode(&m));
    ext.add("p",new BeNode(parent->GetPort()));
    ext.add("v",new BeNode(PACKAGE "/" VERSION));
-   ext.add("reqq",new BeNode(MAX_QUEUE_LEN*16));
+   ext.add("reqq",new BeNode(MAX_QUEUE_LEN));
    if(parent->Complete())
       ext.add("upload_only",new BeNode(1));
    if(parent->metadata)
@@ -2441,7 +2980,7 @@ int TorrentPeer::SendDataRequests(unsigned p)
       bytes_allowed-=len;
       BytesGot(len);
 
-      if(sent_queue.count()>=MAX_QUEUE_LEN)
+      if(sent_queue.count()>=queue_len)
 	 break;
    }
    return sent;
@@ -2461,7 +3000,7 @@ void TorrentPeer::SendDataRequests()
 
    if(peer_choking && !FastExtensionEnabled())
       return;
-   if(sent_queue.count()>=MAX_QUEUE_LEN)
+   if(sent_queue.count()>=queue_len)
       return;
    if(!BytesAllowedToGet(Torrent::BLOCK_SIZE))
       return;
@@ -2494,7 +3033,7 @@ void TorrentPeer::SendDataRequests()
 
    // pick a new piece
    unsigned p=NO_PIECE;
-   for(int i=0; i<parent->pieces_needed.count(); i++) {
+   for(int i=parent->pieces_needed.FirstWithSources(); i<parent->pieces_needed.count(); i++) {
       if(peer_bitfield->get_bit(parent->pieces_needed[i])) {
 	 p=parent->pieces_needed[i];
 	 if(parent->my_bitfield->get_bit(p))
@@ -2554,6 +3093,40 @@ void TorrentPeer::MarkPieceInvalid(unsigned p)
       parent->BlackListPeer(this,"1d");
 }
 
+void TorrentPeer::ResetQueueLen()
+{
+   queue_len=INITIAL_QUEUE_LEN;
+   peer_reqq=MAX_QUEUE_LEN;
+   min_rtt=0;
+   queue_len_timer.Reset();
+}
+
+void TorrentPeer::UpdateQueueLen(const PacketRequest *req)
+{
+   double rtt=TimeDiff(SMTask::now,req->sent);
+   if(rtt<0.001)
+      rtt=0.001;
+   if(min_rtt==0 || rtt<min_rtt)
+      min_rtt=rtt;
+   if(!queue_len_timer.Stopped())
+      return;
+   queue_len_timer.Reset();
+
+   // Twice the bandwidth-delay product: while the queue is what limits
+   // the rate, the queue doubles with the rate; when the peer or the path
+   // is the limit, the rate stops growing and so does the queue.
+   int len=int(peer_recv_rate.Get()*2*min_rtt/Torrent::BLOCK_SIZE)+MIN_QUEUE_LEN;
+   if(len<MIN_QUEUE_LEN)
+      len=MIN_QUEUE_LEN;
+   if(len>MAX_QUEUE_LEN)
+      len=MAX_QUEUE_LEN;
+   if(len>peer_reqq)
+      len=peer_reqq;
+   if(len!=queue_len)
+      LogNote(10,"request queue length %d (rtt %dms)",len,int(min_rtt*1000+0.5));
+   queue_len=len;
+}
+
 void TorrentPeer::ClearSentQueue(int i)
 {
    if(i<0)
@@ -2683,12 +3256,14 @@ void TorrentPeer::SetPieceHaving(unsigned p,bool have)
    int diff = (have - peer_bitfield->get_bit(p));
    if(!diff)
       return;
-   parent->piece_info[p].add_sources_count(diff);
+   TorrentPiece& piece=parent->piece_info[p];
+   if(have)
+      parent->pieces_needed.AddSource(p,piece.get_sources_count());
+   else
+      parent->pieces_needed.RemoveSource(p,piece.get_sources_count());
+   piece.add_sources_count(diff);
    peer_complete_pieces+=diff;
    peer_bitfield->set_bit(p,have);
-
-   if(parent->piece_info[p].get_sources_count()==0)
-      parent->SetPieceNotWanted(p);
    if(have && send_buf && !am_interested && !parent->my_bitfield->get_bit(p)
    && parent->NeedMoreUploaders()) {
       SetAmInterested(true);
@@ -2867,6 +3442,7 @@ void TorrentPeer::HandlePacket(Packet *p)
 // 	    SetError("got a piece that was not requested");
 	    break;
 	 }
+	 UpdateQueueLen(sent_queue[i]);
 	 ClearSentQueue(i);
 	 parent->PeerBytesGot(pp->data.length()); // re-take the bytes returned by ClearSentQueue
 	 Enter(parent);
@@ -2906,7 +3482,7 @@ void TorrentPeer::HandlePacket(Packet *p)
 	    SetError("invalid data length");
 	    break;
 	 }
-	 if(recv_queue.count()>=MAX_QUEUE_LEN*16) {
+	 if(recv_queue.count()>=MAX_QUEUE_LEN) {
 	    SetError("too many requests");
 	    break;
 	 }
@@ -2972,6 +3548,12 @@ void TorrentPeer::HandleExtendedMessage(PacketExtended *pp)
       }
       metadata_size=parent->metadata_size=pp->data->lookup_int("metadata_size");
       upload_only=pp->data->lookup_int("upload_only");
+      int reqq=pp->data->lookup_int("reqq");
+      if(reqq>0) {
+	 peer_reqq=reqq;
+	 if(queue_len>peer_reqq)
+	    queue_len=peer_reqq;
+      }
 
       if(!parent->HasMetadata() && !msg_ext_metadata) {
 	 Disconnect("peer cannot provide metadata");
@@ -3206,7 +3788,7 @@ bool TorrentPeer::HasNeededPieces()
       return false;
    if(GetLastPiece()!=NO_PIECE)
       return true;
-   for(int i=0; i<parent->pieces_needed.count(); i++)
+   for(int i=parent->pieces_needed.FirstWithSources(); i<parent->pieces_needed.count(); i++)
       if(peer_bitfield->get_bit(parent->pieces_needed[i]))
 	 return true;
    return false;
@@ -3302,6 +3884,7 @@ int TorrentPeer::Do()
       myself=peer_id.eq(Torrent::my_peer_id);
       if(myself)
 	 return MOVED;
+      ResetQueueLen();
       SendExtensions();
       if(parent->HasMetadata())
 	 peer_bitfield=new BitField(parent->total_pieces);
@@ -3360,7 +3943,7 @@ int TorrentPeer::Do()
    && HasNeededPieces() && parent->NeedMoreUploaders())
       SetAmInterested(true);
 
-   if(am_interested && sent_queue.count()<MAX_QUEUE_LEN)
+   if(am_interested && sent_queue.count()<queue_len)
       SendDataRequests();
 
    if(peer_interested && am_choking && choke_timer.Stopped()
@@ -3575,6 +4158,11 @@ const char *TorrentPeer::Status()
       buf.append("am-interested ");
    if(am_choking)
       buf.append("am-choking ");
+   if(am_interested) {
+      buf.appendf("requests:%d/%d ",sent_queue.count(),queue_len);
+      if(min_rtt>0)
+	 buf.appendf("rtt:%dms ",int(min_rtt*1000+0.5));
+   }
    if(parent->HasMetadata()) {
       if(peer_complete_pieces<parent->total_pieces)
 	 buf.appendf("complete:%u/%u (%u%%)",peer_complete_pieces,parent->total_pieces,
@@ -3740,8 +4328,10 @@ TorrentListener::TorrentListener(int a,int t)
 }
 TorrentListener::~TorrentListener()
 {
-   if(sock!=-1)
+   if(sock!=-1) {
       close(sock);
+      SMTask::FDClosed(sock);
+   }
 }
 void TorrentListener::FillAddress(int port)
 {
@@ -3948,6 +4538,7 @@ void Torrent::Dispatch(const xstring& info_hash,int sock,const sockaddr_u *remot
    if(!t) {
       LogError(3,_("peer sent unknown info_hash=%s in handshake"),info_hash.hexdump());
       close(sock);
+      SMTask::FDClosed(sock);
       Delete(recv_buf);
       return;
    }
@@ -3963,8 +4554,10 @@ TorrentDispatcher::TorrentDispatcher(int s,const sockaddr_u *a)
 }
 TorrentDispatcher::~TorrentDispatcher()
 {
-   if(sock!=-1)
+   if(sock!=-1) {
       close(sock);
+      SMTask::FDClosed(sock);
+   }
 }
 int TorrentDispatcher::Do()
 {
@@ -4073,6 +4666,10 @@ xstring& TorrentJob::FormatStatus(xstring& s,int v,const char *tab)
    }
 
    if(v>1) {
+      if(torrent->HasMetadata()) {
+	 s.appendf("%sdisk writes: %s\n",tab,torrent->WriteCacheStatus());
+	 s.appendf("%sdisk reads: %s\n",tab,torrent->ReadCacheStatus());
+      }
       if(torrent->Trackers().count()==1) {
 	 s.appendf("%stracker: %s - %s\n",tab,torrent->Trackers()[0]->GetURL(),
 	       torrent->Trackers()[0]->Status());
@@ -29,6 +29,7 @@
 #include "Resolver.h"
 #include "FileCopy.h"
 #include "DHT.h"
+#include "WorkerPool.h"
 
 class FDCache;
 class TorrentBlackList;
@@ -100,6 +101,7 @@ class TorrentPiece
    float ratio;
    RefToArray<const TorrentPeer*> downloader; // which peers download the blocks
    Ref<BitField> block_map;	    // which blocks are present.
+   Ref<xstring> data;		    // the piece in the write cache
 
 public:
    TorrentPiece() : sources_count(0), downloader_count(0), ratio(0) {}
@@ -155,6 +157,41 @@ public:
 
    float get_ratio() const { return ratio; }
    void add_ratio(float add) { ratio+=add; }
+
+   xstring *get_data() const { return data.get_non_const(); }
+   void set_data(xstring *d) { data=d; }
+   xstring *borrow_data() { return data.borrow(); }
+};
+
+// The needed pieces ordered by the number of sources, rarest first. Pieces
+// with the same number of sources form a bucket; a piece changes the bucket
+// by swapping with the piece at the bucket boundary.
+class TorrentPiecesNeeded
+{
+   xarray<unsigned> order;	 // the pieces
+   xarray<unsigned> pos;	 // position of a piece in order, or NONE
+   xarray<unsigned> start;	 // start of bucket for each sources count,
+				 // followed by order.count()
+   void Swap(unsigned i,unsigned j);
+   void AddBucket() { start.append(order.count()); }
+
+public:
+   enum { NONE=~0U };
+   void Init(unsigned total);
+
+   // sources is the current sources count of the piece
+   void Add(unsigned p,unsigned sources);
+   void Remove(unsigned p,unsigned sources);
+   void AddSource(unsigned p,unsigned sources);	 // sources before the change
+   void RemoveSource(unsigned p,unsigned sources);
+
+   bool Has(unsigned p) const { return pos[p]!=NONE; }
+   int count() const { return order.count(); }
+   unsigned operator[](int i) const { return order[i]; }
+   // index of the first piece having a source
+   int FirstWithSources() const { return start.count()>1 ? start[1] : order.count(); }
+   int Buckets() const { return start.count()-1; }
+   int BucketSize(int c) const { return start[c+1]-start[c]; }
 };
 
 struct TorrentFile
@@ -197,6 +234,42 @@ public:
    TorrentFile *FindByPosition(off_t p);
 };
 
+// hashes a piece in a worker thread; the data are either given or read
+// from the files by the worker (for validation).
+class TorrentPieceHash : public WorkerJob
+{
+   Torrent *parent;
+   unsigned length;
+   StringSet paths;
+   struct FileRange { off_t pos,len; };
+   xarray<FileRange> ranges;
+   void ReadFiles();
+   void Run();
+   void Finish();
+public:
+   unsigned piece;
+   xstring src_peer_id;	// the peer can go away while the piece is hashed
+   bool validation;
+   bool cached;   // the data are from the write cache, not on disk yet
+   xstring data;
+   xstring sha1;
+   int read_errno;   // pread error, read_errno_file has the file name
+   const char *read_errno_file;
+   TorrentPieceHash(Torrent *t,unsigned p,const xstring& src_id,const xstring& d)
+      : parent(t), length(d.length()), piece(p), validation(false),
+	cached(false), read_errno(0), read_errno_file(0)
+      { src_peer_id.set(src_id); data.nset(d,d.length()); }
+   TorrentPieceHash(Torrent *t,unsigned p,const xstring& src_id,xstring *d)
+      : parent(t), length(d->length()), piece(p), validation(false),
+	cached(true), read_errno(0), read_errno_file(0)
+      { src_peer_id.set(src_id); data.move_here(*d); }
+   TorrentPieceHash(Torrent *t,unsigned p,unsigned len)
+      : parent(t), length(len), piece(p), validation(true),
+	cached(false), read_errno(0), read_errno_file(0) {}
+   void AddFileRange(const char *path,off_t pos,off_t len);
+   bool Complete() const { return data.length()==length; }
+};
+
 class TorrentListener : public SMTask, protected ProtoLog, protected Networker
 {
    Ref<Error> error;
@@ -228,6 +301,7 @@ class Torrent : public SMTask, protected ProtoLog, public ResClient
    friend class TorrentDispatcher;
    friend class TorrentListener;
    friend class TorrentFiles;
+   friend class TorrentPieceHash;
    friend class DHT;
 
    bool shutting_down;
@@ -240,7 +314,12 @@ class Torrent : public SMTask, protected ProtoLog, public ResClient
    bool stop_if_complete;
    bool stop_if_known;
    bool md_saved;
-   unsigned validate_index;
+   unsigned validate_index;   // number of pieces validated
+   unsigned validate_next;    // next piece to submit for validation
+   xarray<TorrentPieceHash*> validate_jobs;  // in piece order
+   Time validate_start;
+   bool ContinueValidation();
+   void CancelValidation();
    Ref<Error> invalid_cause;
 
    static const unsigned PEER_ID_LEN = 20;
@@ -382,10 +461,9 @@ class Torrent : public SMTask, protected ProtoLog, public ResClient
       piece_info[piece].set_block_present(block,BlocksInPiece(piece));
    }
 
-   void RebuildPiecesNeeded();
+   void ScanPiecesNeeded();
    Timer pieces_timer; // for periodic pieces scanning
-   xarray<unsigned> pieces_needed;
-   static int PiecesNeededCmp(const unsigned *a,const unsigned *b);
+   TorrentPiecesNeeded pieces_needed;
    unsigned last_piece;
 
    unsigned min_piece_sources;
@@ -394,7 +472,6 @@ class Torrent : public SMTask, protected ProtoLog, public ResClient
    float current_min_ppr;
    float current_max_ppr;
 
-   void SetPieceNotWanted(unsigned piece);
    void SetDownloader(unsigned piece,unsigned block,const TorrentPeer *o,const TorrentPeer *n);
 
    xstring_c cwd;
@@ -404,9 +481,42 @@ class Torrent : public SMTask, protected ProtoLog, public ResClient
    const char *MakePath(BeNode *p) const;
    int OpenFile(const char *f,int m,off_t size=0);
    void CloseFile(const char *f) const;
+   void PreallocateFiles();
 
    void StoreBlock(unsigned piece,unsigned begin,unsigned len,const char *buf,TorrentPeer *src_peer);
+   bool WriteBlock(unsigned piece,unsigned begin,unsigned len,const char *buf);
+
+   // New pieces are assembled in memory and hashed from there. Verified
+   // pieces wait in write_back, so that adjacent pieces are written together.
+   unsigned long long write_cache_max;
+   unsigned long long write_cache_size;	 // bytes of all cached pieces
+   xarray<unsigned> write_cache_pieces;	 // pieces being assembled, oldest first
+   xarray<unsigned> write_back;		 // verified pieces not written yet
+   Timer write_back_timer;
+   unsigned long long blocks_stored;
+   unsigned long long write_calls;
+   bool CacheNewPiece(unsigned piece);
+   void EvictPiece();
+   void FlushWriteBack();
+   bool WritePieces(const unsigned *p,int n);
+   xarray<TorrentPieceHash*> hash_jobs;  // new pieces being hashed
+   bool PieceHashing(unsigned piece) const;
+   void PieceHashed(TorrentPieceHash *job);
+   void NewPieceChecked(unsigned piece,const xstring *sha1,const xstring& src_peer_id);
    const xstring& RetrieveBlock(unsigned piece,unsigned begin,unsigned len);
+   bool ReadBlock(unsigned piece,unsigned begin,unsigned len,xstring& buf);
+
+   // Whole pieces read for seeding, and written pieces, least recently
+   // used first. Pieces are read ahead only if the cache can keep one for
+   // each peer being served, and at least READ_AHEAD_MIN_PIECES.
+   static const int READ_AHEAD_MIN_PIECES = 4;
+   unsigned long long read_cache_max;
+   unsigned long long read_cache_size;
+   xarray<unsigned> read_cache;
+   unsigned long long read_cache_hits;
+   unsigned long long read_cache_misses;
+   const xstring *CachedPiece(unsigned piece);
+   bool ReadCacheAdd(unsigned piece,xstring *data);
 
    Speedometer recv_rate;
    Speedometer send_rate;
@@ -482,7 +592,7 @@ public:
    static bool NoTorrentCanAccept();
 
    static void SHA1(const xstring& str,xstring& buf);
-   void ValidatePiece(unsigned p);
+   void PieceValidated(unsigned p,const xstring *sha1);
    unsigned PieceLength(unsigned p) const { return p==total_pieces-1 ? last_piece_length : piece_length; }
    unsigned BlocksInPiece(unsigned p) const { return p==total_pieces-1 ? blocks_in_last_piece : blocks_in_piece; }
 
@@ -514,6 +624,9 @@ public:
    void Reconfig(const char *name);
    const char *GetLogContext() { return GetName(); }
 
+   const char *WriteCacheStatus() const;
+   const char *ReadCacheStatus() const;
+
    void ForceValid() { force_valid=true; }
    bool IsValidating() const { return validating; }
    void Share() { build_md=true; }
@@ -763,6 +876,7 @@ public:
    class PacketRequest : public _PacketIBL
    {
    public:
+      Time sent;
       PacketRequest(unsigned i=0,unsigned b=0,unsigned l=0)
 	 : _PacketIBL(MSG_REQUEST,i,b,l) {}
    };
@@ -863,9 +977,19 @@ private:
    void HandlePacket(Packet *);
    void HandleExtendedMessage(PacketExtended *);
 
-   static const int MAX_QUEUE_LEN = 16;
+   // The number of requests kept in flight follows the bandwidth-delay
+   // product of the peer, within the limit the peer has announced.
+   static const int MIN_QUEUE_LEN = 4;
+   static const int INITIAL_QUEUE_LEN = 16;
+   static const int MAX_QUEUE_LEN = 256;
    RefQueue<PacketRequest> recv_queue;
    RefQueue<PacketRequest> sent_queue;
+   int queue_len;
+   int peer_reqq;
+   double min_rtt;   // the shortest time from a request to its block
+   Timer queue_len_timer;
+   void ResetQueueLen();
+   void UpdateQueueLen(const PacketRequest *req);
 
    unsigned last_piece;
    static const unsigned NO_PIECE = ~0U;
@@ -430,6 +430,7 @@ void UdpTracker::NextPeer() {
    // check if we need to create a socket of different address family
    if(old_peer!=peer_curr && peer[old_peer].family()!=peer[peer_curr].family()) {
       close(sock);
+      SMTask::FDClosed(sock);
       sock=-1;
    }
 }
@@ -192,8 +192,10 @@ public:
         has_connection_id(false), connection_id(0),
 	current_action(a_none), current_event(ev_idle) {}
    ~UdpTracker() {
-      if(sock!=-1)
+      if(sock!=-1) {
 	 close(sock);
+	 SMTask::FDClosed(sock);
+      }
    }
    int Do();
    bool IsActive() const { return current_event!=ev_idle; }
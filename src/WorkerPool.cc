@@ -0,0 +1,450 @@
+/*
+ * lftp - file transfer program
+ *
+ * Copyright (c) 1996-2017 by Alexander V. Lukyanov (lav@yars.free.net)
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <config.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include "WorkerPool.h"
+#include "misc.h"
+
+static const char *WorkerThreadsValidate(xstring_c *s)
+{
+   if(!strcasecmp(*s,"auto"))
+      return 0;
+   return ResMgr::UNumberValidate(s);
+}
+ResDecl res_worker_threads("cmd:worker-threads","auto",WorkerThreadsValidate,ResMgr::NoClosure);
+
+SMTaskRef<WorkerPool> WorkerPool::instance;
+
+WorkerPool *WorkerPool::GetInstance()
+{
+   if(!instance)
+      instance=new WorkerPool();
+   return instance.get_non_const();
+}
+
+WorkerPool::WorkerPool()
+   : wanted_threads(0), queued_count(0), running_count(0),
+     queue_head(0), queue_tail(0), done_head(0), done_tail(0),
+     notified(false), jobs_count(0)
+{
+   notify_pipe[0]=notify_pipe[1]=-1;
+   OpenNotifyPipe();
+#ifdef USE_WORKER_THREADS
+   pthread_mutex_init(&mutex,0);
+   pthread_cond_init(&work_cond,0);
+   pthread_cond_init(&done_cond,0);
+   paused=false;
+   shutdown=false;
+   static bool atfork_installed;
+   if(!atfork_installed) {
+      pthread_atfork(AtForkPrepare,AtForkParent,AtForkChild);
+      atfork_installed=true;
+   }
+#endif
+   SetWaitForEvents();
+   Reconfig(0);
+}
+
+WorkerPool::~WorkerPool()
+{
+#ifdef USE_WORKER_THREADS
+   Lock();
+   shutdown=true;
+   pthread_cond_broadcast(&work_cond);
+   Unlock();
+   for(int i=0; i<threads.count(); i++)
+      pthread_join(threads[i],0);
+   pthread_cond_destroy(&done_cond);
+   pthread_cond_destroy(&work_cond);
+   pthread_mutex_destroy(&mutex);
+#endif
+   // the owners are gone, only the orphans are ours
+   while(queue_head) {
+      WorkerJob *j=queue_head;
+      queue_head=j->next;
+      if(j->orphan)
+	 delete j;
+   }
+   while(done_head) {
+      WorkerJob *j=done_head;
+      done_head=j->next;
+      if(j->orphan)
+	 delete j;
+   }
+   CloseNotifyPipe();
+}
+
+void WorkerPool::OpenNotifyPipe()
+{
+   if(pipe(notify_pipe)==-1) {
+      notify_pipe[0]=notify_pipe[1]=-1;
+      return;
+   }
+   for(int i=0; i<2; i++) {
+      fcntl(notify_pipe[i],F_SETFD,FD_CLOEXEC);
+      fcntl(notify_pipe[i],F_SETFL,O_NONBLOCK);
+   }
+}
+void WorkerPool::CloseNotifyPipe()
+{
+   for(int i=0; i<2; i++) {
+      if(notify_pipe[i]!=-1) {
+	 close(notify_pipe[i]);
+	 SMTask::FDClosed(notify_pipe[i]);
+      }
+      notify_pipe[i]=-1;
+   }
+}
+
+void WorkerPool::Lock()
+{
+#ifdef USE_WORKER_THREADS
+   pthread_mutex_lock(&mutex);
+#endif
+}
+void WorkerPool::Unlock()
+{
+#ifdef USE_WORKER_THREADS
+   pthread_mutex_unlock(&mutex);
+#endif
+}
+
+void WorkerPool::Append(WorkerJob *&head,WorkerJob *&tail,WorkerJob *j)
+{
+   j->next=0;
+   if(tail)
+      tail->next=j;
+   else
+      head=j;
+   tail=j;
+}
+bool WorkerPool::Remove(WorkerJob *&head,WorkerJob *&tail,WorkerJob *j)
+{
+   WorkerJob *prev=0;
+   for(WorkerJob *scan=head; scan; prev=scan, scan=scan->next) {
+      if(scan!=j)
+	 continue;
+      if(prev)
+	 prev->next=j->next;
+      else
+	 head=j->next;
+      if(tail==j)
+	 tail=prev;
+      j->next=0;
+      return true;
+   }
+   return false;
+}
+
+// called with the lock held
+void WorkerPool::Notify()
+{
+   if(notified || notify_pipe[1]==-1)
+      return;
+   char c=0;
+   if(write(notify_pipe[1],&c,1)==1)
+      notified=true;
+}
+
+void WorkerPool::Complete(WorkerJob *j)
+{
+   j->pending=false;
+   j->owner=0;
+   if(j->orphan) {
+      delete j;
+      return;
+   }
+   j->Finish();
+}
+
+int WorkerPool::Do()
+{
+   if(notify_pipe[0]==-1) {
+      // cannot be woken up, poll the finished jobs
+      if(done_head || queue_head)
+	 Timeout(10);
+   } else
+      Block(notify_pipe[0],POLLIN);
+
+   Lock();
+   if(notified) {
+      char buf[64];
+      while(read(notify_pipe[0],buf,sizeof(buf))>0)
+	 ;
+      notified=false;
+   }
+#ifdef USE_WORKER_THREADS
+   if(queue_head && threads.count()<wanted_threads)
+      StartThreads();
+#endif
+   Unlock();
+
+   int m=STALL;
+   for(;;) {
+      // take one job at a time, Finish() can Wait() for another one.
+      Lock();
+      WorkerJob *j=done_head;
+      if(j)
+	 Remove(done_head,done_tail,j);
+      Unlock();
+      if(!j)
+	 break;
+      SMTask *owner=j->owner;
+      Complete(j);
+      if(owner)
+	 owner->Wake();
+      m=MOVED;
+   }
+   return m;
+}
+
+void WorkerPool::Submit(WorkerJob *j,SMTask *owner)
+{
+   WorkerPool *pool=GetInstance();
+   j->owner=owner;
+   j->pending=true;
+   j->orphan=false;
+   pool->jobs_count++;
+#ifdef USE_WORKER_THREADS
+   if(pool->wanted_threads>0) {
+      pool->Lock();
+      if(pool->threads.count()<pool->wanted_threads)
+	 pool->StartThreads();
+      if(pool->threads.count()>0) {
+	 Append(pool->queue_head,pool->queue_tail,j);
+	 pool->queued_count++;
+	 pthread_cond_signal(&pool->work_cond);
+	 pool->Unlock();
+	 return;
+      }
+      pool->Unlock();
+   }
+#endif
+   // no threads, do the work now but finish it in the main loop as usual
+   j->Run();
+   pool->Lock();
+   Append(pool->done_head,pool->done_tail,j);
+   pool->Notify();
+   pool->Unlock();
+}
+
+void WorkerPool::Wait(WorkerJob *j)
+{
+   if(!j->pending)
+      return;
+   WorkerPool *pool=GetInstance();
+   pool->Lock();
+   if(Remove(pool->queue_head,pool->queue_tail,j)) {
+      // not started yet, no need to wait for a worker
+      pool->queued_count--;
+      pool->Unlock();
+      j->Run();
+      pool->Complete(j);
+      return;
+   }
+#ifdef USE_WORKER_THREADS
+   while(j->running)
+      pthread_cond_wait(&pool->done_cond,&pool->mutex);
+#endif
+   Remove(pool->done_head,pool->done_tail,j);
+   pool->Unlock();
+   pool->Complete(j);
+}
+
+void WorkerPool::Cancel(WorkerJob *j)
+{
+   if(!j->pending) {
+      delete j;
+      return;
+   }
+   WorkerPool *pool=GetInstance();
+   pool->Lock();
+   if(Remove(pool->queue_head,pool->queue_tail,j)) {
+      pool->queued_count--;
+      pool->Unlock();
+      delete j;
+      return;
+   }
+   j->owner=0;
+   j->orphan=true;
+   pool->Unlock();
+}
+
+int WorkerPool::GetThreads()
+{
+   int n=GetInstance()->wanted_threads;
+   return n>0 ? n : 1;
+}
+
+void WorkerPool::Reconfig(const char *name)
+{
+   if(name && strcmp(name,"cmd:worker-threads"))
+      return;
+   const char *v=res_worker_threads.Query(0);
+   int n;
+   if(!strcasecmp(v,"auto")) {
+      n=1;
+#ifdef _SC_NPROCESSORS_ONLN
+      n=sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+      if(n<1)
+	 n=1;
+      if(n>64)
+	 n=64;
+   } else
+      n=atoi(v);
+#ifdef USE_WORKER_THREADS
+   Lock();
+   wanted_threads=n;
+   if(threads.count()<=n) {
+      Unlock();
+      return;
+   }
+   // let extra threads exit after their current job
+   pthread_cond_broadcast(&work_cond);
+   Unlock();
+   for(int i=n; i<threads.count(); i++)
+      pthread_join(threads[i],0);
+   threads.set_length(n);
+#else
+   (void)n;
+#endif
+}
+
+#ifdef USE_WORKER_THREADS
+struct WorkerStart
+{
+   WorkerPool *pool;
+   int index;
+};
+void *WorkerPool::ThreadMain(void *a)
+{
+   WorkerStart *s=(WorkerStart*)a;
+   WorkerPool *pool=s->pool;
+   int index=s->index;
+   delete s;
+   pool->Worker(index);
+   return 0;
+}
+
+void WorkerPool::Worker(int index)
+{
+   Lock();
+   for(;;) {
+      while(!shutdown && index<wanted_threads && (paused || !queue_head))
+	 pthread_cond_wait(&work_cond,&mutex);
+      if(shutdown || index>=wanted_threads)
+	 break;
+      WorkerJob *j=queue_head;
+      queue_head=j->next;
+      if(!queue_head)
+	 queue_tail=0;
+      j->next=0;
+      queued_count--;
+      j->running=true;
+      running_count++;
+      Unlock();
+
+      j->Run();
+
+      Lock();
+      j->running=false;
+      running_count--;
+      Append(done_head,done_tail,j);
+      Notify();
+      pthread_cond_broadcast(&done_cond);
+   }
+   Unlock();
+}
+
+// called with the lock held
+void WorkerPool::StartThreads()
+{
+   // the workers must not get the signals meant for the main loop
+   sigset_t all,old;
+   sigfillset(&all);
+   pthread_sigmask(SIG_SETMASK,&all,&old);
+   while(threads.count()<wanted_threads) {
+      WorkerStart *s=new WorkerStart;
+      s->pool=this;
+      s->index=threads.count();
+      pthread_t t;
+      if(pthread_create(&t,0,ThreadMain,s)!=0) {
+	 delete s;
+	 break;
+      }
+      threads.append(t);
+   }
+   pthread_sigmask(SIG_SETMASK,&old,0);
+}
+
+// Don't fork while a job is half-done: the child would get the job
+// without the thread running it.
+void WorkerPool::AtForkPrepare()
+{
+   WorkerPool *pool=instance.get_non_const();
+   if(!pool)
+      return;
+   pool->Lock();
+   pool->paused=true;
+   while(pool->running_count>0)
+      pthread_cond_wait(&pool->done_cond,&pool->mutex);
+}
+void WorkerPool::AtForkParent()
+{
+   WorkerPool *pool=instance.get_non_const();
+   if(!pool)
+      return;
+   pool->paused=false;
+   pthread_cond_broadcast(&pool->work_cond);
+   pool->Unlock();
+}
+void WorkerPool::AtForkChild()
+{
+   WorkerPool *pool=instance.get_non_const();
+   if(!pool)
+      return;
+   // the threads are not inherited, they will be started on demand;
+   // the notification pipe must not be shared with the parent.
+   pool->threads.truncate();
+   pool->paused=false;
+   pool->CloseNotifyPipe();
+   pool->OpenNotifyPipe();
+   pool->notified=false;
+   if(pool->done_head)
+      pool->Notify();
+   pool->Unlock();
+}
+#endif // USE_WORKER_THREADS
+
+void WorkerPool::PrintStats()
+{
+   if(!instance)
+      return;
+   WorkerPool *pool=instance.get_non_const();
+   pool->Lock();
+   printf("worker_threads=%d queued=%d running=%d jobs=%llu\n",
+      pool->wanted_threads,pool->queued_count,pool->running_count,
+      pool->jobs_count);
+   pool->Unlock();
+}
@@ -0,0 +1,118 @@
+/*
+ * lftp - file transfer program
+ *
+ * Copyright (c) 1996-2017 by Alexander V. Lukyanov (lav@yars.free.net)
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef WORKERPOOL_H
+#define WORKERPOOL_H
+
+#include "SMTask.h"
+#include "ResMgr.h"
+
+#if defined(HAVE_PTHREAD_H) && defined(HAVE_PTHREAD_CREATE)
+# define USE_WORKER_THREADS 1
+# include <pthread.h>
+#endif
+
+// A piece of CPU-bound work which can be done outside of the main loop.
+// Run() is called in a worker thread and must only touch the job's own
+// data; Finish() is called later in the main loop and may delete the job.
+// The owner task is woken up when the job is finished, so it must Wait()
+// for or Cancel() all its pending jobs before it is destroyed.
+class WorkerJob
+{
+   friend class WorkerPool;
+
+   WorkerJob *next;  // in pool queues
+   SMTask *owner;    // woken up when the job is finished
+   bool pending;     // submitted and not finished yet (main loop view)
+   bool running;     // Run() is being called by a worker (under pool lock)
+   bool orphan;      // delete when finished
+
+protected:
+   virtual void Run()=0;
+   virtual void Finish() {}
+
+public:
+   WorkerJob() : next(0), owner(0), pending(false), running(false), orphan(false) {}
+   virtual ~WorkerJob() {}
+   bool Pending() const { return pending; }
+};
+
+class WorkerPool : public SMTask, public ResClient
+{
+   static SMTaskRef<WorkerPool> instance;
+   static WorkerPool *GetInstance();
+
+   int wanted_threads;
+   int queued_count;
+   int running_count;
+   WorkerJob *queue_head,*queue_tail;  // jobs waiting for a worker
+   WorkerJob *done_head,*done_tail;    // finished jobs, not yet Finish()ed
+   static void Append(WorkerJob *&head,WorkerJob *&tail,WorkerJob *j);
+   static bool Remove(WorkerJob *&head,WorkerJob *&tail,WorkerJob *j);
+
+   // the pipe wakes up the main loop when a job is done
+   int notify_pipe[2];
+   bool notified;
+   void Notify();
+   void OpenNotifyPipe();
+   void CloseNotifyPipe();
+
+   void Complete(WorkerJob *j);
+
+#ifdef USE_WORKER_THREADS
+   pthread_mutex_t mutex;
+   pthread_cond_t work_cond;
+   pthread_cond_t done_cond;
+   xarray<pthread_t> threads;
+   bool paused;	  // forking
+   bool shutdown;
+   static void *ThreadMain(void *);
+   void Worker(int index);
+   void StartThreads();
+   static void AtForkPrepare();
+   static void AtForkParent();
+   static void AtForkChild();
+#endif
+   void Lock();
+   void Unlock();
+
+   unsigned long long jobs_count;
+
+   int Do();
+
+   WorkerPool();
+   ~WorkerPool();
+
+public:
+   // Queues the job, the owner (if any) is woken up when it is finished.
+   static void Submit(WorkerJob *j,SMTask *owner=0);
+   // Waits for the job to be finished and calls its Finish().
+   static void Wait(WorkerJob *j);
+   // The job is not needed anymore, delete it as soon as possible.
+   static void Cancel(WorkerJob *j);
+
+   // Number of jobs which can be run in parallel.
+   static int GetThreads();
+
+   void Reconfig(const char *name);
+   const char *GetLogContext() { return "worker"; }
+   static void PrintStats();
+};
+
+#endif // WORKERPOOL_H
@@ -19,6 +19,9 @@
 
 #include <config.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/uio.h>
 #include "buffer.h"
 #include "FileAccess.h"
 #include "misc.h"
@@ -26,6 +29,14 @@
 #include "Speedometer.h"
 #include "log.h"
 
+#if defined(HAVE_SYS_SENDFILE_H) && defined(HAVE_SENDFILE)
+# include <sys/sendfile.h>
+# define USE_SENDFILE 1
+#endif
+#if defined(HAVE_SPLICE) && defined(SPLICE_F_NONBLOCK)
+# define USE_SPLICE 1
+#endif
+
 #define BUFFER_INC	   (8*1024) // should be power of 2
 
 const char *Buffer::Get() const
@@ -71,6 +82,10 @@ void Buffer::Allocate(int size)
       buffer_ptr=0;
    }
 
+   // there is enough room after the data, don't move anything.
+   if(buffer.length()+size<=buffer.capacity())
+      return;
+
    size_t in_buffer_real=Size();
    /* disable data movement to beginning of the buffer, if:
       1. we save the data explicitly;
@@ -84,11 +99,33 @@ void Buffer::Allocate(int size)
    // could be round-robin, but this is easier
    if(buffer.length()>in_buffer_real)
    {
+      CountCopied(Size());
       buffer.nset(buffer+buffer_ptr,Size());
       buffer_ptr=0;
    }
 
-   buffer.get_space2(in_buffer_real+size,BUFFER_INC);
+   size_t need=in_buffer_real+size;
+   if(need<=buffer.capacity())
+      return;
+   CountCopied(buffer.length());  // realloc may copy the data
+   if(pooled)
+   {
+      BufferPool::Grow(buffer,need);
+      return;
+   }
+   // grow geometrically, so that a big buffer is not reallocated often.
+   size_t inc=BUFFER_INC;
+   while(inc<need/4)
+      inc*=2;
+   buffer.get_space2(need,inc);
+}
+
+void Buffer::ReleaseSpace()
+{
+   if(!pooled || save || Size()>0 || buffer.capacity()==0)
+      return;
+   BufferPool::Release(buffer);
+   buffer_ptr=0;
 }
 
 void Buffer::SaveMaxCheck(int size)
@@ -111,6 +148,7 @@ void Buffer::Append(const char *buf,int size)
 
    memmove(GetSpace(size),buf,size);
    SpaceAdd(size);
+   CountCopied(size);
 }
 void Buffer::Put(const char *buf,int size)
 {
@@ -200,7 +238,8 @@ int Buffer::MoveDataHere(Buffer *o,int max_len)
    if(size>max_len)
       size=max_len;
    if(size>0) {
-      if(size>=64 && Size()==0 && o->Size()==size && !save && !o->save) {
+      if(size>=64 && Size()==0 && o->Size()==size && !save && !o->save
+      && pooled==o->pooled) {
 	 // optimization by swapping buffers
 	 buffer.swap(o->buffer);
 	 buffer_ptr=replace_value(o->buffer_ptr,buffer_ptr);
@@ -209,11 +248,14 @@ int Buffer::MoveDataHere(Buffer *o,int max_len)
       } else {
 	 memcpy(GetSpace(size),b,size);
 	 o->Skip(size);
+	 CountCopied(size);
       }
    }
    return size;
 }
 
+unsigned long long Buffer::copied_bytes;
+
 Buffer::Buffer()
 {
    saved_errno=0;
@@ -224,9 +266,12 @@ Buffer::Buffer()
    save=false;
    save_max=0;
    pos=0;
+   pooled=false;
 }
 Buffer::~Buffer()
 {
+   if(pooled)
+      BufferPool::Release(buffer);
 }
 
 const char *Buffer::GetRateStrS()
@@ -259,6 +304,78 @@ const char *Buffer::Dump() const
    return xstring::get_tmp(Get(),Size()).dump();
 }
 
+xstring BufferPool::free_blocks[MAX_SHIFT-MIN_SHIFT+1][FREE_MAX];
+int BufferPool::free_count[MAX_SHIFT-MIN_SHIFT+1];
+size_t BufferPool::total;
+size_t BufferPool::limit;
+BufferPoolConfig *BufferPool::config;
+
+class BufferPoolConfig : public ResClient
+{
+   void Reconfig(const char *name)
+      {
+	 if(!name || !strcmp(name,"net:buffer-pool-max"))
+	    BufferPool::Reconfig();
+      }
+};
+
+void BufferPool::Reconfig()
+{
+   if(!config)
+      config=new BufferPoolConfig; // to get notified of changes
+   limit=ResMgr::Query("net:buffer-pool-max",0);
+}
+
+void BufferPool::ClassCleanup()
+{
+   delete config;
+   config=0;
+}
+
+int BufferPool::SizeClass(size_t block)
+{
+   for(int c=0; c<=MAX_SHIFT-MIN_SHIFT; c++)
+      if(block==(size_t(1)<<(MIN_SHIFT+c)))
+	 return c;
+   return -1;
+}
+
+void BufferPool::Grow(xstring& s,size_t need)
+{
+   if(!config)
+      Reconfig();
+   size_t block=size_t(1)<<MIN_SHIFT;
+   while(block<need+1 && block<(size_t(1)<<MAX_SHIFT))
+      block*=2;
+   if(block<need+1)
+      block=(need+block)&~(block-1);
+   size_t old=BlockSize(s);
+   int c=SizeClass(block);
+   if(old==0 && c>=0 && free_count[c]>0)
+   {
+      s.swap(free_blocks[c][--free_count[c]]);
+      return;
+   }
+   s.get_space(block-1);
+   total+=block-old;
+}
+
+void BufferPool::Release(xstring& s)
+{
+   size_t block=BlockSize(s);
+   if(block==0)
+      return;
+   int c=SizeClass(block);
+   if(c>=0 && free_count[c]<FREE_MAX && !Exhausted())
+   {
+      s.truncate(0);
+      s.swap(free_blocks[c][free_count[c]++]);
+      return;
+   }
+   s.unset();
+   total-=block;
+}
+
 void DataTranslator::AppendTranslated(Buffer *target,const char *put_buf,int size)
 {
    off_t old_pos=target->GetPos();
@@ -278,6 +395,7 @@ void DirectedBuffer::SetTranslator(DataTranslator *t)
       t->AppendTranslated(this,0,0);
    }
    translator=t;
+   t->SetOwner(TranslationOwner());
 }
 
 #ifdef HAVE_ICONV
@@ -440,12 +558,25 @@ void DirectedBuffer::EmbraceNewData(int len)
       SpaceAdd(len);
    SaveMaxCheck(0);
 }
+void DirectedBuffer::DrainTranslation()
+{
+   if(!translator)
+      return;
+   off_t old_pos=GetPos();
+   translator->Drain(this);
+   SetPos(old_pos);
+}
 
 
+unsigned long long IOBuffer::zero_copy_sent;
+unsigned long long IOBuffer::zero_copy_received;
+
 IOBuffer::IOBuffer(dir_t m)
    : DirectedBuffer(m), event_time(now),
-     max_buf(0), get_size(GET_BUFSIZE)
+     max_buf(0), get_size(GET_BUFSIZE), receiving_file(false),
+     pool_limited(false)
 {
+   pooled=true;
 }
 IOBuffer::~IOBuffer()
 {
@@ -453,9 +584,26 @@ IOBuffer::~IOBuffer()
 
 void IOBuffer::Put(const char *buf,int size)
 {
-   if(size>=PUT_LL_MIN && Size()==0 && mode==PUT && !save && !translator)
+   if(size>=PUT_LL_MIN && mode==PUT && !save && !translator)
    {
-      int res=Put_LL(buf,size);
+      int res;
+      int buffered=Size();
+      if(buffered==0)
+	 res=Put_LL(buf,size);
+      else
+      {
+	 // write the buffered data and the new data together,
+	 // to avoid copying the new data to the buffer.
+	 res=PutV_LL(buffer+buffer_ptr,buffered,buf,size);
+	 if(res>0)
+	 {
+	    int written=(res<buffered?res:buffered);
+	    buffer_ptr+=written;
+	    RateAdd(written);
+	    event_time=now;
+	    res-=written;
+	 }
+      }
       if(res>=0)
       {
 	 buf+=res;
@@ -468,6 +616,7 @@ void IOBuffer::Put(const char *buf,int size)
    if(Size()==0)
       current->Timeout(0);
    DirectedBuffer::Put(buf,size);
+   Wake();
 }
 void IOBuffer::Put(const char *buf)
 {
@@ -488,6 +637,8 @@ int IOBuffer::TuneGetSize(int res)
 
 int IOBuffer::Do()
 {
+   if(BufferPool::Exhausted())
+      ReleaseSpace();
    if(Done() || Error())
       return STALL;
    int res=0;
@@ -509,17 +660,20 @@ int IOBuffer::Do()
       break;
 
    case GET:
-      if(eof)
+      if(eof || receiving_file)
 	 return STALL;
       res=TuneGetSize(Get_LL(get_size));
       if(res>0)
       {
 	 EmbraceNewData(res);
+	 if(eof)
+	    DrainTranslation();
 	 event_time=now;
 	 return MOVED;
       }
       if(eof)
       {
+	 DrainTranslation();
 	 event_time=now;
 	 return MOVED;
       }
@@ -533,6 +687,21 @@ int IOBuffer::Do()
    return STALL;
 }
 
+void IOBuffer::StopReceivingFile()
+{
+   if(!receiving_file)
+      return;
+   receiving_file=false;
+   Wake();
+}
+
+void IOBuffer::PrintStats()
+{
+   printf("zero_copy_sent=%llu zero_copy_received=%llu buffer_copied=%llu\n",
+      zero_copy_sent,zero_copy_received,CopiedBytes());
+   printf("buffer_pool=%llu\n",(unsigned long long)BufferPool::Total());
+}
+
 // IOBufferStacked implementation
 #undef super
 #define super IOBuffer
@@ -575,7 +744,10 @@ int IOBufferStacked::Do()
 	 m=MOVED;
       }
       if(eof)
+      {
+	 DrainTranslation();
 	 m=MOVED;
+      }
       if(down->Error())
       {
 	 SetError(down->ErrorText(),down->ErrorFatal());
@@ -636,6 +808,10 @@ void IOBufferStacked::ResumeInternal()
 #undef super
 #define super IOBuffer
 int IOBufferFDStream::Put_LL(const char *buf,int size)
+{
+   return PutV_LL(buf,size,0,0);
+}
+int IOBufferFDStream::PutV_LL(const char *buf1,int size1,const char *buf2,int size2)
 {
    if(put_ll_timer && !eof && Size()<PUT_LL_MIN
    && !put_ll_timer->Stopped())
@@ -658,7 +834,12 @@ int IOBufferFDStream::Put_LL(const char *buf,int size)
       return 0;
    }
 
-   res=write(fd,buf,size);
+   struct iovec iov[2];
+   iov[0].iov_base=const_cast<char*>(buf1);
+   iov[0].iov_len=size1;
+   iov[1].iov_base=const_cast<char*>(buf2);
+   iov[1].iov_len=size2;
+   res=writev(fd,iov,size2>0?2:1);
    if(res==-1)
    {
       saved_errno=errno;
@@ -690,6 +871,12 @@ int IOBufferFDStream::Get_LL(int size)
 {
    if(max_buf && Size()>=max_buf)
       return 0;
+   if(PoolFull())
+   {
+      // wait for the data to be taken.
+      Timeout(100);
+      return 0;
+   }
 
    int res=0;
 
@@ -751,6 +938,192 @@ bool IOBufferFDStream::Done()
    return false;
 }
 
+int IOBufferFDStream::SendFile(int in_fd,off_t at,int size)
+{
+#ifdef USE_SENDFILE
+   if(mode!=PUT || translator || eof || broken || Error())
+      return -1;
+   if(Size()>0)
+      return 0;
+   int fd=stream->getfd();
+   if(fd==-1)
+      return 0;
+   int res=sendfile(fd,in_fd,&at,size);
+   if(res==-1)
+   {
+      saved_errno=errno;
+      if(E_RETRY(saved_errno))
+      {
+	 Block(fd,POLLOUT);
+	 return 0;
+      }
+      // not supported for these descriptors
+      if(saved_errno==EINVAL || saved_errno==ENOSYS || saved_errno==EOVERFLOW)
+	 return -1;
+      if(stream->NonFatalError(saved_errno))
+      {
+	 // the caller (FileCopy) retries, not this buffer; make sure it
+	 // runs again even if nothing else wakes it up.
+	 TimeoutS(1);
+	 return 0;
+      }
+      if(saved_errno==EPIPE)
+	 broken=true;
+      else
+      {
+	 stream->MakeErrorText(saved_errno);
+	 SetError(stream->error_text,!TemporaryNetworkError(saved_errno));
+      }
+      return 0;
+   }
+   pos+=res;
+   RateAdd(res);
+   event_time=now;
+   zero_copy_sent+=res;
+   return res;
+#else
+   return -1;
+#endif
+}
+
+#ifdef USE_SPLICE
+// The pipe is shared by all buffers, it is always empty between calls.
+static int splice_pipe[2]={-1,-1};
+static int splice_pipe_size;
+static pid_t splice_pipe_pid;
+static void CloseSplicePipe()
+{
+   close(splice_pipe[0]);
+   close(splice_pipe[1]);
+   splice_pipe[0]=splice_pipe[1]=-1;
+}
+static bool OpenSplicePipe()
+{
+   if(splice_pipe[0]!=-1 && splice_pipe_pid==getpid())
+      return true;
+   if(splice_pipe[0]!=-1)
+   {
+      // forked, don't share the pipe with the parent
+      CloseSplicePipe();
+   }
+   if(pipe(splice_pipe)==-1)
+   {
+      splice_pipe[0]=splice_pipe[1]=-1;
+      return false;
+   }
+   fcntl(splice_pipe[0],F_SETFD,FD_CLOEXEC);
+   fcntl(splice_pipe[1],F_SETFD,FD_CLOEXEC);
+   splice_pipe_size=0x10000;
+#ifdef F_SETPIPE_SZ
+   fcntl(splice_pipe[1],F_SETPIPE_SZ,0x100000);
+   int sz=fcntl(splice_pipe[1],F_GETPIPE_SZ);
+   if(sz>0)
+      splice_pipe_size=sz;
+#endif
+   splice_pipe_pid=getpid();
+   return true;
+}
+#endif
+
+int IOBufferFDStream::ReceiveFile(int out_fd,off_t at,int size)
+{
+#ifdef USE_SPLICE
+   if(mode!=GET || translator || Error())
+      return -1;
+   receiving_file=true;
+   if(Size()>0)
+   {
+      // the data read before, write them the usual way.
+      if(size>Size())
+	 size=Size();
+      int res=pwrite(out_fd,buffer+buffer_ptr,size,at);
+      if(res<=0)
+	 return -1;  // the error is reported when the data are written again
+      Skip(res);
+      return res;
+   }
+   if(eof)
+      return 0;
+   int fd=stream->getfd();
+   if(fd==-1)
+      return 0;
+   if(!OpenSplicePipe())
+      return -1;
+
+   int total=0;
+   while(total<size)
+   {
+      int want=size-total;
+      if(want>splice_pipe_size)
+	 want=splice_pipe_size;
+      int res=splice(fd,0,splice_pipe[1],0,want,SPLICE_F_MOVE|SPLICE_F_NONBLOCK);
+      if(res==-1)
+      {
+	 saved_errno=errno;
+	 if(E_RETRY(saved_errno))
+	 {
+	    Block(fd,POLLIN);
+	    break;
+	 }
+	 if(total>0)
+	    break;   // handle the error next time
+	 if(saved_errno==EINVAL || saved_errno==ENOSYS)
+	    return -1;
+	 if(NonFatalError(saved_errno))
+	    return 0;
+	 stream->MakeErrorText(saved_errno);
+	 SetError(stream->error_text,!TemporaryNetworkError(saved_errno));
+	 return 0;
+      }
+      if(res==0)
+      {
+	 eof=true;
+	 break;
+      }
+      // now move everything from the pipe to the file.
+      while(res>0)
+      {
+	 loff_t off=at+total;
+	 int w=splice(splice_pipe[0],0,out_fd,&off,res,SPLICE_F_MOVE);
+	 if(w<=0)
+	 {
+	    // cannot write, keep the data for the usual way.
+	    while(res>0)
+	    {
+	       int r=read(splice_pipe[0],GetSpace(res),res);
+	       if(r<=0)
+	       {
+		  // the pipe is shared, the data must not get into
+		  // another file; the data are lost for this transfer.
+		  saved_errno=(r<0?errno:EIO);
+		  CloseSplicePipe();
+		  stream->MakeErrorText(saved_errno);
+		  SetError(stream->error_text,false);
+		  break;
+	       }
+	       SpaceAdd(r);
+	       res-=r;
+	    }
+	    goto out;
+	 }
+	 total+=w;
+	 res-=w;
+      }
+   }
+out:
+   if(total>0)
+   {
+      pos+=total;
+      RateAdd(total);
+      event_time=now;
+      zero_copy_received+=total;
+   }
+   return total;
+#else
+   return -1;
+#endif
+}
+
 IOBufferFDStream::~IOBufferFDStream() {}
 
 
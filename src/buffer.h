@@ -35,6 +35,35 @@ CDECL_BEGIN
 CDECL_END
 #endif
 
+// Storage for IOBuffers. Freed blocks of common sizes are kept for reuse,
+// and the total is limited by net:buffer-pool-max.
+class BufferPool
+{
+   enum {
+      MIN_SHIFT=13,  // 8K
+      MAX_SHIFT=20,  // 1M; bigger blocks are allocated in steps of this
+      FREE_MAX=8,    // free blocks kept per size
+   };
+   static xstring free_blocks[MAX_SHIFT-MIN_SHIFT+1][FREE_MAX];
+   static int free_count[MAX_SHIFT-MIN_SHIFT+1];
+   static size_t total; // including the free blocks
+   static size_t limit;
+   static class BufferPoolConfig *config;
+
+   static size_t BlockSize(const xstring& s) { return s.capacity()?s.capacity()+1:0; }
+   static int SizeClass(size_t block);
+
+public:
+   // make room for need bytes in s
+   static void Grow(xstring& s,size_t need);
+   // free the storage of s
+   static void Release(xstring& s);
+   static bool Exhausted() { return limit>0 && total>=limit; }
+   static size_t Total() { return total; }
+   static void Reconfig();
+   static void ClassCleanup();
+};
+
 class Buffer
 {
 protected:
@@ -52,10 +81,24 @@ protected:
 
    off_t pos;
 
+   bool pooled;	 // the storage comes from BufferPool
+
    Ref<Speedometer> rate;
    void RateAdd(int n);
 
    void Allocate(int size);
+   void ReleaseSpace(); // return the storage of empty buffer to the pool
+
+   static unsigned long long copied_bytes;  // by memcpy, memmove or realloc
+   // buffers are also used by worker threads (background translation)
+   static void CountCopied(unsigned long long n)
+      {
+#ifdef __ATOMIC_RELAXED
+	 __atomic_fetch_add(&copied_bytes,n,__ATOMIC_RELAXED);
+#else
+	 __sync_fetch_and_add(&copied_bytes,n);
+#endif
+      }
 
    void SaveMaxCheck(int addsize);
 
@@ -131,6 +174,15 @@ public:
    ~Buffer();
 
    const char *Dump() const;
+
+   static unsigned long long CopiedBytes()
+      {
+#ifdef __ATOMIC_RELAXED
+	 return __atomic_load_n(&copied_bytes,__ATOMIC_RELAXED);
+#else
+	 return __sync_fetch_and_add(&copied_bytes,0);
+#endif
+      }
 };
 
 class DataTranslator : public Buffer
@@ -138,6 +190,10 @@ class DataTranslator : public Buffer
 public:
    virtual void PutTranslated(Buffer *dst,const char *buf,int size)=0;
    virtual void ResetTranslation() { Empty(); }
+   // complete the translation which is being done in background
+   virtual void Drain(Buffer *dst) {}
+   // the task to wake up when background translation adds data
+   virtual void SetOwner(SMTask *owner) {}
    virtual ~DataTranslator() {}
 
    // same as PutTranslated, but does not advance pos.
@@ -165,6 +221,8 @@ protected:
    Ref<DataTranslator> translator;
    dir_t mode;
    void EmbraceNewData(int len);
+   void DrainTranslation();
+   virtual SMTask *TranslationOwner() { return 0; }
 
 public:
    DirectedBuffer(dir_t m) : mode(m) {}
@@ -196,6 +254,9 @@ protected:
    // low-level for derived classes
    virtual int Get_LL(int size) { return 0; }
    virtual int Put_LL(const char *buf,int size) { return 0; }
+   // write buf1 and then buf2 at once, returns the total number of bytes
+   // written; 0 means not supported (the data are buffered then).
+   virtual int PutV_LL(const char *buf1,int size1,const char *buf2,int size2) { return 0; }
    virtual int PutEOF_LL() { return 0; }
 
    Time event_time; // used to detect timeouts
@@ -203,10 +264,21 @@ protected:
    int get_size;
    int TuneGetSize(int res);
 
+   bool receiving_file;	 // the data are taken by ReceiveFile, don't read
+   bool pool_limited;	 // a data buffer, reading pauses when the pool is exhausted
+   static unsigned long long zero_copy_sent;
+   static unsigned long long zero_copy_received;
+
    enum {
       GET_BUFSIZE=0x10000,
       PUT_LL_MIN=0x2000,
+      POOL_FLOOR=GET_BUFSIZE, // pool_limited buffers can always hold this much
    };
+   bool PoolFull() const
+      {
+	 return pool_limited && Size()>=POOL_FLOOR && BufferPool::Exhausted();
+      }
+   SMTask *TranslationOwner() { return this; }
 
    virtual ~IOBuffer();
 
@@ -235,10 +307,29 @@ public:
    void Put(const xstring &s) { Put(s.get(),s.length()); }
    void Put(char c) { Put(&c,1); }
    // anchor to PutEOF_LL
-   void PutEOF() { DirectedBuffer::PutEOF(); PutEOF_LL(); }
+   void PutEOF() { DirectedBuffer::PutEOF(); PutEOF_LL(); Wake(); }
+
+   // Sends data straight from a regular file when the buffer is empty.
+   // Returns number of bytes sent, 0 if it has to wait (or on error),
+   // -1 if it is not possible with this buffer.
+   virtual int SendFile(int fd,off_t at,int size) { return -1; }
+   // Moves received data to a regular file at offset at: the buffered
+   // data are written, the rest is spliced from the descriptor directly.
+   // Returns the same as SendFile. Normal reading is paused until
+   // StopReceivingFile is called.
+   virtual int ReceiveFile(int fd,off_t at,int size) { return -1; }
+   void StopReceivingFile();
+   static void PrintStats();
 
    void SetMaxBuffered(int m) { max_buf=m; }
-   bool IsFull() { return Size()+(translator?translator->Size():0) >= max_buf; }
+   // Only transfer data buffers should be limited by the pool; protocol
+   // buffers have to read until they hold a complete reply or packet.
+   void SetPoolLimited(bool yes=true) { pool_limited=yes; }
+   bool IsFull()
+      {
+	 return Size()+(translator?translator->Size():0) >= max_buf
+	    || PoolFull();
+      }
 };
 
 class IOBufferStacked : public IOBuffer
@@ -268,18 +359,21 @@ class IOBufferFDStream : public IOBuffer
 
    int Get_LL(int size);
    int Put_LL(const char *buf,int size);
+   int PutV_LL(const char *buf1,int size1,const char *buf2,int size2);
 
 public:
    IOBufferFDStream(FDStream *o,dir_t m)
-      : IOBuffer(m), my_stream(o), stream(my_stream) {}
+      : IOBuffer(m), my_stream(o), stream(my_stream) { SetWaitForEvents(); }
    IOBufferFDStream(const Ref<FDStream>& o,dir_t m)
-      : IOBuffer(m), stream(o) {}
+      : IOBuffer(m), stream(o) { SetWaitForEvents(); }
    IOBufferFDStream(FDStream *o,dir_t m,Timer *t)
-      : IOBuffer(m), my_stream(o), stream(my_stream), put_ll_timer(t) {}
+      : IOBuffer(m), my_stream(o), stream(my_stream), put_ll_timer(t) { SetWaitForEvents(); }
    IOBufferFDStream(const Ref<FDStream>& o,dir_t m,Timer *t)
-      : IOBuffer(m), stream(o), put_ll_timer(t) {}
+      : IOBuffer(m), stream(o), put_ll_timer(t) { SetWaitForEvents(); }
    ~IOBufferFDStream();
    bool Done();
+   int SendFile(int fd,off_t at,int size);
+   int ReceiveFile(int fd,off_t at,int size);
    FgData *GetFgData(bool fg);
    const char *Status() { return stream->status; }
 };
@@ -19,14 +19,144 @@
 
 #include <config.h>
 #include "buffer_zlib.h"
+#include "WorkerPool.h"
 
-void DataInflator::PutTranslated(Buffer *target,const char *put_buf,int size)
+class DataZlib::Job : public WorkerJob
+{
+   DataZlib *parent;
+public:
+   xstring in;
+   Buffer out;
+   Job(DataZlib *p) : parent(p) {}
+   void Run() {
+      parent->Translate(&out,&parent->backlog,in.get(),in.length(),false);
+   }
+   void Finish() {
+      parent->JobDone();
+   }
+};
+
+DataZlib::DataZlib(bool bg)
+   : job(0), job_target(0), owner(0), waiting(false), z_err(Z_OK), background(bg)
+{
+   memset(&z,0,sizeof(z));
+}
+DataZlib::~DataZlib()
+{
+   delete job;
+}
+
+void DataZlib::SetZlibError(Buffer *target,const char *what) const
+{
+   // this can be called in a worker thread, avoid xstring::cat
+   xstring msg("zlib ");
+   msg.append(what);
+   msg.append(" error: ");
+   msg.append(z.msg?z.msg:"unknown error");
+   target->SetError(msg,true);
+}
+
+void DataZlib::PutTranslated(Buffer *target,const char *buf,int size)
+{
+   bool finish=Finishing(buf);
+   if(!background) {
+      Translate(target,this,buf,size,finish);
+      return;
+   }
+   job_target=target;
+   Put(buf,size);
+   if(job && job->Pending()) {
+      if(!finish && Size()<BACKGROUND_MAX)
+	 return;  // the data will be translated when the job is done
+      WaitJob();
+   }
+   Process(finish);
+}
+
+void DataZlib::Process(bool finish)
+{
+   if(job_target->Error())
+      return;
+   if(finish || Size()<BACKGROUND_MIN) {
+      const char *b;
+      int s;
+      Get(&b,&s);
+      Translate(job_target,&backlog,b,s,finish);
+      Skip(s);
+      return;
+   }
+   StartJob();
+}
+
+void DataZlib::StartJob()
+{
+   if(!job)
+      job=new Job(this);
+   int s=Size();
+   if(s>BACKGROUND_CHUNK)
+      s=BACKGROUND_CHUNK;
+   job->in.nset(Get(),s);
+   job->out.Empty();
+   Skip(s);
+   WorkerPool::Submit(job,owner);
+}
+
+void DataZlib::JobDone()
+{
+   if(!job_target)
+      return;
+   job_target->Append(job->out.Get(),job->out.Size());
+   if(job->out.Error()) {
+      job_target->SetError(job->out.ErrorText(),job->out.ErrorFatal());
+      return;
+   }
+   if(!waiting && Size()>0)
+      Process(false);
+}
+
+void DataZlib::WaitJob()
+{
+   waiting=true;
+   WorkerPool::Wait(job);
+   waiting=false;
+}
+
+// wait for the background translation and discard its output
+void DataZlib::DiscardJob()
+{
+   job_target=0;
+   if(job && job->Pending())
+      WaitJob();
+}
+
+void DataZlib::Drain(Buffer *target)
+{
+   if(!background)
+      return;
+   job_target=target;
+   for(;;) {
+      if(job && job->Pending())
+	 WaitJob();
+      if(Size()==0 || target->Error())
+	 break;
+      Process(false);
+   }
+}
+
+void DataZlib::ResetTranslation()
+{
+   DiscardJob();
+   Empty();
+   backlog.Empty();
+}
+
+void DataInflator::Translate(Buffer *target,Buffer *u,const char *put_buf,int size,bool)
 {
    bool from_untranslated=false;
-   if(Size()>0)
+   if(u->Size()>0)
    {
-      Put(put_buf,size);
-      Get(&put_buf,&size);
+      u->Put(put_buf,size);
+      u->Get(&put_buf,&size);
       from_untranslated=true;
    }
    // process all data we can, save the rest in the untranslated buffer
@@ -37,7 +167,7 @@ void DataInflator::PutTranslated(Buffer *target,const char *put_buf,int size)
 	 // assume the data after the compressed stream are not compressed.
 	 target->Put(put_buf,size);
 	 if(from_untranslated)
-	    Skip(size);
+	    u->Skip(size);
 	 return;
       }
       size_t put_size=size;
@@ -55,7 +185,7 @@ void DataInflator::PutTranslated(Buffer *target,const char *put_buf,int size)
 	 break;
       case Z_STREAM_END:
 	 z_err=ret;
-	 PutEOF();
+	 u->PutEOF();
 	 break;
       case Z_NEED_DICT:
 	 ret = Z_DATA_ERROR;
@@ -64,7 +194,7 @@ void DataInflator::PutTranslated(Buffer *target,const char *put_buf,int size)
 	 /* fallthrough */
       default:
 	 z_err=ret;
-	 target->SetError(xstring::cat("zlib inflate error: ",z.msg,NULL),true);
+	 SetZlibError(target,"inflate");
 	 return;
       }
       int inflated_size=store_size-z.avail_out;
@@ -72,8 +202,8 @@ void DataInflator::PutTranslated(Buffer *target,const char *put_buf,int size)
 
       target->SpaceAdd(inflated_size);
       if(from_untranslated) {
-	 Skip(processed_size);
-	 Get(&put_buf,&size);
+	 u->Skip(processed_size);
+	 u->Get(&put_buf,&size);
       } else {
 	 put_buf+=processed_size;
 	 size-=processed_size;
@@ -81,13 +211,13 @@ void DataInflator::PutTranslated(Buffer *target,const char *put_buf,int size)
       if(inflated_size==0) {
 	 // could not inflate any data, save unprocessed data
 	 if(!from_untranslated)
-	    Put(put_buf,size);
+	    u->Put(put_buf,size);
 	 return;
       }
    }
 }
 
-DataInflator::DataInflator()
+DataInflator::DataInflator(bool bg) : DataZlib(bg)
 {
    /* allocate inflate state */
    memset(&z,0,sizeof(z));
@@ -95,22 +225,24 @@ DataInflator::DataInflator()
 }
 DataInflator::~DataInflator()
 {
+   DiscardJob();
    (void)inflateEnd(&z);
 }
 void DataInflator::ResetTranslation()
 {
+   DataZlib::ResetTranslation();
    z_err = inflateReset(&z);
 }
 
 
-void DataDeflator::PutTranslated(Buffer *target,const char *put_buf,int size)
+void DataDeflator::Translate(Buffer *target,Buffer *u,const char *put_buf,int size,bool finish)
 {
-   const int flush=(put_buf?Z_NO_FLUSH:Z_FINISH);
+   const int flush=(finish?Z_FINISH:Z_NO_FLUSH);
    bool from_untranslated=false;
-   if(Size()>0)
+   if(u->Size()>0)
    {
-      Put(put_buf,size);
-      Get(&put_buf,&size);
+      u->Put(put_buf,size);
+      u->Get(&put_buf,&size);
       from_untranslated=true;
    }
    int size_coeff=1;
@@ -137,7 +269,7 @@ void DataDeflator::PutTranslated(Buffer *target,const char *put_buf,int size)
 	 break;
       default:
 	 z_err=ret;
-	 target->SetError(xstring::cat("zlib deflate error: ",z.msg,NULL),true);
+	 SetZlibError(target,"deflate");
 	 return;
       }
       int deflated_size=store_size-z.avail_out;
@@ -145,8 +277,8 @@ void DataDeflator::PutTranslated(Buffer *target,const char *put_buf,int size)
 
       target->SpaceAdd(deflated_size);
       if(from_untranslated) {
-	 Skip(processed_size);
-	 Get(&put_buf,&size);
+	 u->Skip(processed_size);
+	 u->Get(&put_buf,&size);
       } else {
 	 put_buf+=processed_size;
 	 size-=processed_size;
@@ -154,7 +286,7 @@ void DataDeflator::PutTranslated(Buffer *target,const char *put_buf,int size)
       if(deflated_size==0) {
 	 // could not deflate any data, save unprocessed data
 	 if(!from_untranslated)
-	    Put(put_buf,size);
+	    u->Put(put_buf,size);
 	 return;
       }
       if(flush==Z_FINISH && ret==Z_STREAM_END)
@@ -162,7 +294,7 @@ void DataDeflator::PutTranslated(Buffer *target,const char *put_buf,int size)
    }
 }
 
-DataDeflator::DataDeflator(int level)
+DataDeflator::DataDeflator(int level,bool bg) : DataZlib(bg)
 {
    /* allocate deflate state */
    memset(&z,0,sizeof(z));
@@ -170,9 +302,11 @@ DataDeflator::DataDeflator(int level)
 }
 DataDeflator::~DataDeflator()
 {
+   DiscardJob();
    (void)deflateEnd(&z);
 }
 void DataDeflator::ResetTranslation()
 {
+   DataZlib::ResetTranslation();
    z_err = deflateReset(&z);
 }
@@ -26,25 +26,66 @@
 #include <zlib.h>
 #include "buffer.h"
 
-class DataInflator : public DataTranslator
+// Common part of zlib translators. In background mode the (de)compression
+// is done by a worker thread and the output is added to the target buffer
+// when the worker is done, then the owner task is woken up; the owner must
+// call Drain() before relying on the translation to be complete.
+class DataZlib : public DataTranslator
 {
+   class Job;
+   friend class Job;
+   Job *job;
+   Buffer *job_target;
+   SMTask *owner;    // woken up when the job output is appended
+   Buffer backlog;   // untranslated data left by the background translation
+   bool waiting;
+
+   enum {
+      BACKGROUND_MIN=0x4000,	 // don't bother a worker with less data
+      BACKGROUND_CHUNK=0x40000,
+      BACKGROUND_MAX=0x100000	 // translate in foreground when so much is queued
+   };
+   void Process(bool finish);
+   void StartJob();
+   void JobDone();
+   void WaitJob();
+
+protected:
    z_stream z;
    int z_err;
+   bool background;
+
+   virtual void Translate(Buffer *dst,Buffer *untranslated,const char *buf,int size,bool finish)=0;
+   virtual bool Finishing(const char *buf) const { return false; }
+   void SetZlibError(Buffer *dst,const char *what) const;
+   void DiscardJob();
+
+   DataZlib(bool bg);
+   ~DataZlib();
+
 public:
-   DataInflator();
-   ~DataInflator();
    void PutTranslated(Buffer *dst,const char *buf,int size);
    void ResetTranslation();
+   void Drain(Buffer *dst);
+   void SetOwner(SMTask *o) { owner=o; }
 };
 
-class DataDeflator : public DataTranslator
+class DataInflator : public DataZlib
 {
-   z_stream z;
-   int z_err;
+   void Translate(Buffer *dst,Buffer *untranslated,const char *buf,int size,bool finish);
 public:
-   DataDeflator(int level=Z_DEFAULT_COMPRESSION);
+   DataInflator(bool background=false);
+   ~DataInflator();
+   void ResetTranslation();
+};
+
+class DataDeflator : public DataZlib
+{
+   void Translate(Buffer *dst,Buffer *untranslated,const char *buf,int size,bool finish);
+   bool Finishing(const char *buf) const { return !buf; }
+public:
+   DataDeflator(int level=Z_DEFAULT_COMPRESSION,bool background=false);
    ~DataDeflator();
-   void PutTranslated(Buffer *dst,const char *buf,int size);
    void ResetTranslation();
 };
 
@@ -75,6 +75,7 @@
 #include "PatternSet.h"
 #include "LocalDir.h"
 #include "ConnectionSlot.h"
+#include "WorkerPool.h"
 
 #include "configmake.h"
 
@@ -3523,6 +3524,9 @@ CMD(slot)
 CMD(tasks)
 {
    printf("task_count=%d\n",SMTask::TaskCount());
+   SMTask::PrintStats();
+   WorkerPool::PrintStats();
+   IOBuffer::PrintStats();
    SMTask::PrintTasks();
    exit_code=0;
    return 0;
@@ -1084,6 +1084,7 @@ Ftp::Connection::~Connection()
    {
       LogNote(7,_("Closing control socket"));
       close(control_sock);
+      SMTask::FDClosed(control_sock);
    }
 }
 
@@ -2230,6 +2231,7 @@ int   Ftp::Do()
       }
 
       close(conn->data_sock);
+      SMTask::FDClosed(conn->data_sock);
       conn->data_sock=res;
       if(QueryBool("use-ip-tos",hostname))
 	 MaximizeThroughput(conn->data_sock);
@@ -2368,11 +2370,12 @@ int   Ftp::Do()
 	 if(!conn->data_iobuf || conn->data_iobuf->GetDirection()!=dir)
 	    conn->data_iobuf=new IOBufferFDStream(new FDStream(conn->data_sock,"data-socket"),dir);
       }
+      conn->data_iobuf->SetPoolLimited();
       if(conn->t_mode=='Z') {
 	 if(mode==STORE)
-	    conn->AddDataTranslator(new DataDeflator(Query("mode-z-level",hostname)));
+	    conn->AddDataTranslator(new DataDeflator(Query("mode-z-level",hostname),true));
 	 else
-	    conn->AddDataTranslator(new DataInflator());
+	    conn->AddDataTranslator(new DataInflator(true));
       }
       if(mode==LIST || mode==LONG_LIST || mode==MP_LIST)
       {
@@ -3267,6 +3270,7 @@ void Ftp::Connection::CloseDataSocket()
       return;
    LogNote(7,_("Closing data socket"));
    close(data_sock);
+   SMTask::FDClosed(data_sock);
    data_sock=-1;
 }
 
@@ -3289,6 +3293,7 @@ void Ftp::Connection::CloseAbortedDataConnection()
    {
       LogNote(9,_("Closing aborted data socket"));
       close(aborted_data_sock);
+      SMTask::FDClosed(aborted_data_sock);
       aborted_data_sock=-1;
    }
 }
@@ -3726,7 +3731,8 @@ void Ftp::ResumeInternal()
    super::ResumeInternal();
 }
 
-int   Ftp::CanRead()
+// checks common to Read and ReadToFile, returns 1 if the data can be taken.
+int   Ftp::ReadReady()
 {
    if(Error())
       return(error_code);
@@ -3743,6 +3749,20 @@ int   Ftp::CanRead()
    if(state==DATASOCKET_CONNECTING_STATE)
       return DO_AGAIN;
 
+   if(norest_manual && real_pos==0 && pos>0)
+      return DO_AGAIN;
+
+   return 1;
+}
+
+int   Ftp::CanRead()
+{
+   int res=ReadReady();
+   if(res<=0)
+      return res;
+
+   conn->data_iobuf->StopReceivingFile();
+
    int size=conn->data_iobuf->Size();
    if(state==DATA_OPEN_STATE)
    {
@@ -3753,8 +3773,6 @@ int   Ftp::CanRead()
       if(size>allowed)
 	 size=allowed;
    }
-   if(norest_manual && real_pos==0 && pos>0)
-      return DO_AGAIN;
    if(size==0)
       return DO_AGAIN;
    return size;
@@ -3799,17 +3817,7 @@ int   Ftp::Read(Buffer *buf,int size)
    return(size);
 }
 
-/*
-   Write - send data to ftp server
-
-   * Uploading is not reliable in this realization *
-   Well, not less reliable than in any usual ftp client.
-
-   The reason for this is uncheckable receiving of data on the remote end.
-   Since that, we have to leave re-putting up to caller.
-   Fortunately, class FileCopy does it.
-*/
-int   Ftp::Write(const void *buf,int size)
+int   Ftp::CanWrite(int size)
 {
    if(mode!=STORE)
       return(0);
@@ -3831,13 +3839,11 @@ int   Ftp::Write(const void *buf,int size)
       if(size>allowed)
 	 size=allowed;
    }
-   if(size+conn->data_iobuf->Size()>=max_buf)
-      size=max_buf-conn->data_iobuf->Size();
-   if(size<=0)
-      return 0;
-
-   conn->data_iobuf->Put((const char*)buf,size);
+   return size;
+}
 
+void  Ftp::Written(int size)
+{
    if(retries+persist_retries>0
    && conn->data_iobuf->GetPos()>Buffered()+0x20000)
    {
@@ -3851,6 +3857,87 @@ int   Ftp::Write(const void *buf,int size)
    pos+=size;
    real_pos+=size;
    flags|=IO_FLAG;
+}
+
+// splice from the data socket, possible for plain binary transfers.
+int   Ftp::ReadToFile(int fd,off_t at,int size)
+{
+   if(ascii)
+      return NOT_SUPP;
+
+   int res=ReadReady();
+   if(res<=0)
+      return res;
+
+   // the data before pos have to be skipped by Read.
+   if(real_pos!=pos)
+      return NOT_SUPP;
+
+   if(!rate_limit || (state!=DATA_OPEN_STATE && state!=WAITING_STATE))
+      return DO_AGAIN;
+
+   int allowed=rate_limit->BytesAllowedToGet();
+   if(allowed==0)
+      return DO_AGAIN;
+   if(size>allowed)
+      size=allowed;
+
+   size=conn->data_iobuf->ReceiveFile(fd,at,size);
+   if(size<0)
+      return NOT_SUPP;
+   if(size==0)
+      return DO_AGAIN;
+   rate_limit->BytesGot(size);
+   real_pos+=size;
+   pos+=size;
+
+   TrySuccess();
+   flags|=IO_FLAG;
+
+   return(size);
+}
+
+/*
+   Write - send data to ftp server
+
+   * Uploading is not reliable in this realization *
+   Well, not less reliable than in any usual ftp client.
+
+   The reason for this is uncheckable receiving of data on the remote end.
+   Since that, we have to leave re-putting up to caller.
+   Fortunately, class FileCopy does it.
+*/
+int   Ftp::Write(const void *buf,int size)
+{
+   size=CanWrite(size);
+   if(size<=0)
+      return size;
+
+   if(size+conn->data_iobuf->Size()>=max_buf)
+      size=max_buf-conn->data_iobuf->Size();
+   if(size<=0)
+      return 0;
+
+   conn->data_iobuf->Put((const char*)buf,size);
+   Written(size);
+   return(size);
+}
+
+// sendfile to the data socket, possible for plain binary transfers.
+int   Ftp::WriteFromFile(int fd,off_t at,int size)
+{
+   if(ascii)
+      return NOT_SUPP;
+   size=CanWrite(size);
+   if(size<=0)
+      return size;
+
+   size=conn->data_iobuf->SendFile(fd,at,size);
+   if(size<0)
+      return NOT_SUPP;
+   if(size==0)
+      return DO_AGAIN;
+   Written(size);
    return(size);
 }
 
@@ -433,9 +433,13 @@ private:
    const char *encode_eprt(const sockaddr_u *);
 
    typedef FileInfo *(*FtpLineParser)(char *line,int *err,const char *tz);
-   static FtpLineParser line_parsers[];
+   enum { number_of_parsers=7 };
+   static FtpLineParser line_parsers[number_of_parsers];
 
+   int ReadReady();
    int CanRead();
+   int CanWrite(int size);
+   void Written(int size);
 
    const char *path_to_send();
 
@@ -477,6 +481,8 @@ public:
 
    int   Read(Buffer *buf,int size);
    int   Write(const void *buf,int size);
+   int   WriteFromFile(int fd,off_t at,int size);
+   int   ReadToFile(int fd,off_t at,int size);
    int   Buffered();
    void  Close();
    bool	 IOReady();
@@ -518,6 +524,27 @@ public:
    DirList *MakeDirList(ArgV *args);
    FileSet *ParseLongList(const char *buf,int len,int *err=0) const;
 
+   // Parses a long list as it arrives, trying all the line parsers on the
+   // first lines and using only the best one when it stands out.
+   class LongListParser
+   {
+      xstring_c tz;  // a copy, the setting can change while parsing
+      int err[number_of_parsers];
+      Ref<FileSet> set[number_of_parsers];
+      int guessed;   // the parser chosen, or -1
+      int best_err1;
+      int best_err2;
+      bool failed;   // too many errors with every parser
+      xstring line;
+      xstring tmp_line;
+      void ParseLine();
+   public:
+      LongListParser(const char *tz);
+      int Parse(const char *buf,int len); // returns the length of parsed lines
+      FileSet *GetResult(int *err_ret);
+   };
+   LongListParser *NewLongListParser() const;
+
    void SetCopyMode(copy_mode_t cm,bool rp,bool prot,bool sscn,int rnum,time_t tt)
       {
 	 copy_mode=cm;
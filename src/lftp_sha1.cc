@@ -0,0 +1,155 @@
+/*
+ * lftp - file transfer program
+ *
+ * Copyright (c) 1996-2016 by Alexander V. Lukyanov (lav@yars.free.net)
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <config.h>
+#include <string.h>
+#include <stdint.h>
+#include <sha1.h>
+#include "lftp_sha1.h"
+
+#if (defined(__x86_64__) || defined(__i386__)) \
+ && (__GNUC__>=5 || defined(__clang__)) && defined(HAVE_CPUID_H)
+# define USE_SHA_NI 1
+# include <cpuid.h>
+# include <immintrin.h>
+#endif
+
+typedef void (*sha1_blocks_t)(uint32_t *state,const unsigned char *data,size_t blocks);
+
+#ifdef USE_SHA_NI
+// Intel SHA extensions. Each group does 4 rounds; the message schedule
+// for group g+1..g+3 is computed along the way in a ring of 4 registers.
+#define SHA1_GROUP(g) do { \
+   if(g==0) \
+      E[0]=_mm_add_epi32(E[0],M[0]); \
+   else \
+      E[g%2]=_mm_sha1nexte_epu32(E[g%2],M[g%4]); \
+   E[(g+1)%2]=ABCD; \
+   if(g>=3 && g<=18) \
+      M[(g+1)%4]=_mm_sha1msg2_epu32(M[(g+1)%4],M[g%4]); \
+   ABCD=_mm_sha1rnds4_epu32(ABCD,E[g%2],g/5); \
+   if(g>=1 && g<=16) \
+      M[(g+3)%4]=_mm_sha1msg1_epu32(M[(g+3)%4],M[g%4]); \
+   if(g>=2 && g<=17) \
+      M[(g+2)%4]=_mm_xor_si128(M[(g+2)%4],M[g%4]); \
+} while(0)
+
+__attribute__((target("sha,sse4.1")))
+static void sha1_blocks_shani(uint32_t *state,const unsigned char *data,size_t blocks)
+{
+   const __m128i bswap=_mm_set_epi64x(0x0001020304050607ULL,0x08090a0b0c0d0e0fULL);
+   __m128i ABCD=_mm_shuffle_epi32(_mm_loadu_si128((const __m128i*)state),0x1B);
+   __m128i E[2],M[4];
+   E[0]=_mm_set_epi32(state[4],0,0,0);
+   E[1]=_mm_setzero_si128();
+
+   while(blocks-->0) {
+      const __m128i ABCD_save=ABCD;
+      const __m128i E_save=E[0];
+      for(int i=0; i<4; i++)
+	 M[i]=_mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(data+16*i)),bswap);
+      SHA1_GROUP(0);  SHA1_GROUP(1);  SHA1_GROUP(2);  SHA1_GROUP(3);
+      SHA1_GROUP(4);  SHA1_GROUP(5);  SHA1_GROUP(6);  SHA1_GROUP(7);
+      SHA1_GROUP(8);  SHA1_GROUP(9);  SHA1_GROUP(10); SHA1_GROUP(11);
+      SHA1_GROUP(12); SHA1_GROUP(13); SHA1_GROUP(14); SHA1_GROUP(15);
+      SHA1_GROUP(16); SHA1_GROUP(17); SHA1_GROUP(18); SHA1_GROUP(19);
+      E[0]=_mm_sha1nexte_epu32(E[0],E_save);
+      ABCD=_mm_add_epi32(ABCD,ABCD_save);
+      data+=64;
+   }
+
+   _mm_storeu_si128((__m128i*)state,_mm_shuffle_epi32(ABCD,0x1B));
+   state[4]=_mm_extract_epi32(E[0],3);
+}
+#undef SHA1_GROUP
+
+static bool cpu_has_sha_ni()
+{
+   unsigned a,b,c,d;
+   if(__get_cpuid_max(0,0)<7)
+      return false;
+   __cpuid(1,a,b,c,d);
+   if(!(c&bit_SSSE3) || !(c&bit_SSE4_1))
+      return false;
+   __cpuid_count(7,0,a,b,c,d);
+   return (b&(1<<29))!=0;  // SHA
+}
+
+// Feeds whole blocks to the given function and does the padding.
+static void sha1_buffer_blocks(sha1_blocks_t process,const char *buf,size_t len,void *digest)
+{
+   uint32_t state[5]={0x67452301,0xEFCDAB89,0x98BADCFE,0x10325476,0xC3D2E1F0};
+   const unsigned char *data=(const unsigned char*)buf;
+   size_t blocks=len/64;
+   if(blocks>0)
+      process(state,data,blocks);
+   size_t tail=len%64;
+   unsigned char last[128];
+   memcpy(last,data+blocks*64,tail);
+   last[tail]=0x80;
+   size_t last_len=(tail<56 ? 64 : 128);
+   memset(last+tail+1,0,last_len-tail-1);
+   uint64_t bits=(uint64_t)len*8;
+   for(int i=0; i<8; i++)
+      last[last_len-1-i]=(unsigned char)(bits>>(8*i));
+   process(state,last,last_len/64);
+   unsigned char *out=(unsigned char*)digest;
+   for(int i=0; i<5; i++) {
+      out[4*i+0]=state[i]>>24;
+      out[4*i+1]=state[i]>>16;
+      out[4*i+2]=state[i]>>8;
+      out[4*i+3]=state[i];
+   }
+}
+#endif // USE_SHA_NI
+
+struct sha1_impl_t
+{
+   const char *name;
+   sha1_blocks_t blocks;   // null means gnulib's sha1_buffer
+};
+static sha1_impl_t sha1_select()
+{
+#ifdef USE_SHA_NI
+   if(cpu_has_sha_ni()) {
+      sha1_impl_t i={"sha-ni",sha1_blocks_shani};
+      return i;
+   }
+#endif
+   sha1_impl_t i={"generic",0};
+   return i;
+}
+// selected before any threads are started
+static const sha1_impl_t sha1_impl=sha1_select();
+
+void lftp_sha1_buffer(const char *buf,size_t len,void *digest)
+{
+#ifdef USE_SHA_NI
+   if(sha1_impl.blocks) {
+      sha1_buffer_blocks(sha1_impl.blocks,buf,len,digest);
+      return;
+   }
+#endif
+   sha1_buffer(buf,len,digest);
+}
+
+const char *lftp_sha1_impl()
+{
+   return sha1_impl.name;
+}
@@ -0,0 +1,32 @@
+/*
+ * lftp - file transfer program
+ *
+ * Copyright (c) 1996-2016 by Alexander V. Lukyanov (lav@yars.free.net)
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef LFTP_SHA1_H
+#define LFTP_SHA1_H
+
+#include <stddef.h>
+
+// Same as gnulib's sha1_buffer, but uses the CPU SHA instructions when
+// they are available (checked once at startup). Thread safe.
+void lftp_sha1_buffer(const char *buf,size_t len,void *digest);
+
+// name of the implementation in use, for diagnostics and benchmarks
+const char *lftp_sha1_impl();
+
+#endif // LFTP_SHA1_H
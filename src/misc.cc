@@ -53,6 +53,7 @@ CDECL_BEGIN
 #include "human.h"
 CDECL_END
 #include "misc.h"
+#include "ascii_ctype.h"
 #include "ProcWait.h"
 #include "SignalHook.h"
 #include "url.h"
@@ -293,76 +294,45 @@ char *xgetcwd()
 
 int parse_perms(const char *s)
 {
-   int p=0;
-
-   if(strlen(s)!=9
-   && !(strlen(s)==10 && s[9]=='+'))   // ACL tag
-      bad: return -1;
+   // the user, group and other triplets only differ in the special bit
+   static const int special_bit[3]={S_ISUID,S_ISGID,S_ISVTX};
+   static const char special_ch[3]={'s','s','t'};
 
-   switch(s[0])
-   {
-   case('r'): p|=S_IRUSR; break;
-   case('-'): break;
-   default: goto bad;
-   }
-   switch(s[1])
-   {
-   case('w'): p|=S_IWUSR; break;
-   case('-'): break;
-   default: goto bad;
-   }
-   switch(s[2])
-   {
-   case('S'): p|=S_ISUID; break;
-   case('s'): p|=S_ISUID; // fall-through
-   case('x'): p|=S_IXUSR; break;
-   case('-'): break;
-   default: goto bad;
-   }
-   s+=3;
-   switch(s[0])
-   {
-   case('r'): p|=S_IRGRP; break;
-   case('-'): break;
-   default: goto bad;
-   }
-   switch(s[1])
-   {
-   case('w'): p|=S_IWGRP; break;
-   case('-'): break;
-   default: goto bad;
-   }
-   switch(s[2])
-   {
-   case('S'): p|=S_ISGID; break;
-   case('s'): p|=S_ISGID; // fall-through
-   case('x'): p|=S_IXGRP; break;
-   case('-'): break;
-   default: goto bad;
-   }
-   s+=3;
-   switch(s[0])
-   {
-   case('r'): p|=S_IROTH; break;
-   case('-'): break;
-   default: goto bad;
-   }
-   switch(s[1])
-   {
-   case('w'): p|=S_IWOTH; break;
-   case('-'): break;
-   default: goto bad;
-   }
-   switch(s[2])
+   int p=0;
+   for(int i=0; i<3; i++, s+=3)
    {
-   case('T'): p|=S_ISVTX; break;
-   case('t'): p|=S_ISVTX; // fall-through
-   case('x'): p|=S_IXOTH; break;
-   case('l'): case('L'): p|=S_ISGID; p&=~S_IXGRP; break;
-   case('-'): break;
-   default: goto bad;
+      int shift=3*(2-i);
+      switch(s[0])
+      {
+      case('r'): p|=04<<shift; break;
+      case('-'): break;
+      default: return -1;
+      }
+      switch(s[1])
+      {
+      case('w'): p|=02<<shift; break;
+      case('-'): break;
+      default: return -1;
+      }
+      char c=s[2];
+      if(c=='x')
+	 p|=01<<shift;
+      else if(c==special_ch[i])
+	 p|=special_bit[i]|(01<<shift);
+      else if(c==to_ascii_upper(special_ch[i]))
+	 p|=special_bit[i];
+      else if(i==2 && (c=='l' || c=='L'))
+      {
+	 p|=S_ISGID;
+	 p&=~S_IXGRP;
+      }
+      else if(c!='-')
+	 return -1;
    }
-
+   if(s[0]=='+')  // ACL tag
+      s++;
+   if(s[0]!=0)
+      return -1;
    return p;
 }
 
@@ -391,26 +361,52 @@ const char month_names[][4]={
    "Jul","Aug","Sep","Oct","Nov","Dec",
    ""
 };
+#define MONTH_KEY(a,b,c) ((a)<<16|(b)<<8|(c))
+static const int month_keys[12]={
+   MONTH_KEY('j','a','n'),MONTH_KEY('f','e','b'),MONTH_KEY('m','a','r'),
+   MONTH_KEY('a','p','r'),MONTH_KEY('m','a','y'),MONTH_KEY('j','u','n'),
+   MONTH_KEY('j','u','l'),MONTH_KEY('a','u','g'),MONTH_KEY('s','e','p'),
+   MONTH_KEY('o','c','t'),MONTH_KEY('n','o','v'),MONTH_KEY('d','e','c'),
+};
 int parse_month(const char *m)
 {
-   for(int i=0; month_names[i][0]; i++)
-      if(!strcasecmp(month_names[i],m))
-	 return(i%12);
+   if(!m[0] || !m[1] || !m[2] || m[3])
+      return -1;
+   int key=MONTH_KEY(to_ascii_lower(m[0]),to_ascii_lower(m[1]),to_ascii_lower(m[2]));
+   for(int i=0; i<12; i++)
+      if(month_keys[i]==key)
+	 return i;
    return -1;
 }
+#undef MONTH_KEY
+
+static inline bool two_digits(const char *s,int *n)
+{
+   if(!is_ascii_digit(s[0]) || !is_ascii_digit(s[1]))
+      return false;
+   *n=(s[0]-'0')*10+(s[1]-'0');
+   return true;
+}
 
 int parse_year_or_time(const char *year_or_time,int *year,int *hour,int *minute)
 {
    if(year_or_time[2]==':')
    {
-      if(2!=sscanf(year_or_time,"%2d:%2d",hour,minute))
+      if(!(two_digits(year_or_time,hour) && two_digits(year_or_time+3,minute))
+      && 2!=sscanf(year_or_time,"%2d:%2d",hour,minute))
 	 return -1;
       *year=-1;
    }
    else
    {
-      if(1!=sscanf(year_or_time,"%d",year))
-	 return -1;;
+      const char *s=year_or_time;
+      int y=0;
+      while(is_ascii_digit(*s) && s-year_or_time<9)
+	 y=y*10+(*s++-'0');
+      if(s>year_or_time && *s==0)
+	 *year=y;
+      else if(1!=sscanf(year_or_time,"%d",year))
+	 return -1;
       *hour=*minute=0;
    }
    return 0;
@@ -465,27 +461,29 @@ const char *squeeze_file_name(const char *name,int w)
 }
 
 /* Converts struct tm to time_t, assuming the data in tm is UTC rather
-   than local timezone (mktime assumes the latter).
-
-   Contributed by Roger Beeman <beeman@cisco.com>, with the help of
-   Mark Baushke <mdb@cisco.com> and the rest of the Gurus at CISCO.  */
+   than local timezone (mktime assumes the latter). Out of range fields
+   are allowed, like for mktime. */
 time_t
 mktime_from_utc (const struct tm *t)
 {
-   struct tm tc;
-   memcpy(&tc, t, sizeof(struct tm));
-
-   /* UTC times are never DST; if we say -1, we'll introduce odd localtime-
-    * dependant errors. */
-
-   tc.tm_isdst = 0;
-
-   time_t tl = mktime (&tc);
-   if (tl == -1)
-      return -1;
-   time_t tb = mktime (gmtime (&tl));
-
-   return (tl <= tb ? (tl + (tl - tb)) : (tl - (tb - tl)));
+   long long year=t->tm_year+1900LL;
+   int mon=t->tm_mon%12;
+   year+=t->tm_mon/12;
+   if(mon<0)
+   {
+      mon+=12;
+      year--;
+   }
+   // days since 1970-01-01 in the proleptic Gregorian calendar,
+   // counting years from March to put the leap day at the end.
+   if(mon<2)
+      year--;
+   long long era=(year>=0 ? year : year-399)/400;
+   int year_of_era=year-era*400;
+   int day_of_year=(153*(mon<2 ? mon+10 : mon-2)+2)/5;
+   int day_of_era=year_of_era*365+year_of_era/4-year_of_era/100+day_of_year;
+   long long days=era*146097+day_of_era-719468+(t->tm_mday-1);
+   return days*86400+t->tm_hour*3600LL+t->tm_min*60+t->tm_sec;
 }
 
 static void set_tz(const char *tz)
@@ -528,12 +526,10 @@ static void restore_tz()
 {
    set_tz(saved_tz);
 }
-time_t mktime_from_tz(struct tm *t,const char *tz)
+static time_t mktime_in_tz(struct tm *t,const char *tz)
 {
-   if(!tz || !*tz)
+   if(!tz)
       return mktime(t);
-   if(!strcasecmp(tz,"GMT"))
-      return mktime_from_utc(t);
    if(isdigit((unsigned char)*tz) || *tz=='+' || *tz=='-')
    {
       int tz1_len=strlen(tz)+4;
@@ -548,6 +544,72 @@ time_t mktime_from_tz(struct tm *t,const char *tz)
    return res;
 }
 
+/* Switching TZ and mktime are slow, and a directory listing has dates
+   from a few months only. Remember the UTC offset of recent months and
+   use it while it is the same at the start and at the end of the month. */
+struct month_offset
+{
+   int year,mon;
+   int days;	     // in the month
+   bool fixed;	     // the offset is the same for the whole month
+   long offset;
+};
+static month_offset month_offsets[64];
+static xstring_c month_offsets_tz;
+static bool month_offsets_valid;
+
+static const month_offset *get_month_offset(int year,int mon,const char *tz)
+{
+   const char *key=(tz?tz:getenv("TZ"));
+   if(!month_offsets_valid || xstrcmp(key,month_offsets_tz))
+   {
+      month_offsets_tz.set(key);
+      for(int i=0; i<64; i++)
+	 month_offsets[i].days=0;
+      month_offsets_valid=true;
+   }
+   month_offset *m=&month_offsets[(year*12+mon)&63];
+   if(m->days && m->year==year && m->mon==mon)
+      return m;
+
+   struct tm start;
+   memset(&start,0,sizeof(start));
+   start.tm_year=year;
+   start.tm_mon=mon;
+   start.tm_mday=1;
+   start.tm_isdst=-1;
+   struct tm end=start;
+   end.tm_mon++;
+   time_t start_utc=mktime_from_utc(&start);
+   time_t end_utc=mktime_from_utc(&end);
+   time_t start_local=mktime_in_tz(&start,tz);
+   time_t end_local=mktime_in_tz(&end,tz);
+
+   m->year=year;
+   m->mon=mon;
+   m->days=(end_utc-start_utc)/86400;
+   m->offset=start_utc-start_local;
+   m->fixed=(start_local!=-1 && end_local!=-1 && end_utc-end_local==m->offset);
+   return m;
+}
+
+time_t mktime_from_tz(struct tm *t,const char *tz)
+{
+   if(tz && !*tz)
+      tz=0;
+   if(tz && !strcasecmp(tz,"GMT"))
+      return mktime_from_utc(t);
+   if(t->tm_isdst!=-1
+   || t->tm_mon<0 || t->tm_mon>11 || t->tm_mday<1
+   || t->tm_hour<0 || t->tm_hour>23 || t->tm_min<0 || t->tm_min>59
+   || t->tm_sec<0 || t->tm_sec>59)
+      return mktime_in_tz(t,tz);
+   const month_offset *m=get_month_offset(t->tm_year,t->tm_mon,tz);
+   if(!m->fixed || t->tm_mday>m->days)
+      return mktime_in_tz(t,tz);
+   return mktime_from_utc(t)-m->offset;
+}
+
 bool re_match(const char *line,const char *a,int flags)
 {
    if(!a || !*a)
@@ -1050,15 +1112,3 @@ bool is_ipv6_address(const char *s)
    return false;
 #endif
 }
-
-int lftp_fallocate(int fd,off_t sz)
-{
-#if defined(HAVE_FALLOCATE)
-   return fallocate(fd,0,0,sz);
-#elif defined(HAVE_POSIX_FALLOCATE)
-   return posix_fallocate(fd,0,sz);
-#else
-   errno=ENOSYS;
-   return -1;
-#endif
-}
@@ -28,6 +28,7 @@
 #include "url.h"
 #include "misc.h"
 #include "log.h"
+#include "FileLayout.h"
 
 ResType pget_vars[] = {
    {"pget:save-status",	"10s",   ResMgr::TimeIntervalValidate,ResMgr::NoClosure},
@@ -165,14 +166,16 @@ int pgetJob::Do()
       {
 	 SaveStatus();
 	 status_timer.Reset();
-	 if(ResMgr::QueryBool("file:use-fallocate",0)) {
-	    // allocate space after creating *.lftp-pget-status file,
-	    // so that the incomplete status is more obvious.
-	    const Ref<FDStream>& local=c->put->GetLocal();
-	    if(lftp_fallocate(local->getfd(),size)==-1 && errno!=ENOSYS && errno!=EOPNOTSUPP) {
-	       eprintf(_("pget: warning: space allocation for %s (%lld bytes) failed: %s\n"),
-		  local->name.get(),(long long)size,strerror(errno));
-	    }
+      }
+      // allocate space after creating *.lftp-pget-status file,
+      // so that the incomplete status is more obvious. When continuing,
+      // the holes left by the previous run get allocated.
+      if(ResMgr::QueryBool("file:use-fallocate",0)) {
+	 const Ref<FDStream>& local=c->put->GetLocal();
+	 if(FileLayout::Preallocate(local->getfd(),size,local->name)==-1
+	 && errno!=ENOSYS && errno!=EOPNOTSUPP) {
+	    eprintf(_("pget: warning: space allocation for %s (%lld bytes) failed: %s\n"),
+	       local->name.get(),(long long)size,strerror(errno));
 	 }
       }
    }
@@ -310,9 +310,13 @@ static ResType lftp_vars[] = {
 #if USE_SSL
    {"https:proxy",		 "",	  HttpProxyValidate,0},
 #endif
+   {"net:buffer-pool-max",	 "0",	  ResMgr::UNumberValidate,ResMgr::NoClosure},
    {"net:idle",			 "3m",	  ResMgr::TimeIntervalValidate,0},
    {"net:limit-max",		 "0",	  ResMgr::UNumberValidate,0},
    {"net:limit-rate",		 "0:0",   ResMgr::UNumberPairValidate,0},
+   {"net:limit-host-max",	 "0",	  ResMgr::UNumberValidate,0},
+   {"net:limit-host-rate",	 "0:0",   ResMgr::UNumberPairValidate,0},
+   {"net:limit-share",		 "1",	  ResMgr::UNumberValidate,0},
    {"net:limit-total-max",	 "0",	  ResMgr::UNumberValidate,ResMgr::NoClosure},
    {"net:limit-total-rate",	 "0:0",   ResMgr::UNumberPairValidate,ResMgr::NoClosure},
    {"net:max-retries",		 "1000",  ResMgr::UNumberValidate,0},
@@ -335,6 +339,7 @@ static ResType lftp_vars[] = {
    {"mirror:order",		 "*.sfv *.sig *.md5* *.sum * */", 0,ResMgr::NoClosure},
    {"mirror:parallel-directories", "yes", ResMgr::BoolValidate,ResMgr::NoClosure},
    {"mirror:parallel-transfer-count", "1",ResMgr::UNumberValidate,ResMgr::NoClosure},
+   {"mirror:parallel-scan-count", "0",ResMgr::UNumberValidate,ResMgr::NoClosure},
    {"mirror:exclude-regex",	 "(^|/)(\\.in\\.|\\.nfs)",ResMgr::ERegExpValidate,ResMgr::NoClosure},
    {"mirror:include-regex",	 "",	  ResMgr::ERegExpValidate,ResMgr::NoClosure},
    {"mirror:use-pget-n",	 "1",	  ResMgr::UNumberValidate,ResMgr::NoClosure},
@@ -346,7 +351,7 @@ static ResType lftp_vars[] = {
    {"mirror:overwrite",		 "no",	  ResMgr::BoolValidate,ResMgr::NoClosure},
 
    {"sftp:auto-confirm",	 "no",	  ResMgr::BoolValidate,0},
-   {"sftp:max-packets-in-flight","16",	  ResMgr::UNumberValidate,0},
+   {"sftp:max-packets-in-flight","512",	  ResMgr::UNumberValidate,0},
    {"sftp:protocol-version",	 "6",	  ResMgr::UNumberValidate,0},
    {"sftp:size-read",		 "32k",	  ResMgr::UNumberValidate,0},
    {"sftp:size-write",		 "32k",	  ResMgr::UNumberValidate,0},
@@ -393,6 +398,7 @@ static ResType lftp_vars[] = {
    {"xfer:temp-file-name",	 ".in.*", 0,ResMgr::NoClosure},
    {"xfer:timeout",		 "1d",	  ResMgr::TimeIntervalValidate,ResMgr::NoClosure},
    {"xfer:clobber",		 "no",	  ResMgr::BoolValidate,ResMgr::NoClosure},
+   {"xfer:delta",		 "no",	  ResMgr::BoolValidate,ResMgr::NoClosure},
    {"xfer:make-backup",		 "yes",	  ResMgr::BoolValidate,ResMgr::NoClosure},
    {"xfer:keep-backup",		 "no",	  ResMgr::BoolValidate,ResMgr::NoClosure},
    {"xfer:backup-suffix",	 "~%Y%m%d%H%M%S~",0,ResMgr::NoClosure},
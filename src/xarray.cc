@@ -26,11 +26,22 @@ void xarray0::get_space_do(size_t s,size_t g)
    if(!buf)
       buf=xmalloc(element_size*(size=s+keep_extra));
    else if(size<s+keep_extra)
+   {
+      // grow big arrays geometrically to keep appends amortized O(1)
+      if(s<size+size/2 && size>=g*8)
+	 s=size+size/2;
       buf=xrealloc(buf,element_size*(size=(s|(g-1))+keep_extra));
+   }
    else if(size>=g*8 && s+keep_extra<=size/2)
       buf=xrealloc(buf,element_size*(size/=2));
 }
 
+void xarray0::shrink_space()
+{
+   if(buf && size>len+keep_extra)
+      buf=xrealloc(buf,element_size*(size=len+keep_extra));
+}
+
 void xarray0::_nset(const void *s,int len)
 {
    if(!s)
@@ -57,8 +57,11 @@ public:
       if(size<s+keep_extra)
 	 get_space_do(s,g);
    }
+   // frees unused slots
+   void shrink_space();
 
    size_t get_element_size() const { return element_size; }
+   size_t get_allocated_size() const { return size*element_size; }
 
    int length() const { return len; }
    int count()  const { return len; }
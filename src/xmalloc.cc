@@ -21,7 +21,13 @@
 #include "trio.h"
 #include "xmalloc.h"
 
+#ifdef MEM_DEBUG
 static int memory_count=0;
+# define MEMORY_COUNT(n) (memory_count+=(n))
+#else
+// worker threads allocate memory too, don't update shared counters
+# define MEMORY_COUNT(n) ((void)0)
+#endif
 
 static void memory_error_and_abort(const char *fname,size_t size)
 {
@@ -37,7 +43,7 @@ void *xmalloc (size_t bytes)
    void *temp=(void*)malloc(bytes);
    if(temp==0)
       memory_error_and_abort("xmalloc",bytes);
-   memory_count++;
+   MEMORY_COUNT(1);
 #ifdef MEM_DEBUG
    printf("xmalloc %p %lu (count=%d)\n",temp,(long)bytes,memory_count);
 #endif
@@ -51,7 +57,7 @@ void *xrealloc(void *pointer,size_t bytes)
       return 0;
    if(bytes==0)
    {
-      memory_count--;
+      MEMORY_COUNT(-1);
       free(pointer);
       temp=0;
       goto leave;
@@ -59,7 +65,7 @@ void *xrealloc(void *pointer,size_t bytes)
    if(pointer==0)
    {
       temp=(void*)malloc(bytes);
-      memory_count++;
+      MEMORY_COUNT(1);
    }
    else
       temp=(void*)realloc(pointer,bytes);
@@ -79,7 +85,7 @@ void xfree(void *p)
 #ifdef MEM_DEBUG
    printf("xfree %p (count=%d)\n",p,memory_count);
 #endif
-   memory_count--;
+   MEMORY_COUNT(-1);
    free(p);
 }
 
@@ -149,7 +155,7 @@ void xmalloc_register_block(void *b)
 {
    if(!b)
       return;
-   memory_count++;
+   MEMORY_COUNT(1);
 #ifdef MEM_DEBUG
    printf("xmalloc %p (count=%d)\n",b,memory_count);
 #endif
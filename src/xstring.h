@@ -195,6 +195,8 @@ public:
    void add_commit(int new_len) { len+=new_len; }
 
    size_t length() const { return len; }
+   // the length the string can grow to without reallocation
+   size_t capacity() const { return size?size-1:0; }
 
    xstring& set(const xstring &s) { return nset(s,s.length()); }
    xstring& set(const char *s);
@@ -0,0 +1,24 @@
+/*
+	Timing and report helpers shared by the *-bench programs.
+*/
+
+#ifndef BENCH_H
+#define BENCH_H
+
+#include <stdio.h>
+#include <sys/time.h>
+
+static inline double now_sec()
+{
+   struct timeval tv;
+   gettimeofday(&tv,0);
+   return tv.tv_sec+tv.tv_usec/1e6;
+}
+
+// one line per measurement: what was run, on how many items, how long.
+static inline void report(const char *name,int count,const char *items,double t)
+{
+   printf("%-20s %8d %-6s %10.3f ms\n",name,count,items,t*1000);
+}
+
+#endif // BENCH_H
@@ -0,0 +1,89 @@
+/*
+	This benchmark measures how many bytes Buffer copies internally
+	(memcpy, memmove, realloc) per transferred byte. Build it with
+	`make buffer-bench'.
+*/
+
+#include <config.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include "buffer.h"
+#include "bench.h"
+
+static void report_copied(const char *name,long long total,unsigned long long copied,double t)
+{
+   printf("%-10s %8.2f %12.1f\n",name,(double)copied/total,total/t/(1<<20));
+}
+
+// data read from a socket in pieces of random size and moved to
+// another buffer, which is consumed slowly (like FileCopy does).
+static void bench_get(long long total)
+{
+   Buffer in,out;
+   unsigned long long copied0=Buffer::CopiedBytes();
+   double start=now_sec();
+   long long done=0;
+   while(done<total)
+   {
+      int n=1+rand()%0x10000;
+      memset(in.GetSpace(0x10000),'x',n);
+      in.SpaceAdd(n);
+      out.SpaceAdd(out.MoveDataHere(&in,in.Size()>0x20000?in.Size():1+rand()%0x10000));
+      int s=out.Size();
+      if(s>0x20000 || (s>0 && rand()%2))
+      {
+	 s=1+rand()%s;
+	 out.Skip(s);
+	 done+=s;
+      }
+   }
+   report_copied("get",done,Buffer::CopiedBytes()-copied0,now_sec()-start);
+}
+
+// data put to a socket buffer faster than the peer reads them.
+static void bench_put(long long total)
+{
+   int sv[2];
+   if(socketpair(AF_UNIX,SOCK_STREAM,0,sv)==-1)
+   {
+      perror("socketpair");
+      exit(1);
+   }
+   fcntl(sv[0],F_SETFL,O_NONBLOCK);
+   fcntl(sv[1],F_SETFL,O_NONBLOCK);
+   SMTaskRef<IOBufferFDStream> b(new IOBufferFDStream(new FDStream(sv[0],"sock"),IOBuffer::PUT));
+   static char chunk[0x8000];
+   static char sink[0x10000];
+   memset(chunk,'x',sizeof(chunk));
+   unsigned long long copied0=Buffer::CopiedBytes();
+   double start=now_sec();
+   long long done=0;
+   while(done<total)
+   {
+      if(b->Size()<0x40000)
+	 b->Put(chunk,sizeof(chunk));
+      SMTask::Schedule();
+      SMTask::Timeout(0);  // just poll the descriptors
+      SMTask::Block();
+      int r=read(sv[1],sink,1+rand()%sizeof(sink));
+      if(r>0)
+	 done+=r;
+   }
+   report_copied("put",done,Buffer::CopiedBytes()-copied0,now_sec()-start);
+   close(sv[1]);
+}
+
+int main(int argc,char **argv)
+{
+   signal(SIGPIPE,SIG_IGN);
+   long long total=(argc>1?atoll(argv[1]):1024)<<20;
+   printf("%-10s %8s %12s\n","test","copy/byte","MB/s");
+   bench_get(total);
+   bench_put(total);
+   return 0;
+}
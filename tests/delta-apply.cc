@@ -0,0 +1,152 @@
+/*
+	This test encodes a delta of a target against a basis file with
+	DeltaEncoder and applies it to the basis in place with
+	FileCopyPeerDeltaPut, then compares the result with the target.
+*/
+
+#include <config.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include "DeltaSum.h"
+#include "FileCopy.h"
+#include "log.h"
+
+char *program_name;
+
+static const char tmp_file[]="delta-apply.tmp";
+enum { BS=64 };
+
+static unsigned seed=1;
+static void random_data(xstring& s,int len)
+{
+   for(int i=0; i<len; i++)
+   {
+      seed=seed*1103515245+12345;
+      s.append(char(seed>>16));
+   }
+}
+
+static bool write_file(const xstring& data)
+{
+   int fd=open(tmp_file,O_WRONLY|O_CREAT|O_TRUNC,0600);
+   if(fd==-1)
+      return false;
+   bool ok=(write(fd,data.get(),data.length())==(int)data.length());
+   close(fd);
+   return ok;
+}
+static bool read_file(xstring& data)
+{
+   int fd=open(tmp_file,O_RDONLY);
+   if(fd==-1)
+      return false;
+   char buf[0x1000];
+   int res;
+   while((res=read(fd,buf,sizeof(buf)))>0)
+      data.append(buf,res);
+   close(fd);
+   return res==0;
+}
+
+static bool round_trip(const char *name,const xstring& basis,const xstring& target)
+{
+   if(!write_file(basis))
+   {
+      perror(tmp_file);
+      return false;
+   }
+
+   DeltaSignature sig(BS);
+   for(int o=0; o+BS<=(int)basis.length(); o+=BS)
+      sig.AddBlock(basis.get()+o,BS);
+   sig.Index();
+
+   // feed the encoder in pieces not aligned to the blocks.
+   DeltaEncoder enc(&sig);
+   xstring delta;
+   for(int o=0; o<(int)target.length(); o+=100)
+   {
+      int len=target.length()-o;
+      enc.Put(target.get()+o,len<100?len:100,delta);
+   }
+   enc.PutEOF(delta);
+
+   SMTaskRef<FileCopyPeerDeltaPut> put(new FileCopyPeerDeltaPut(tmp_file));
+   put->DontCopyDate();
+   put->Resume(); // peers start suspended
+   put->Put(delta);
+   put->PutEOF();
+   while(!put->Done())
+   {
+      SMTask::Schedule();
+      SMTask::Block();
+   }
+   if(put->Error())
+   {
+      fprintf(stderr,"%s: %s\n",name,put->ErrorText());
+      return false;
+   }
+
+   xstring result;
+   if(!read_file(result))
+   {
+      perror(tmp_file);
+      return false;
+   }
+   if(result.length()!=target.length()
+   || (target.length()>0 && memcmp(result.get(),target.get(),target.length())))
+   {
+      fprintf(stderr,"%s: result differs from the target (%d bytes, expected %d)\n",
+	 name,(int)result.length(),(int)target.length());
+      return false;
+   }
+   printf("%s: ok, delta %d bytes for %d\n",name,(int)delta.length(),(int)target.length());
+   return true;
+}
+
+int main(int argc,char **argv)
+{
+   program_name=argv[0];
+   Log::global=new Log("debug");
+
+   xstring basis;
+   random_data(basis,BS*100+17);
+   int len=basis.length();
+   int failed=0;
+
+   failed+=!round_trip("same",basis,basis);
+
+   xstring t;
+   t.nset(basis,len/2).append("inserted data");
+   random_data(t,BS*3);
+   t.append(basis.get()+len/2,len-len/2);
+   failed+=!round_trip("insertion",basis,t);
+
+   t.nset(basis,BS*10+5).append(basis.get()+BS*30,len-BS*30);
+   failed+=!round_trip("deletion",basis,t);
+
+   // the halves swapped, and a block repeated several times.
+   t.nset(basis.get()+len/2,len-len/2).append(basis,len/2);
+   for(int i=0; i<5; i++)
+      t.append(basis.get()+BS*7,BS);
+   failed+=!round_trip("moved",basis,t);
+
+   t.nset(basis.get()+BS*50+3,BS*20);
+   failed+=!round_trip("shorter",basis,t);
+
+   t.set(basis);
+   random_data(t,BS*50+1);
+   t.append(basis);
+   failed+=!round_trip("longer",basis,t);
+
+   t.truncate(0);
+   failed+=!round_trip("empty target",basis,t);
+   t.nset(basis,BS*3);
+   failed+=!round_trip("empty basis",xstring::null,t);
+
+   unlink(tmp_file);
+   return failed?1:0;
+}
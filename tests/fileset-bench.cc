@@ -0,0 +1,70 @@
+/*
+	This benchmark measures FileSet set operations used by mirror to
+	compare directory listings, on synthetic sets of 1M entries by
+	default. Build it with `make fileset-bench'.
+*/
+
+#include <config.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "FileSet.h"
+#include "bench.h"
+
+// every step-th name from n names; sizes differ for every 7th file
+static FileSet *make_set(int n,int step,int size_salt)
+{
+   FileSet *set=new FileSet;
+   char name[32];
+   for(int i=0; i<n; i+=step)
+   {
+      snprintf(name,sizeof(name),"file%08d",i);
+      FileInfo *fi=new FileInfo(name);
+      fi->SetType(i%100==0?FileInfo::DIRECTORY:FileInfo::NORMAL);
+      fi->SetSize(i%7==0?i+size_salt:i);
+      fi->SetDate(1000000000+i,0);
+      set->Add(fi);
+   }
+   return set;
+}
+
+static void bench(const char *name,void (*op)(FileSet *,const FileSet *),int n)
+{
+   FileSet *a=make_set(n,1,0);
+   FileSet *b=make_set(n,2,1);
+   double start=now_sec();
+   op(a,b);
+   double t=now_sec()-start;
+   report(name,a->count(),"left",t);
+   delete a;
+   delete b;
+}
+
+static void memory(int n)
+{
+   FileSet *a=make_set(n,1,0);
+   printf("%-20s %8d files %10.1f MB\n","FileSet",a->count(),a->EstimateMemory()/1048576.0);
+   PackedFileSet *p=new PackedFileSet(a);
+   printf("%-20s %8d files %10.1f MB\n","PackedFileSet",p->count(),p->EstimateMemory()/1048576.0);
+   delete p;
+   delete a;
+}
+
+static void op_same(FileSet *a,const FileSet *b) { a->SubtractSame(b,0); }
+static void op_any(FileSet *a,const FileSet *b) { a->SubtractAny(b); }
+static void op_not_in(FileSet *a,const FileSet *b) { a->SubtractNotIn(b); }
+static void op_same_type(FileSet *a,const FileSet *b) { a->SubtractSameType(b); }
+static void op_dirs(FileSet *a,const FileSet *) { a->SubtractDirs(); }
+static void op_not_dirs(FileSet *a,const FileSet *) { a->SubtractNotDirs(); }
+
+int main(int argc,char **argv)
+{
+   int n=(argc>1?atoi(argv[1]):1000000);
+   bench("SubtractSame",op_same,n);
+   bench("SubtractAny",op_any,n);
+   bench("SubtractNotIn",op_not_in,n);
+   bench("SubtractSameType",op_same_type,n);
+   bench("SubtractDirs",op_dirs,n);
+   bench("SubtractNotDirs",op_not_dirs,n);
+   memory(n);
+   return 0;
+}
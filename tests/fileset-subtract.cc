@@ -0,0 +1,144 @@
+/*
+	This test checks FileSet::Subtract* against a reference which looks
+	up every file with FindByName, on random sets: plain ones, ones
+	flattened with Sort(BYNAME_FLAT), and a set subtracted from itself.
+	Subtract* walk two sets sorted by name in one merge pass, so this
+	catches the merge going out of step with the lookup.
+*/
+
+#include <config.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "FileSet.h"
+
+static unsigned seed;
+static int random_below(int n)
+{
+   seed=seed*1103515245+12345;
+   return (seed>>8)%n;
+}
+
+// the same seed gives the same set, the copy constructor loses the sort state.
+static FileSet *make_set(unsigned set_seed,bool with_dirs)
+{
+   seed=set_seed;
+   FileSet *set=new FileSet;
+   int n=random_below(40);
+   for(int i=0; i<n; i++)
+   {
+      xstring name;
+      if(with_dirs)
+	 name.appendf("d%d/",random_below(3));
+      name.appendf("f%02d",random_below(60));
+      FileInfo *fi=new FileInfo(name);
+      switch(random_below(3))
+      {
+      case 0: fi->SetType(FileInfo::NORMAL); break;
+      case 1: fi->SetType(FileInfo::DIRECTORY); break;
+      }
+      if(random_below(3))
+	 fi->SetSize(random_below(3));
+      if(random_below(3))
+	 fi->SetDate(1000000000+random_below(3)*100,random_below(2)*30);
+      set->Add(fi);
+   }
+   return set;
+}
+
+struct subtract_op
+{
+   const char *name;
+   void (*op)(FileSet *a,const FileSet *b);
+   bool (*pred)(const FileInfo *f,const FileInfo *o);  // o is b's file or 0
+};
+
+static void op_same(FileSet *a,const FileSet *b) { a->SubtractSame(b,0); }
+static bool pred_same(const FileInfo *f,const FileInfo *o) { return o && f->SameAs(o,0); }
+static void op_any(FileSet *a,const FileSet *b) { a->SubtractAny(b); }
+static bool pred_any(const FileInfo *f,const FileInfo *o) { return o; }
+static void op_not_in(FileSet *a,const FileSet *b) { a->SubtractNotIn(b); }
+static bool pred_not_in(const FileInfo *f,const FileInfo *o) { return !o; }
+static void op_same_type(FileSet *a,const FileSet *b) { a->SubtractSameType(b); }
+static bool pred_same_type(const FileInfo *f,const FileInfo *o) {
+   return o && f->Has(f->TYPE) && o->Has(o->TYPE) && f->filetype==o->filetype;
+}
+static void op_dirs(FileSet *a,const FileSet *b) { a->SubtractDirs(b); }
+static bool pred_dirs(const FileInfo *f,const FileInfo *o) {
+   return o && f->TypeIs(f->DIRECTORY) && o->TypeIs(o->DIRECTORY);
+}
+static void op_not_older_dirs(FileSet *a,const FileSet *b) { a->SubtractNotOlderDirs(b); }
+static bool pred_not_older_dirs(const FileInfo *f,const FileInfo *o) {
+   return o && f->TypeIs(f->DIRECTORY) && f->Has(f->DATE)
+      && o->TypeIs(o->DIRECTORY) && o->NotOlderThan(f->date);
+}
+
+static const subtract_op ops[]={
+   { "SubtractSame", op_same, pred_same },
+   { "SubtractAny", op_any, pred_any },
+   { "SubtractNotIn", op_not_in, pred_not_in },
+   { "SubtractSameType", op_same_type, pred_same_type },
+   { "SubtractDirs", op_dirs, pred_dirs },
+   { "SubtractNotOlderDirs", op_not_older_dirs, pred_not_older_dirs },
+};
+
+static void list_names(FileSet *set,xstring& names)
+{
+   names.truncate();
+   set->rewind();
+   for(FileInfo *fi=set->curr(); fi; fi=set->next())
+      names.append(fi->name).append(' ');
+}
+
+static int failed;
+
+static void check(const subtract_op& op,unsigned a_seed,unsigned b_seed,bool flat)
+{
+   bool self=(b_seed==a_seed && !flat);
+   FileSet *a=make_set(a_seed,false);
+   FileSet *b=(self ? a : make_set(b_seed,flat));
+   if(flat)
+      b->Sort(FileSet::BYNAME_FLAT);
+
+   // the reference is computed on an identical set, a changes in place.
+   FileSet *ref=make_set(a_seed,false);
+   FileSet *ref_b=(self ? make_set(a_seed,false) : b);
+   xstring expect;
+   ref->rewind();
+   for(FileInfo *fi=ref->curr(); fi; fi=ref->next())
+      if(!op.pred(fi,ref_b->FindByName(fi->name)))
+	 expect.append(fi->name).append(' ');
+
+   op.op(a,b);
+   xstring result;
+   list_names(a,result);
+   if(!result.eq(expect))
+   {
+      fprintf(stderr,"%s (%s, seeds %u %u): got [%s], expected [%s]\n",
+	 op.name,self?"self":flat?"flat":"plain",a_seed,b_seed,result.get(),expect.get());
+      failed++;
+   }
+
+   if(ref_b!=b)
+      delete ref_b;
+   delete ref;
+   if(b!=a)
+      delete b;
+   delete a;
+}
+
+int main(int argc,char **argv)
+{
+   for(unsigned i=0; i<sizeof(ops)/sizeof(*ops); i++)
+   {
+      for(unsigned s=1; s<=300; s++)
+      {
+	 check(ops[i],s,s+1000,false);
+	 check(ops[i],s,s+2000,true);
+	 check(ops[i],s,s,false);
+      }
+   }
+   if(failed)
+      fprintf(stderr,"%d checks failed\n",failed);
+   return failed?1:0;
+}
@@ -0,0 +1,57 @@
+/*
+	Sample `ls -l' listing lines, shared by ls-parse (check) and
+	lsparse-bench. ftp-list and ftp-cls-l list a live server and have
+	no fixtures of their own.
+
+	The dates use the year form so that they don't depend on the
+	current time; year==0 means the line has an hh:mm time instead.
+*/
+
+#ifndef LS_LINES_H
+#define LS_LINES_H
+
+#include "FileSet.h"
+
+struct ls_line
+{
+   const char *line;
+   int type;		// FileInfo::type, or -1 if the line is rejected
+   int mode;		// -1 if the permissions are not parsed
+   long long size;
+   int year,mon,mday;	// the date at 12:00
+   const char *name;
+   const char *symlink;
+};
+
+static const ls_line ls_lines[]={
+   { "-rwxr-xr-x   1 lav      root         4771 Sep 12  1996 install-sh",
+      FileInfo::NORMAL,0755,4771,1996,8,12,"install-sh",0 },
+   { "drwxr-xr-x   4 lav      root         1024 Feb 22 15:32 lib",
+      FileInfo::DIRECTORY,0755,1024,0,1,22,"lib",0 },
+   { "lrwxrwxrwx   1 lav      root           33 Feb 14 17:45 ltconfig -> /usr/share/libtool/ltconfig",
+      FileInfo::SYMLINK,0777,33,0,1,14,"ltconfig","/usr/share/libtool/ltconfig" },
+   { "-rw-rw-r--+  1 user     group         100 Jan  1  2017 acl file",
+      FileInfo::NORMAL,0664,100,2017,0,1,"acl file",0 },
+   { "-rwsr-sr-t   1 root     root        12345 Mar 31  2016 suid",
+      FileInfo::NORMAL,07755,12345,2016,2,31,"suid",0 },
+   { "-rwSr-Sr-T   1 root     root            0 Oct 30  2016 no-exec",
+      FileInfo::NORMAL,07644,0,2016,9,30,"no-exec",0 },
+   { "-rw-r--rwl   1 root     root           10 Mar 27  2016 mandatory-lock",
+      FileInfo::NORMAL,02646,10,2016,2,27,"mandatory-lock",0 },
+   { "drwxrwxrwt  12 root     root         4096 Dec 31  1999 tmp",
+      FileInfo::DIRECTORY,01777,4096,1999,11,31,"tmp",0 },
+   { "-rw-r--r--   1 user           2048 Jul  4  2010 no group",
+      FileInfo::NORMAL,0644,2048,2010,6,4,"no group",0 },
+   { "-rw-r--r--   1 user     group    5000000000 Nov  6 09:15 big",
+      FileInfo::NORMAL,0644,5000000000LL,0,10,6,"big",0 },
+   { "-rwxrwxrwxx  1 user     group           1 Jan  1  2000 bad-perms",
+      FileInfo::NORMAL,-1,1,2000,0,1,"bad-perms",0 },
+   { "lrwxrwxrwx   1 user     group           9 Aug  1  2015 a -> b -> c",
+      FileInfo::SYMLINK,0777,9,2015,7,1,"a","b -> c" },
+   { "brw-rw----   1 root     disk       8,   0 Jan  1  2017 sda",
+      -1,0,0,0,0,0,0,0 },
+   { "total 12",
+      -1,0,0,0,0,0,0,0 },
+};
+
+#endif // LS_LINES_H
@@ -0,0 +1,293 @@
+/*
+	This test checks the ls-style listing parser: parse_ls_line on the
+	lines from ls-lines.h, parse_perms and parse_month on valid and
+	invalid fields, and mktime_from_utc and mktime_from_tz against libc
+	timegm and mktime with TZ set, over DST changes and out of range
+	struct tm fields.
+*/
+
+#include <config.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/stat.h>
+#include "FileSet.h"
+#include "misc.h"
+#include "SMTask.h"
+#include "ls-lines.h"
+
+static int failed;
+
+static void check_ls_lines()
+{
+   for(unsigned i=0; i<sizeof(ls_lines)/sizeof(*ls_lines); i++)
+   {
+      const ls_line& e=ls_lines[i];
+      FileInfo *fi=FileInfo::parse_ls_line(e.line,strlen(e.line),"GMT");
+      xstring err;
+      if(e.type==-1)
+      {
+	 if(fi)
+	    err.append("accepted ");
+      }
+      else if(!fi)
+	 err.append("rejected ");
+      else
+      {
+	 if(!fi->TypeIs((FileInfo::type)e.type))
+	    err.append("type ");
+	 if(e.mode==-1 ? fi->Has(fi->MODE) : !fi->Has(fi->MODE) || fi->mode!=(mode_t)e.mode)
+	    err.append("mode ");
+	 if(!fi->Has(fi->SIZE) || fi->size!=e.size)
+	    err.append("size ");
+	 if(strcmp(fi->name,e.name))
+	    err.append("name ");
+	 if(xstrcmp(fi->symlink,e.symlink))
+	    err.append("symlink ");
+	 struct tm tm;
+	 memset(&tm,0,sizeof(tm));
+	 time_t date=fi->date;
+	 gmtime_r(&date,&tm);
+	 if(tm.tm_mon!=e.mon || tm.tm_mday!=e.mday
+	 || (e.year && (tm.tm_year+1900!=e.year || tm.tm_hour!=12 || tm.tm_min!=0)))
+	    err.append("date ");
+      }
+      delete fi;
+      if(err)
+      {
+	 fprintf(stderr,"parse_ls_line: wrong %sfor `%s'\n",err.get(),e.line);
+	 failed++;
+      }
+   }
+}
+
+static void check_perms(const char *s,int expect)
+{
+   int p=parse_perms(s);
+   if(p!=expect)
+   {
+      fprintf(stderr,"parse_perms(\"%s\")=%#o, expected %#o\n",s,p,expect);
+      failed++;
+   }
+}
+
+static void check_month(const char *s,int expect)
+{
+   int m=parse_month(s);
+   if(m!=expect)
+   {
+      fprintf(stderr,"parse_month(\"%s\")=%d, expected %d\n",s,m,expect);
+      failed++;
+   }
+}
+
+static void check_fields()
+{
+   check_perms("rwxr-xr-x",0755);
+   check_perms("---------",0);
+   check_perms("rw-rw-r--+",0664);
+   check_perms("rwsr-xr-x",04755);
+   check_perms("rwSr--r--",04644);
+   check_perms("rwxr-sr-x",02755);
+   check_perms("rwxr-Sr-x",02745);
+   check_perms("rwxrwxrwt",01777);
+   check_perms("rwxrwxrwT",01776);
+   check_perms("rwxrwxrwl",02766);
+   check_perms("rwxrwxrwL",02766);
+   check_perms("rwsrwsrwt+",07777);
+   check_perms("rwlrwxrwx",-1);	// l is only valid in the other triplet
+   check_perms("rwxrwlrwx",-1);
+   check_perms("rwtrwxrwx",-1);	// t is only valid in the other triplet
+   check_perms("rwxrwxrws",-1);	// s is not valid in the other triplet
+   check_perms("rwxrwxrw",-1);
+   check_perms("rwxrwxrwxx",-1);
+   check_perms("rwxrwxrwx++",-1);
+   check_perms("wrxrwxrwx",-1);
+   check_perms("",-1);
+
+   const char *const upper[12]={"JAN","FEB","MAR","APR","MAY","JUN","JUL","AUG","SEP","OCT","NOV","DEC"};
+   for(int i=0; i<12; i++)
+   {
+      check_month(month_names[i],i);
+      check_month(upper[i],i);
+   }
+   check_month("jAn",0);
+   check_month("",-1);
+   check_month("Ja",-1);
+   check_month("Janu",-1);
+   check_month("Jan ",-1);
+   check_month("Foo",-1);
+}
+
+static unsigned seed=1;
+static int random_in(int from,int to)
+{
+   seed=seed*1103515245+12345;
+   return from+int((seed>>8)%unsigned(to-from+1));
+}
+
+static void check_utc(const struct tm& t)
+{
+   struct tm t1=t;
+   time_t expect=timegm(&t1);
+   time_t res=mktime_from_utc(&t);
+   if(res!=expect)
+   {
+      fprintf(stderr,"mktime_from_utc(%d-%d-%d %d:%d:%d)=%ld, expected %ld\n",
+	 t.tm_year+1900,t.tm_mon+1,t.tm_mday,t.tm_hour,t.tm_min,t.tm_sec,(long)res,(long)expect);
+      failed++;
+   }
+}
+
+static void check_from_utc()
+{
+   struct tm t;
+   memset(&t,0,sizeof(t));
+   // every day of years around 1900, 1970, 2000 and 2100, leap or not.
+   static const int years[]={1899,1900,1904,1969,1970,1999,2000,2016,2017,2100,2104};
+   for(unsigned y=0; y<sizeof(years)/sizeof(*years); y++)
+   {
+      for(int yday=0; yday<366; yday++)
+      {
+	 t.tm_year=years[y]-1900;
+	 t.tm_mon=0;
+	 t.tm_mday=yday+1;
+	 t.tm_hour=yday%24;
+	 t.tm_min=yday%60;
+	 t.tm_sec=yday%61;
+	 check_utc(t);
+      }
+   }
+   // out of range fields, including negative ones.
+   for(int i=0; i<100000; i++)
+   {
+      t.tm_year=random_in(-100,250);
+      t.tm_mon=random_in(-30,40);
+      t.tm_mday=random_in(-40,70);
+      t.tm_hour=random_in(-30,50);
+      t.tm_min=random_in(-70,130);
+      t.tm_sec=random_in(-70,130);
+      check_utc(t);
+   }
+}
+
+/* mktime in the given zone. A local time repeated when DST ends is
+   ambiguous with tm_isdst=-1, and mktime may pick either occurrence,
+   so return the other one in *alt (or -1 when there is none). */
+static time_t mktime_with_tz(const struct tm *t,const char *tz,time_t *alt)
+{
+   xstring_c saved(getenv("TZ"));
+   if(tz && *tz)
+   {
+      xstring tz1;
+      if(strchr("+-0123456789",tz[0]))
+	 tz1.set("GMT");
+      tz1.append(tz);
+      setenv("TZ",tz1,1);
+   }
+   tzset();
+   struct tm t1=*t;
+   time_t res=mktime(&t1);
+   *alt=-1;
+   if(t->tm_isdst==-1)
+   {
+      struct tm std=*t;
+      struct tm dst=*t;
+      std.tm_isdst=0;
+      dst.tm_isdst=1;
+      time_t res_std=mktime(&std);
+      time_t res_dst=mktime(&dst);
+      if(res_std!=res_dst && std.tm_isdst==0 && dst.tm_isdst==1
+      && std.tm_hour==dst.tm_hour && std.tm_mday==dst.tm_mday)
+	 *alt=(res==res_std ? res_dst : res_std);
+   }
+   if(saved)
+      setenv("TZ",saved,1);
+   else
+      unsetenv("TZ");
+   tzset();
+   return res;
+}
+
+static void check_tz(const struct tm& t,const char *tz)
+{
+   struct tm t1=t;
+   time_t alt=-1;
+   time_t expect;
+   if(tz && !strcasecmp(tz,"GMT"))
+      expect=timegm(&t1);  // GMT ignores tm_isdst
+   else
+      expect=mktime_with_tz(&t,tz,&alt);
+   struct tm t2=t;
+   time_t res=mktime_from_tz(&t2,tz);
+   if(res!=expect && res!=alt)
+   {
+      fprintf(stderr,"mktime_from_tz(%d-%d-%d %d:%d:%d isdst=%d,%s)=%ld, expected %ld\n",
+	 t.tm_year+1900,t.tm_mon+1,t.tm_mday,t.tm_hour,t.tm_min,t.tm_sec,t.tm_isdst,
+	 tz?tz:"local",(long)res,(long)expect);
+      failed++;
+   }
+}
+
+static void check_from_tz(const char *tz)
+{
+   struct tm t;
+   memset(&t,0,sizeof(t));
+   // every hour of a year, across the DST changes in both directions.
+   for(int mon=0; mon<12; mon++)
+   {
+      for(int mday=1; mday<=31; mday++)
+      {
+	 for(int hour=0; hour<24; hour++)
+	 {
+	    t.tm_year=2017-1900;
+	    t.tm_mon=mon;
+	    t.tm_mday=mday;
+	    t.tm_hour=hour;
+	    t.tm_min=30;
+	    t.tm_sec=hour;
+	    t.tm_isdst=-1;
+	    check_tz(t,tz);
+	 }
+      }
+   }
+   // out of range fields and explicit isdst.
+   for(int i=0; i<10000; i++)
+   {
+      t.tm_year=random_in(70,130);
+      t.tm_mon=random_in(-3,14);
+      t.tm_mday=random_in(0,33);
+      t.tm_hour=random_in(-1,25);
+      t.tm_min=random_in(-1,61);
+      t.tm_sec=random_in(-1,61);
+      t.tm_isdst=random_in(-3,1);
+      if(t.tm_isdst<-1)
+	 t.tm_isdst=-1;
+      check_tz(t,tz);
+   }
+}
+
+int main(int argc,char **argv)
+{
+   SMTask::UpdateNow();
+   // start with the local zone unset, mktime_from_tz puts its own TZ.
+   unsetenv("TZ");
+   tzset();
+   check_ls_lines();
+   check_fields();
+   check_from_utc();
+   check_from_tz("GMT");
+   check_from_tz("Europe/Berlin");
+   check_from_tz("America/New_York");
+   check_from_tz("+3");
+   check_from_tz("-5");
+   // the local zone comes from TZ; use one with DST in the other half-year.
+   setenv("TZ","Australia/Sydney",1);
+   tzset();
+   check_from_tz(0);
+   check_from_tz("");
+   if(failed)
+      fprintf(stderr,"%d checks failed\n",failed);
+   return failed?1:0;
+}
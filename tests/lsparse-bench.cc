@@ -0,0 +1,82 @@
+/*
+	This benchmark measures parsing of `ls -l' style listing lines, as
+	used by ftp and http directory listings, on 1M lines repeated from
+	ls-lines.h by default. Build it with `make lsparse-bench'.
+*/
+
+#include <config.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "FileSet.h"
+#include "misc.h"
+#include "xstring.h"
+#include "SMTask.h"
+#include "ls-lines.h"
+#include "bench.h"
+
+static const int ls_lines_count=sizeof(ls_lines)/sizeof(*ls_lines);
+
+static void make_lines(xstring& buf,int n)
+{
+   for(int i=0; i<n; i++)
+      buf.append(ls_lines[i%ls_lines_count].line).append('\n');
+}
+
+static void bench_ls_lines(const xstring& buf,const char *tz)
+{
+   double start=now_sec();
+   const char *scan=buf;
+   const char *end=scan+buf.length();
+   int count=0;
+   while(scan<end)
+   {
+      const char *nl=find_char(scan,end-scan,'\n');
+      FileInfo *fi=FileInfo::parse_ls_line(scan,nl-scan,tz);
+      if(fi)
+	 count++;
+      delete fi;
+      scan=nl+1;
+   }
+   double t=now_sec()-start;
+   report(xstring::format("parse_ls_line %s",tz?tz:"local"),count,"parsed",t);
+}
+
+static volatile int sink;  // keeps the parsed values alive
+
+static void bench_fields(int n)
+{
+   // the first field of each line, parse_perms wants it alone.
+   xstring_c perms[ls_lines_count];
+   for(int i=0; i<ls_lines_count; i++)
+   {
+      const char *line=ls_lines[i].line;
+      perms[i].nset(line,strcspn(line," "));
+   }
+   double start=now_sec();
+   int sum=0;
+   for(int i=0; i<n; i++)
+   {
+      sum+=parse_perms(perms[i%ls_lines_count]+1);
+      sum+=parse_month(month_names[i%12]);
+      int year,hour,minute;
+      if(parse_year_or_time(i&1?"2017":"12:34",&year,&hour,&minute)!=-1)
+	 sum+=year+hour+minute;
+   }
+   double t=now_sec()-start;
+   report("perms/month/time",n,"fields",t);
+   sink=sum;
+}
+
+int main(int argc,char **argv)
+{
+   int n=(argc>1?atoi(argv[1]):1000000);
+   SMTask::UpdateNow();
+   xstring buf;
+   make_lines(buf,n);
+   bench_ls_lines(buf,"GMT");
+   bench_ls_lines(buf,0);
+   bench_ls_lines(buf,"+3");
+   bench_fields(n);
+   return 0;
+}
@@ -0,0 +1,60 @@
+/*
+	This benchmark compares lftp_sha1_buffer with gnulib's sha1_buffer
+	on torrent piece sizes. Build it with `make sha1-bench'.
+*/
+
+#include <config.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <sha1.h>
+#include "lftp_sha1.h"
+
+static double now()
+{
+   struct timeval tv;
+   gettimeofday(&tv,0);
+   return tv.tv_sec+tv.tv_usec/1e6;
+}
+
+typedef void *(*sha1_func)(const char *,size_t,void *);
+
+static void *lftp_sha1(const char *buf,size_t len,void *res)
+{
+   lftp_sha1_buffer(buf,len,res);
+   return res;
+}
+
+static double bench(sha1_func f,const char *buf,size_t len,unsigned char *digest)
+{
+   // hash at least 256MB to get stable numbers
+   int rounds=(256<<20)/len;
+   double start=now();
+   for(int i=0; i<rounds; i++)
+      f(buf,len,digest);
+   return (double)rounds*len/(now()-start)/(1<<20);
+}
+
+int main(int argc,char **argv)
+{
+   const size_t max_size=16<<20;
+   char *buf=(char*)malloc(max_size);
+   for(size_t i=0; i<max_size; i++)
+      buf[i]=rand();
+
+   printf("implementation: %s\n",lftp_sha1_impl());
+   printf("%10s %12s %12s\n","size","gnulib MB/s","lftp MB/s");
+   for(size_t size=256<<10; size<=max_size; size*=4) {
+      unsigned char d1[SHA1_DIGEST_SIZE],d2[SHA1_DIGEST_SIZE];
+      double r1=bench(sha1_buffer,buf,size,d1);
+      double r2=bench(lftp_sha1,buf,size,d2);
+      if(memcmp(d1,d2,SHA1_DIGEST_SIZE)) {
+	 fprintf(stderr,"digest mismatch for size %lu\n",(unsigned long)size);
+	 return 1;
+      }
+      printf("%9luK %12.1f %12.1f\n",(unsigned long)(size>>10),r1,r2);
+   }
+   free(buf);
+   return 0;
+}
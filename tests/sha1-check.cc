@@ -0,0 +1,67 @@
+/*
+	This test compares lftp_sha1_buffer, which uses the CPU SHA
+	instructions when available, with gnulib's sha1_buffer over many
+	lengths (around the 64-byte block and padding boundaries) and
+	buffer alignments.
+*/
+
+#include <config.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sha1.h>
+#include "lftp_sha1.h"
+
+static int failed;
+
+static void check(const char *buf,size_t len)
+{
+   unsigned char expect[SHA1_DIGEST_SIZE],res[SHA1_DIGEST_SIZE];
+   sha1_buffer(buf,len,expect);
+   lftp_sha1_buffer(buf,len,res);
+   if(memcmp(expect,res,SHA1_DIGEST_SIZE))
+   {
+      fprintf(stderr,"digest mismatch for length %lu at alignment %lu\n",
+	 (unsigned long)len,(unsigned long)((size_t)buf&15));
+      failed++;
+   }
+}
+
+int main(int argc,char **argv)
+{
+   printf("implementation: %s\n",lftp_sha1_impl());
+
+   // a known digest first, in case both implementations are wrong.
+   static const unsigned char abc_sha1[SHA1_DIGEST_SIZE]={
+      0xa9,0x99,0x3e,0x36,0x47,0x06,0x81,0x6a,0xba,0x3e,
+      0x25,0x71,0x78,0x50,0xc2,0x6c,0x9c,0xd0,0xd8,0x9d,
+   };
+   unsigned char res[SHA1_DIGEST_SIZE];
+   lftp_sha1_buffer("abc",3,res);
+   if(memcmp(res,abc_sha1,SHA1_DIGEST_SIZE))
+   {
+      fprintf(stderr,"wrong digest of \"abc\"\n");
+      failed++;
+   }
+
+   const size_t max_len=0x10000+200;
+   char *data=(char*)malloc(max_len+16);
+   unsigned seed=1;
+   for(size_t i=0; i<max_len+16; i++)
+   {
+      seed=seed*1103515245+12345;
+      data[i]=char(seed>>16);
+   }
+   for(int align=0; align<16; align++)
+   {
+      for(size_t len=0; len<=300; len++)
+	 check(data+align,len);
+      for(size_t len=0x10000-70; len<=max_len; len+=7)
+	 check(data+align,len);
+   }
+   free(data);
+
+   if(failed)
+      fprintf(stderr,"%d checks failed\n",failed);
+   return failed?1:0;
+}